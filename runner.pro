@@ -28,21 +28,62 @@ HEADERS += \
         runner/FeatureWriterFactory.h  \
         runner/DefaultFeatureWriter.h \
         runner/FeatureExtractionManager.h \
+        runner/BufferingFeatureWriter.h \
+        runner/ExtractionWorkerPool.h \
+        runner/ExtractionTaskScheduler.h \
+        runner/ExtractionProcessPool.h \
+        runner/SourceManifest.h \
+        runner/SourceQueue.h \
+        runner/SourceFinder.h \
+        runner/SourcePrefetcher.h \
+        runner/MemoryBudget.h \
+        runner/DecodedAudioBuffer.h \
+        runner/TaskPool.h \
+        runner/BoundedQueue.h \
         runner/JAMSFeatureWriter.h \
         runner/LabFeatureWriter.h \
         runner/MIDIFeatureWriter.h \
-        runner/MultiplexedReader.h
+        runner/MultiplexedReader.h \
+        runner/ReadAheadBuffer.h \
+        runner/StreamingAudioFileReader.h \
+        runner/DeinterleavingReader.h \
+        runner/MappedAudioFileReader.h \
+        runner/PipeAudioFileReader.h \
+        runner/DecodeCache.h \
+        runner/DecodeMemoryPolicy.h \
+        runner/InMemoryAudioFileReader.h \
+        runner/AudioFileProbe.h
 
 SOURCES += \
 	runner/main.cpp \
 	runner/DefaultFeatureWriter.cpp \
 	runner/FeatureExtractionManager.cpp \
+        runner/BufferingFeatureWriter.cpp \
+        runner/ExtractionWorkerPool.cpp \
+        runner/ExtractionTaskScheduler.cpp \
+        runner/ExtractionProcessPool.cpp \
+        runner/SourceManifest.cpp \
+        runner/SourceQueue.cpp \
+        runner/SourceFinder.cpp \
+        runner/SourcePrefetcher.cpp \
+        runner/MemoryBudget.cpp \
+        runner/DecodedAudioBuffer.cpp \
+        runner/TaskPool.cpp \
         runner/AudioDBFeatureWriter.cpp \
         runner/FeatureWriterFactory.cpp \
         runner/JAMSFeatureWriter.cpp \
         runner/LabFeatureWriter.cpp \
         runner/MIDIFeatureWriter.cpp \
-        runner/MultiplexedReader.cpp
+        runner/MultiplexedReader.cpp \
+        runner/ReadAheadBuffer.cpp \
+        runner/StreamingAudioFileReader.cpp \
+        runner/DeinterleavingReader.cpp \
+        runner/MappedAudioFileReader.cpp \
+        runner/PipeAudioFileReader.cpp \
+        runner/DecodeCache.cpp \
+        runner/DecodeMemoryPolicy.cpp \
+        runner/InMemoryAudioFileReader.cpp \
+        runner/AudioFileProbe.cpp
 
 !win32 {
     QMAKE_POST_LINK=/bin/bash tests/test.sh
@@ -0,0 +1,69 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AudioFileProbe.h"
+#include "MappedAudioFileReader.h"
+
+#include "base/Debug.h"
+
+#include <bqaudiostream/AudioReadStream.h>
+#include <bqaudiostream/AudioReadStreamFactory.h>
+
+#include <memory>
+
+using namespace std;
+
+bool
+AudioFileProbe::probe(FileSource source, Info &info)
+{
+    if (!source.isAvailable()) {
+        return false;
+    }
+    source.waitForData();
+
+    // Uncompressed files we can read ourselves. This maps the file,
+    // but reads only the headers.
+    unique_ptr<MappedAudioFileReader> mapped
+        (MappedAudioFileReader::create(source, 0));
+    if (mapped) {
+        info.channels = mapped->getChannelCount();
+        info.sampleRate = mapped->getNativeRate();
+        info.frameCount = mapped->getFrameCount();
+        return true;
+    }
+
+    // Anything else, try opening a stream, which reads the headers
+    // but decodes nothing until asked
+    QString path = source.getLocalFilename();
+    unique_ptr<breakfastquay::AudioReadStream> stream;
+    try {
+        stream.reset(breakfastquay::AudioReadStreamFactory::createReadStream
+                     (path.toLocal8Bit().data()));
+    } catch (const std::exception &e) {
+        SVDEBUG << "AudioFileProbe: no stream for \"" << path
+                << "\": " << e.what() << endl;
+        return false;
+    }
+
+    if (!stream || !stream->isOK() ||
+        stream->getChannelCount() == 0 || stream->getSampleRate() == 0) {
+        return false;
+    }
+
+    info.channels = int(stream->getChannelCount());
+    info.sampleRate = sv_samplerate_t(stream->getSampleRate());
+    info.frameCount = sv_frame_t(stream->getEstimatedFrameCount());
+    return true;
+}
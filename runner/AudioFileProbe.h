@@ -0,0 +1,44 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _AUDIO_FILE_PROBE_H_
+#define _AUDIO_FILE_PROBE_H_
+
+#include "data/fileio/FileSource.h"
+#include "base/BaseTypes.h"
+
+/**
+ * Find out the channel count, sample rate and length of an audio
+ * file from its headers, without decoding any of its audio. This is
+ * much quicker than opening an AudioFileReader, which for most
+ * compressed formats decodes the whole file before returning.
+ */
+class AudioFileProbe
+{
+public:
+    struct Info {
+        Info() : channels(0), sampleRate(0), frameCount(0) { }
+        int channels;
+        sv_samplerate_t sampleRate;
+        sv_frame_t frameCount; // 0 if it can't be found from the headers
+    };
+
+    // Return true and fill in info if the file's headers could be
+    // read. Return false if not, which doesn't mean the file can't
+    // be read by other means.
+    static bool probe(FileSource source, Info &info);
+};
+
+#endif
@@ -0,0 +1,89 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _BOUNDED_QUEUE_H_
+#define _BOUNDED_QUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * A first-in first-out queue for handing items from one thread to
+ * another, holding no more than a fixed number of items at once. A
+ * producer that gets too far ahead of its consumer blocks in push()
+ * until there is room again.
+ *
+ * Either side may close() the queue. After that, push() refuses new
+ * items and pop() returns whatever remains and then reports the
+ * queue as finished, so neither side can be left waiting forever
+ * when the other one stops early.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(int capacity) :
+        m_capacity(capacity < 1 ? 1 : capacity),
+        m_closed(false) { }
+
+    // Add an item, waiting for space if the queue is full. Return
+    // false (and discard the item) if the queue has been closed.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this]() {
+                return m_closed || int(m_items.size()) < m_capacity;
+            });
+        if (m_closed) return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Remove the oldest item into item, waiting for one to arrive if
+    // the queue is empty. Return false if the queue has been closed
+    // and there is nothing left in it.
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this]() {
+                return m_closed || !m_items.empty();
+            });
+        if (m_items.empty()) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+
+private:
+    int m_capacity;
+    bool m_closed;
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+
+    BoundedQueue(const BoundedQueue &) =delete;
+    BoundedQueue &operator=(const BoundedQueue &) =delete;
+};
+
+#endif
@@ -0,0 +1,138 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BufferingFeatureWriter.h"
+
+using Vamp::Plugin;
+
+BufferingFeatureWriter::BufferingFeatureWriter(FeatureWriter *target) :
+    m_target(target),
+    m_recording(new Recording)
+{
+}
+
+BufferingFeatureWriter::~BufferingFeatureWriter()
+{
+}
+
+string
+BufferingFeatureWriter::getDescription() const
+{
+    return m_target->getDescription();
+}
+
+QString
+BufferingFeatureWriter::getWriterTag() const
+{
+    return m_target->getWriterTag();
+}
+
+void
+BufferingFeatureWriter::setTrackMetadata(QString trackId,
+                                         TrackMetadata metadata)
+{
+    Recording::Event e;
+    e.type = Recording::TrackMetadataEvent;
+    e.trackId = trackId;
+    e.metadata = metadata;
+    e.output = 0;
+    m_recording->m_events.push_back(e);
+}
+
+void
+BufferingFeatureWriter::testOutputFile(QString trackId,
+                                       TransformId transformId)
+{
+    Recording::Event e;
+    e.type = Recording::TestOutputFileEvent;
+    e.trackId = trackId;
+    e.transformId = transformId;
+    e.output = 0;
+    m_recording->m_events.push_back(e);
+}
+
+void
+BufferingFeatureWriter::write(QString trackId,
+                              const Transform &transform,
+                              const Plugin::OutputDescriptor &output,
+                              const Plugin::FeatureList &features,
+                              std::string summaryType)
+{
+    Recording::OutputMap &outputs = m_recording->m_outputs;
+    Recording::OutputMap::iterator i = outputs.find(transform);
+    if (i == outputs.end()) {
+        i = outputs.insert(Recording::OutputMap::value_type
+                           (transform, output)).first;
+    }
+
+    Recording::Event e;
+    e.type = Recording::WriteEvent;
+    e.trackId = trackId;
+    e.output = &(*i);
+    e.features = features;
+    e.summaryType = summaryType;
+    m_recording->m_events.push_back(e);
+}
+
+void
+BufferingFeatureWriter::flush()
+{
+    Recording::Event e;
+    e.type = Recording::FlushEvent;
+    e.output = 0;
+    m_recording->m_events.push_back(e);
+}
+
+void
+BufferingFeatureWriter::finish()
+{
+    Recording::Event e;
+    e.type = Recording::FinishEvent;
+    e.output = 0;
+    m_recording->m_events.push_back(e);
+}
+
+std::shared_ptr<BufferingFeatureWriter::Recording>
+BufferingFeatureWriter::takeRecording()
+{
+    std::shared_ptr<Recording> r(new Recording);
+    std::swap(r, m_recording);
+    return r;
+}
+
+void
+BufferingFeatureWriter::Recording::replay(FeatureWriter *writer) const
+{
+    for (const Event &e: m_events) {
+        switch (e.type) {
+        case TrackMetadataEvent:
+            writer->setTrackMetadata(e.trackId, e.metadata);
+            break;
+        case TestOutputFileEvent:
+            writer->testOutputFile(e.trackId, e.transformId);
+            break;
+        case WriteEvent:
+            writer->write(e.trackId, e.output->first, e.output->second,
+                          e.features, e.summaryType);
+            break;
+        case FlushEvent:
+            writer->flush();
+            break;
+        case FinishEvent:
+            writer->finish();
+            break;
+        }
+    }
+}
@@ -0,0 +1,110 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _BUFFERING_FEATURE_WRITER_H_
+#define _BUFFERING_FEATURE_WRITER_H_
+
+#include "transform/FeatureWriter.h"
+
+#include <memory>
+
+/**
+ * A FeatureWriter that writes nothing itself, but records the calls
+ * made to it so that they can be replayed later against the "real"
+ * writer it stands in for. This lets a worker thread extract
+ * features for one file without touching the shared writers, which
+ * are not thread-safe and which may need their input files in a
+ * particular order (e.g. JAMS or RDF written to a single file).
+ *
+ * setNofM is not recorded: it's called by whoever decides the order
+ * in which recordings are replayed, on the target writer directly.
+ */
+class BufferingFeatureWriter : public FeatureWriter
+{
+public:
+    BufferingFeatureWriter(FeatureWriter *target);
+    virtual ~BufferingFeatureWriter();
+
+    FeatureWriter *getTarget() const { return m_target; }
+
+    virtual string getDescription() const;
+
+    virtual void setTrackMetadata(QString trackid, TrackMetadata metadata);
+
+    virtual void testOutputFile(QString trackId, TransformId transformId);
+
+    virtual void write(QString trackid,
+                       const Transform &transform,
+                       const Vamp::Plugin::OutputDescriptor &output,
+                       const Vamp::Plugin::FeatureList &features,
+                       std::string summaryType = "");
+
+    virtual void flush();
+    virtual void finish();
+
+    virtual QString getWriterTag() const;
+
+    class Recording
+    {
+    public:
+        bool empty() const { return m_events.empty(); }
+
+        // Apply the recorded calls, in order, to the given
+        // writer. May throw anything the writer itself throws.
+        void replay(FeatureWriter *writer) const;
+
+    private:
+        friend class BufferingFeatureWriter;
+
+        enum EventType {
+            TrackMetadataEvent,
+            TestOutputFileEvent,
+            WriteEvent,
+            FlushEvent,
+            FinishEvent
+        };
+
+        // We write many small feature lists for each transform, so
+        // rather than copy the transform and output descriptor into
+        // every event, we keep one copy of each per recording and
+        // point at that
+        typedef map<Transform, Vamp::Plugin::OutputDescriptor> OutputMap;
+        OutputMap m_outputs;
+
+        struct Event {
+            EventType type;
+            QString trackId;
+            TrackMetadata metadata;
+            TransformId transformId;
+            const OutputMap::value_type *output;
+            Vamp::Plugin::FeatureList features;
+            std::string summaryType;
+        };
+        vector<Event> m_events;
+    };
+
+    // Return everything recorded since the last call, leaving this
+    // writer empty and ready to record the next file
+    std::shared_ptr<Recording> takeRecording();
+
+private:
+    FeatureWriter *m_target;
+    std::shared_ptr<Recording> m_recording;
+
+    BufferingFeatureWriter(const BufferingFeatureWriter &) =delete;
+    BufferingFeatureWriter &operator=(const BufferingFeatureWriter &) =delete;
+};
+
+#endif
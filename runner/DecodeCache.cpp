@@ -0,0 +1,399 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DecodeCache.h"
+#include "MappedAudioFileReader.h"
+
+#include "data/fileio/AudioFileReader.h"
+#include "data/fileio/FileSource.h"
+#include "base/Debug.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+#include <QtEndian>
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+// Frames to copy from a reader into a new entry at a time
+static const sv_frame_t storeChunk = 65536;
+
+static QString
+sha1(QByteArray data)
+{
+    return QString::fromLatin1
+        (QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+}
+
+static void
+append32(QByteArray &b, quint32 v)
+{
+    v = qToLittleEndian(v);
+    b.append(reinterpret_cast<const char *>(&v), 4);
+}
+
+static void
+append16(QByteArray &b, quint16 v)
+{
+    v = qToLittleEndian(v);
+    b.append(reinterpret_cast<const char *>(&v), 2);
+}
+
+static void
+appendChunk(QByteArray &b, const char *id, QByteArray body)
+{
+    b.append(id, 4);
+    append32(b, quint32(body.size()));
+    b.append(body);
+    if (body.size() & 1) b.append('\0');
+}
+
+DecodeCache::DecodeCache(QString directory, size_t maxBytes) :
+    m_directory(directory),
+    m_maxBytes(maxBytes),
+    m_ok(true)
+{
+    QDir dir;
+    for (QString sub: { "audio", "peaks", "sources" }) {
+        if (!dir.mkpath(m_directory + "/" + sub)) {
+            SVCERR << "ERROR: Failed to create decode cache directory \""
+                   << m_directory + "/" + sub << "\"" << endl;
+            m_ok = false;
+            return;
+        }
+    }
+}
+
+QString
+DecodeCache::getContentHash(QString localFilename)
+{
+    QFileInfo info(localFilename);
+    if (!info.isFile()) {
+        return "";
+    }
+
+    QString stamp = QString("%1\t%2")
+        .arg(info.size())
+        .arg(info.lastModified().toMSecsSinceEpoch());
+
+    QString recordPath = m_directory + "/sources/" +
+        sha1(info.absoluteFilePath().toUtf8());
+
+    QFile record(recordPath);
+    if (record.open(QIODevice::ReadOnly)) {
+        QStringList fields = QString::fromUtf8(record.readAll())
+            .trimmed().split('\t');
+        record.close();
+        if (fields.size() == 3 && fields[0] + "\t" + fields[1] == stamp) {
+            return fields[2];
+        }
+    }
+
+    QFile file(localFilename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return "";
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&file)) {
+        return "";
+    }
+    QString contentHash = QString::fromLatin1(hash.result().toHex());
+
+    QSaveFile saver(recordPath);
+    if (saver.open(QIODevice::WriteOnly)) {
+        saver.write(QString("%1\t%2\n").arg(stamp).arg(contentHash).toUtf8());
+        saver.commit();
+    }
+
+    return contentHash;
+}
+
+QString
+DecodeCache::getEntryPath(QString localFilename, sv_samplerate_t rate,
+                          bool normalised)
+{
+    QString contentHash = getContentHash(localFilename);
+    if (contentHash == "") {
+        return "";
+    }
+
+    QString key = sha1(QString("%1\t%2\t%3")
+                       .arg(contentHash)
+                       .arg(rate, 0, 'f')
+                       .arg(normalised ? "peak" : "none").toUtf8());
+
+    return m_directory + "/audio/" + key + ".wav";
+}
+
+QString
+DecodeCache::getPeakPath(QString localFilename, sv_samplerate_t rate)
+{
+    QString contentHash = getContentHash(localFilename);
+    if (contentHash == "") {
+        return "";
+    }
+
+    QString key = sha1(QString("%1\t%2")
+                       .arg(contentHash)
+                       .arg(rate, 0, 'f').toUtf8());
+
+    return m_directory + "/peaks/" + key;
+}
+
+MappedAudioFileReader *
+DecodeCache::open(QString localFilename, sv_samplerate_t rate,
+                  bool normalised)
+{
+    if (!m_ok) return 0;
+    
+    QString path = getEntryPath(localFilename, rate, normalised);
+    if (path == "" || !QFileInfo(path).exists()) {
+        return 0;
+    }
+
+    MappedAudioFileReader *reader =
+        MappedAudioFileReader::create(FileSource(path), rate);
+    if (!reader) {
+        return 0;
+    }
+
+    // Mark the entry as recently used
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly)) {
+        file.setFileTime(QDateTime::currentDateTimeUtc(),
+                         QFileDevice::FileModificationTime);
+    }
+
+    SVCERR << "Using decoded audio for \"" << localFilename
+           << "\" from cache" << endl;
+    
+    return reader;
+}
+
+bool
+DecodeCache::getPeak(QString localFilename, sv_samplerate_t rate,
+                     float &peak)
+{
+    if (!m_ok || localFilename == "") return false;
+
+    QString path = getPeakPath(localFilename, rate);
+    if (path == "") {
+        return false;
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    bool ok = false;
+    float value = QString::fromUtf8(file.readAll()).trimmed().toFloat(&ok);
+    if (!ok || value < 0.f) {
+        return false;
+    }
+
+    peak = value;
+    return true;
+}
+
+void
+DecodeCache::storePeak(QString localFilename, sv_samplerate_t rate,
+                       float peak)
+{
+    if (!m_ok || localFilename == "") return;
+
+    QString path = getPeakPath(localFilename, rate);
+    if (path == "" || QFileInfo(path).exists()) {
+        return;
+    }
+
+    // Written in full so that the value reads back exactly
+    QSaveFile saver(path);
+    if (saver.open(QIODevice::WriteOnly)) {
+        saver.write(QString("%1\n").arg(double(peak), 0, 'g', 9).toUtf8());
+        saver.commit();
+    }
+
+    SVDEBUG << "DecodeCache: recorded peak " << peak << " for \""
+            << localFilename << "\" at " << rate << "Hz" << endl;
+}
+
+void
+DecodeCache::store(QString localFilename, AudioFileReader *reader,
+                   sv_samplerate_t rate, bool normalised)
+{
+    if (!m_ok || localFilename == "") return;
+
+    // Files that can be read in place gain nothing from an entry
+    if (!normalised) {
+        unique_ptr<MappedAudioFileReader> direct
+            (MappedAudioFileReader::create(FileSource(localFilename), rate));
+        if (direct) return;
+    }
+
+    QString path = getEntryPath(localFilename, rate, normalised);
+    if (path == "" || QFileInfo(path).exists()) {
+        return;
+    }
+
+    float peak = 0.f;
+    if (!writeEntry(path, reader, peak)) {
+        SVCERR << "NOTE: Decoded audio for \"" << localFilename
+               << "\" could not be stored in the cache" << endl;
+        return;
+    }
+
+    // Having read all of it, we can save a later normalising run the
+    // trouble
+    if (!normalised) {
+        storePeak(localFilename, rate, peak);
+    }
+
+    SVDEBUG << "DecodeCache: stored \"" << localFilename
+            << "\" as \"" << path << "\"" << endl;
+    
+    evict(path);
+}
+
+bool
+DecodeCache::writeEntry(QString path, AudioFileReader *reader, float &peak)
+{
+    int channels = reader->getChannelCount();
+    sv_samplerate_t rate = reader->getSampleRate();
+    sv_frame_t frames = reader->getFrameCount();
+
+    // A WAV file's sizes are 32-bit and its sample rate an integer
+    double dataBytes = double(frames) * channels * sizeof(float);
+    if (channels < 1 || frames < 1 || dataBytes > 4.0e9 ||
+        rate != floor(rate)) {
+        return false;
+    }
+
+    QByteArray header;
+
+    QByteArray format;
+    append16(format, 3); // IEEE float
+    append16(format, quint16(channels));
+    append32(format, quint32(rate));
+    append32(format, quint32(rate) * channels * sizeof(float));
+    append16(format, quint16(channels * sizeof(float)));
+    append16(format, 32);
+    appendChunk(header, "fmt ", format);
+
+    // The rate of the original file, for MappedAudioFileReader to
+    // report as the native rate
+    quint64 nativeRate;
+    double d = reader->getNativeRate();
+    memcpy(&nativeRate, &d, 8);
+    nativeRate = qToLittleEndian(nativeRate);
+    appendChunk(header, "srcr",
+                QByteArray(reinterpret_cast<const char *>(&nativeRate), 8));
+
+    QByteArray info("INFO");
+    if (reader->getTitle() != "") {
+        appendChunk(info, "INAM", reader->getTitle().toUtf8() + '\0');
+    }
+    if (reader->getMaker() != "") {
+        appendChunk(info, "IART", reader->getMaker().toUtf8() + '\0');
+    }
+    if (info.size() > 4) {
+        appendChunk(header, "LIST", info);
+    }
+
+    // Pad so that the samples start on a 16-byte boundary, allowing
+    // for the RIFF header before us and the data chunk header after
+    int misalign = (12 + header.size() + 8) % 16;
+    if (misalign != 0) {
+        int pad = 16 - misalign;
+        if (pad < 8) pad += 16;
+        appendChunk(header, "JUNK", QByteArray(pad - 8, '\0'));
+    }
+
+    header.append("data", 4);
+    append32(header, quint32(dataBytes));
+
+    QByteArray riff("RIFF", 4);
+    append32(riff, quint32(4 + header.size() + dataBytes));
+    riff.append("WAVE", 4);
+    
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    file.write(riff);
+    file.write(header);
+
+    for (sv_frame_t i = 0; i < frames; i += storeChunk) {
+        sv_frame_t n = std::min(storeChunk, frames - i);
+        auto block = reader->getInterleavedFrames(i, n);
+        block.resize(n * channels, 0.f);
+        for (float f: block) {
+            peak = std::max(peak, fabsf(f));
+        }
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+        for (auto &f: block) {
+            quint32 u;
+            memcpy(&u, &f, 4);
+            u = qToLittleEndian(u);
+            memcpy(&f, &u, 4);
+        }
+#endif
+        qint64 bytes = qint64(block.size() * sizeof(float));
+        if (file.write(reinterpret_cast<const char *>(block.data()), bytes)
+            != bytes) {
+            return false;
+        }
+    }
+
+    return file.commit();
+}
+
+void
+DecodeCache::evict(QString keep)
+{
+    if (m_maxBytes == 0) return;
+
+    lock_guard<mutex> lock(m_mutex);
+    
+    // Oldest first
+    QFileInfoList entries = QDir(m_directory + "/audio")
+        .entryInfoList({ "*.wav" }, QDir::Files, QDir::Time | QDir::Reversed);
+
+    size_t total = 0;
+    for (const QFileInfo &entry: entries) {
+        total += size_t(entry.size());
+    }
+
+    for (const QFileInfo &entry: entries) {
+        if (total <= m_maxBytes) {
+            break;
+        }
+        if (entry.absoluteFilePath() == QFileInfo(keep).absoluteFilePath()) {
+            continue;
+        }
+        // Another run may have removed it already
+        QFile::remove(entry.absoluteFilePath());
+        total -= size_t(entry.size());
+    }
+}
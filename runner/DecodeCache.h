@@ -0,0 +1,106 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _DECODE_CACHE_H_
+#define _DECODE_CACHE_H_
+
+#include "base/BaseTypes.h"
+
+#include <QString>
+
+#include <mutex>
+#include <cstddef>
+
+class AudioFileReader;
+class MappedAudioFileReader;
+
+/**
+ * A directory of audio files already decoded, resampled and (if
+ * asked for) normalised, kept from one run to the next so that
+ * compressed files need not be decoded again each time they are
+ * processed.
+ *
+ * Each entry is a 32-bit float WAV file, which MappedAudioFileReader
+ * reads in place. Entries are found by the SHA-1 of the source file's
+ * contents, together with the sample rate and normalisation they were
+ * made with. They hold all of the source's channels, as mixing down
+ * happens after reading. The content hash of each source is recorded
+ * along with its size and modification time, so that a file is only
+ * hashed again once it has changed.
+ *
+ * The peak level of each source at each sample rate is also kept, so
+ * that it can be normalised with a gain as it is read rather than by
+ * decoding it in full first.
+ *
+ * The directory contains:
+ *
+ *   audio/<key>.wav      -- decoded audio
+ *   peaks/<key>          -- peak level of a source at a sample rate
+ *   sources/<key>        -- size, modification time and content
+ *                           hash last seen for a source file
+ *
+ * When the entries come to more than the size limit, those least
+ * recently used are removed. Several runs may share a directory.
+ */
+class DecodeCache
+{
+public:
+    // A maxBytes of 0 means no limit
+    DecodeCache(QString directory, size_t maxBytes);
+
+    // Return false if the cache directory could not be set up (an
+    // error will have been printed)
+    bool isOK() const { return m_ok; }
+
+    // Return a reader for the cached audio for the given local file
+    // at the given rate and normalisation, or 0 if it isn't cached.
+    MappedAudioFileReader *open(QString localFilename, sv_samplerate_t rate,
+                                bool normalised);
+
+    // Store all of the audio from the given reader, which has read
+    // the given local file at the given rate and normalisation, if
+    // it isn't already stored. Then remove older entries if the
+    // cache is over its size limit. A failure to store is reported
+    // but is otherwise harmless.
+    void store(QString localFilename, AudioFileReader *reader,
+               sv_samplerate_t rate, bool normalised);
+
+    // Find the peak level recorded for the given local file at the
+    // given rate, returning false if there is none.
+    bool getPeak(QString localFilename, sv_samplerate_t rate, float &peak);
+
+    // Record the peak level of the given local file at the given
+    // rate, as found by a reader that has read all of it.
+    void storePeak(QString localFilename, sv_samplerate_t rate, float peak);
+
+private:
+    QString getContentHash(QString localFilename);
+    QString getEntryPath(QString localFilename, sv_samplerate_t rate,
+                         bool normalised);
+    QString getPeakPath(QString localFilename, sv_samplerate_t rate);
+    // Write an entry, returning the peak level of what was written
+    bool writeEntry(QString path, AudioFileReader *reader, float &peak);
+    void evict(QString keep);
+
+    QString m_directory;
+    size_t m_maxBytes;
+    bool m_ok;
+    std::mutex m_mutex;
+
+    DecodeCache(const DecodeCache &) =delete;
+    DecodeCache &operator=(const DecodeCache &) =delete;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DecodeMemoryPolicy.h"
+
+#include "base/Debug.h"
+#include "base/TempDirectory.h"
+
+using namespace std;
+
+static int
+toMB(size_t bytes)
+{
+    return int((bytes + 1048575) / 1048576);
+}
+
+DecodeMemoryPolicy::DecodeMemoryPolicy(size_t memoryBytes,
+                                       SpillFormat format,
+                                       QString spillDirectory) :
+    m_memoryBytes(memoryBytes),
+    m_format(format),
+    m_spillDirectory(spillDirectory),
+    m_held(0),
+    m_peakHeld(0),
+    m_sources(0),
+    m_spilledSources(0),
+    m_decodedBytes(0),
+    m_spilledBytes(0),
+    m_fileBytes(0)
+{
+}
+
+bool
+DecodeMemoryPolicy::parseSpillFormat(QString text, SpillFormat &format)
+{
+    text = text.toLower();
+    if (text == "int16") {
+        format = SpillFormat::Int16;
+        return true;
+    }
+    if (text == "float") {
+        format = SpillFormat::Float32;
+        return true;
+    }
+    return false;
+}
+
+QString
+DecodeMemoryPolicy::getSpillDirectory() const
+{
+    if (m_spillDirectory != "") {
+        return m_spillDirectory;
+    }
+    return TempDirectory::getInstance()->getPath();
+}
+
+size_t
+DecodeMemoryPolicy::getAvailable()
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_held < m_memoryBytes ? m_memoryBytes - m_held : 0;
+}
+
+bool
+DecodeMemoryPolicy::tryTake(size_t bytes)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_held + bytes > m_memoryBytes) {
+        return false;
+    }
+    m_held += bytes;
+    if (m_held > m_peakHeld) {
+        m_peakHeld = m_held;
+    }
+    return true;
+}
+
+void
+DecodeMemoryPolicy::release(size_t bytes)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_held -= std::min(bytes, m_held);
+}
+
+void
+DecodeMemoryPolicy::recordSource(size_t decodedBytes, size_t spilledBytes,
+                                 size_t fileBytes)
+{
+    lock_guard<mutex> lock(m_mutex);
+    ++m_sources;
+    m_decodedBytes += decodedBytes;
+    if (spilledBytes > 0) {
+        ++m_spilledSources;
+        m_spilledBytes += spilledBytes;
+        m_fileBytes += fileBytes;
+    }
+}
+
+void
+DecodeMemoryPolicy::report()
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    SVCERR << "Decode memory: " << m_sources << " source(s) decoded, "
+           << toMB(m_decodedBytes) << "MB in all, at most "
+           << toMB(m_peakHeld) << "MB held in memory at once (limit "
+           << toMB(m_memoryBytes) << "MB)" << endl;
+
+    if (m_spilledSources == 0) {
+        SVCERR << "Decode memory: nothing spilled" << endl;
+        return;
+    }
+    
+    SVCERR << "Decode memory: " << toMB(m_spilledBytes) << "MB from "
+           << m_spilledSources << " source(s) spilled to \""
+           << getSpillDirectory() << "\" as "
+           << (m_format == SpillFormat::Int16 ? "16-bit integers" : "floats")
+           << ", " << m_fileBytes << " bytes written" << endl;
+}
@@ -0,0 +1,91 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _DECODE_MEMORY_POLICY_H_
+#define _DECODE_MEMORY_POLICY_H_
+
+#include <QString>
+
+#include <mutex>
+#include <cstddef>
+
+/**
+ * How much decoded audio InMemoryAudioFileReader may keep in memory,
+ * shared among all the readers open at once, and what to do with
+ * the rest. Audio that doesn't fit is spilled to a file in the spill
+ * directory, either as 16-bit integers, taking half the space of the
+ * float WAV files the ordinary readers decode into, or as floats,
+ * which lose nothing and are the better choice when the spill
+ * directory is on tmpfs.
+ *
+ * The policy also counts what was decoded and spilled over the run,
+ * for report() to print at the end.
+ */
+class DecodeMemoryPolicy
+{
+public:
+    enum class SpillFormat {
+        Int16, Float32
+    };
+
+    // A spillDirectory of "" means the temporary directory
+    DecodeMemoryPolicy(size_t memoryBytes, SpillFormat format,
+                       QString spillDirectory);
+
+    // Parse "int16" or "float", returning false for anything else
+    static bool parseSpillFormat(QString text, SpillFormat &format);
+
+    size_t getMemoryBytes() const { return m_memoryBytes; }
+    SpillFormat getSpillFormat() const { return m_format; }
+    QString getSpillDirectory() const;
+
+    // Return how many bytes could be taken right now
+    size_t getAvailable();
+
+    // Take the given number of bytes from the allowance if there is
+    // room for them, returning true if so. Nothing waits: a reader
+    // that can't have the memory spills instead.
+    bool tryTake(size_t bytes);
+
+    void release(size_t bytes);
+
+    // Record a source decoded by a reader, with decodedBytes of float
+    // audio in all, of which spilledBytes went to a spill file taking
+    // fileBytes on disc
+    void recordSource(size_t decodedBytes, size_t spilledBytes,
+                      size_t fileBytes);
+
+    // Print the counts for the run so far
+    void report();
+
+private:
+    size_t m_memoryBytes;
+    SpillFormat m_format;
+    QString m_spillDirectory;
+
+    size_t m_held;
+    size_t m_peakHeld;
+    int m_sources;
+    int m_spilledSources;
+    size_t m_decodedBytes;
+    size_t m_spilledBytes;
+    size_t m_fileBytes;
+    std::mutex m_mutex;
+
+    DecodeMemoryPolicy(const DecodeMemoryPolicy &) =delete;
+    DecodeMemoryPolicy &operator=(const DecodeMemoryPolicy &) =delete;
+};
+
+#endif
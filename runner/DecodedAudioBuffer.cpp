@@ -0,0 +1,40 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DecodedAudioBuffer.h"
+
+DecodedAudioBuffer::DecodedAudioBuffer(int channels,
+                                       int blockSize,
+                                       sv_frame_t startFrame,
+                                       sv_frame_t endFrame) :
+    m_blockSize(blockSize),
+    m_blockCount(0),
+    m_startFrame(startFrame),
+    m_endFrame(endFrame)
+{
+    if (endFrame > startFrame && blockSize > 0) {
+        m_blockCount = int((endFrame - startFrame + blockSize - 1) / blockSize);
+    }
+    
+    m_data = std::vector<std::vector<float>>
+        (channels,
+         std::vector<float>(sv_frame_t(m_blockCount) * m_blockSize, 0.f));
+}
+
+size_t
+DecodedAudioBuffer::getSize() const
+{
+    return m_data.size() * size_t(m_blockCount) * m_blockSize * sizeof(float);
+}
@@ -0,0 +1,81 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _DECODED_AUDIO_BUFFER_H_
+#define _DECODED_AUDIO_BUFFER_H_
+
+#include "base/BaseTypes.h"
+#include "transform/FeatureWriter.h"
+
+#include <vector>
+
+/**
+ * The audio for one input file, already decoded, resampled and mixed
+ * to the channel count the plugins expect, and held in memory in
+ * whole processing blocks. Several plugins can then each read it at
+ * their own pace (and on their own threads) without decoding the
+ * file more than once.
+ *
+ * The buffer covers frames startFrame to endFrame of the file,
+ * zero-padded at the end to a whole number of blocks.
+ */
+class DecodedAudioBuffer
+{
+public:
+    DecodedAudioBuffer(int channels, int blockSize,
+                       sv_frame_t startFrame, sv_frame_t endFrame);
+
+    int getChannelCount() const { return int(m_data.size()); }
+    int getBlockSize() const { return m_blockSize; }
+    int getBlockCount() const { return m_blockCount; }
+
+    sv_frame_t getStartFrame() const { return m_startFrame; }
+    sv_frame_t getEndFrame() const { return m_endFrame; }
+
+    // Return the frame number in the file at which the given block
+    // starts
+    sv_frame_t getBlockFrame(int block) const {
+        return m_startFrame + sv_frame_t(block) * m_blockSize;
+    }
+
+    // Return a pointer to the samples of the given channel, starting
+    // at the start of the given block
+    float *getBlockData(int channel, int block) {
+        return m_data[channel].data() + sv_frame_t(block) * m_blockSize;
+    }
+    const float *getBlockData(int channel, int block) const {
+        return m_data[channel].data() + sv_frame_t(block) * m_blockSize;
+    }
+
+    void setTrackMetadata(const FeatureWriter::TrackMetadata &metadata) {
+        m_metadata = metadata;
+    }
+    const FeatureWriter::TrackMetadata &getTrackMetadata() const {
+        return m_metadata;
+    }
+
+    // Return the approximate amount of memory used, in bytes
+    size_t getSize() const;
+    
+private:
+    int m_blockSize;
+    int m_blockCount;
+    sv_frame_t m_startFrame;
+    sv_frame_t m_endFrame;
+    std::vector<std::vector<float>> m_data;
+    FeatureWriter::TrackMetadata m_metadata;
+};
+
+#endif
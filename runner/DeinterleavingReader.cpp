@@ -0,0 +1,88 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "DeinterleavingReader.h"
+
+#include <algorithm>
+
+void
+DeinterleavingReader::deinterleave(const float *in,
+                                   sv_frame_t available, int rc,
+                                   sv_frame_t count, int channels,
+                                   float *const *out)
+{
+    sv_frame_t n = std::max(sv_frame_t(0), std::min(available, count));
+    
+    if (channels == 1 && rc > 1) {
+
+        // Summing from zero in channel order, then dividing, gives
+        // exactly the same results as FeatureExtractionManager always
+        // has done. Stereo, by far the commonest case, is written out
+        // with no inner loop so that the compiler can vectorise it.
+        
+        float *o = out[0];
+        if (rc == 2) {
+            for (sv_frame_t j = 0; j < n; ++j) {
+                o[j] = ((0.f + in[j * 2]) + in[j * 2 + 1]) / 2.f;
+            }
+            std::fill(o + n, o + count, 0.f);
+            return;
+        }
+        for (sv_frame_t j = 0; j < n; ++j) {
+            float sum = 0.f;
+            const float *frame = in + j * rc;
+            for (int c = 0; c < rc; ++c) {
+                sum += frame[c];
+            }
+            o[j] = sum / float(rc);
+        }
+        std::fill(o + n, o + count, 0.f);
+        return;
+    }
+
+    for (int c = 0; c < channels; ++c) {
+        float *o = out[c];
+        if (c < rc) {
+            if (rc == 1) {
+                std::copy(in, in + n, o);
+            } else {
+                for (sv_frame_t j = 0; j < n; ++j) {
+                    o[j] = in[j * rc + c];
+                }
+            }
+            std::fill(o + n, o + count, 0.f);
+        } else {
+            std::fill(o, o + count, 0.f);
+        }
+    }
+}
+
+void
+DeinterleavingReader::applyGain(float *samples, sv_frame_t n) const
+{
+    if (m_gain == 1.f) return;
+    for (sv_frame_t i = 0; i < n; ++i) {
+        samples[i] *= m_gain;
+    }
+}
+
+void
+DeinterleavingReader::applyGain(int channels, float *const *buffers,
+                                sv_frame_t n) const
+{
+    for (int c = 0; c < channels; ++c) {
+        applyGain(buffers[c], n);
+    }
+}
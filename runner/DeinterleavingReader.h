@@ -0,0 +1,88 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _DEINTERLEAVING_READER_H_
+#define _DEINTERLEAVING_READER_H_
+
+#include "base/BaseTypes.h"
+
+/**
+ * An interface for audio file readers that can write audio straight
+ * into the caller's own per-channel buffers, mixing it to the
+ * caller's channel count on the way, rather than returning a newly
+ * allocated interleaved vector for the caller to unpick. Readers in
+ * this directory implement this alongside AudioFileReader, and
+ * FeatureExtractionManager uses it when it's there.
+ *
+ * Channels are mapped as in FeatureExtractionManager: mixing down to
+ * mono averages all channels; otherwise each output channel takes
+ * the input channel of the same index, or silence if there is none,
+ * and any further input channels are dropped.
+ */
+class DeinterleavingReader
+{
+public:
+    DeinterleavingReader() : m_gain(1.f) { }
+    virtual ~DeinterleavingReader() { }
+
+    // Scale everything read by the given gain (default 1). This is
+    // how audio is normalised once its peak is known, so that it
+    // need not be decoded in full just to find the peak first.
+    void setGain(float gain) { m_gain = gain; }
+    float getGain() const { return m_gain; }
+
+    // Read count frames starting at frame start into the given
+    // buffers, one for each of channels channels, each with room for
+    // count samples. Anything past the end of the audio is filled
+    // with zeros. Return the number of frames of actual audio read.
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const = 0;
+
+    // If the reader has a single channel of audio already in memory
+    // as floats, and all of the count frames from start lie within
+    // it, return a pointer to them that remains valid for the
+    // lifetime of the reader. Otherwise return 0, and the caller
+    // must use readChannels.
+    virtual const float *getChannelData(sv_frame_t /* start */,
+                                        sv_frame_t /* count */) const {
+        return 0;
+    }
+
+    // Return true if the length of the audio can't be known until it
+    // has been read to the end, as when it comes from a pipe. Such a
+    // reader has a frame count of 0, its reads come back empty once
+    // they pass the end, and getFramesRead then gives the length.
+    virtual bool isOpenEnded() const { return false; }
+    virtual sv_frame_t getFramesRead() const { return 0; }
+
+    // Mix available frames of interleaved audio with sourceChannels
+    // channels into the given buffers as above, and zero-fill the
+    // buffers from there up to count frames.
+    static void deinterleave(const float *interleaved,
+                             sv_frame_t available, int sourceChannels,
+                             sv_frame_t count, int channels,
+                             float *const *buffers);
+
+protected:
+    // Apply the gain to n samples in place, or to the first n
+    // samples of each of the given buffers
+    void applyGain(float *samples, sv_frame_t n) const;
+    void applyGain(int channels, float *const *buffers, sv_frame_t n) const;
+
+    float m_gain;
+};
+
+#endif
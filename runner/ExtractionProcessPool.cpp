@@ -0,0 +1,391 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ExtractionProcessPool.h"
+#include "FeatureExtractionManager.h"
+
+#include "transform/FeatureWriter.h"
+#include "base/TempDirectory.h"
+#include "base/Debug.h"
+
+#include <QFile>
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+ExtractionProcessPool::ExtractionProcessPool(FeatureExtractionManager &manager,
+                                             const vector<WriterSetup> &writers,
+                                             int processCount) :
+    m_manager(manager),
+    m_writers(writers),
+    m_processCount(processCount),
+    m_ok(true)
+{
+#ifdef _WIN32
+    SVCERR << "ERROR: Worker processes are not supported on this platform"
+           << endl;
+    m_ok = false;
+#else
+    bool haveStdout = false;
+    
+    for (int i = 0; i < int(m_writers.size()); ++i) {
+
+        const WriterSetup &w = m_writers[i];
+        const auto &params = w.parameters;
+
+        bool oneFile = (params.find("one-file") != params.end());
+        bool toStdout = (params.find("stdout") != params.end() ||
+                         w.tag == "default");
+
+        if (!oneFile && !toStdout) {
+            continue; // separate files for each input, nothing to join
+        }
+
+        if (w.tag != "csv" && w.tag != "lab" && w.tag != "default") {
+            SVCERR << "ERROR: Output from the \"" << w.tag
+                   << "\" writer can't be joined up from several worker"
+                   << " processes, so it can only be written to a separate"
+                   << " file for each input when using worker processes"
+                   << endl;
+            m_ok = false;
+            continue;
+        }
+
+        if (toStdout) {
+            if (!haveStdout) {
+                Output output;
+                output.writer = i;
+                output.append = false;
+                m_outputs.push_back(output);
+                haveStdout = true;
+            }
+        } else {
+            Output output;
+            output.writer = i;
+            output.target = QString::fromStdString(params.at("one-file"));
+            output.append = (params.find("append") != params.end());
+            m_outputs.push_back(output);
+        }
+    }
+
+    if (haveStdout) {
+        // The temporary directory is created here, before any worker
+        // exists, so they all share it
+        m_stdoutPartPath = TempDirectory::getInstance()->getPath() +
+            "/stdout.%1.part";
+    }
+#endif
+}
+
+ExtractionProcessPool::~ExtractionProcessPool()
+{
+}
+
+QString
+ExtractionProcessPool::getPartPath(const Output &output, int process) const
+{
+    if (output.target == "") {
+        return m_stdoutPartPath.arg(process);
+    } else {
+        return QString("%1.%2.part").arg(output.target).arg(process);
+    }
+}
+
+bool
+ExtractionProcessPool::extractFeatures(QStringList sources, bool force)
+{
+    if (!m_ok) return false;
+
+#ifdef _WIN32
+    (void)sources;
+    (void)force;
+    return false;
+#else
+    int n = sources.size();
+    int processCount = std::max(1, std::min(m_processCount, n));
+
+    SVCERR << "Starting " << processCount << " extraction worker process(es)"
+           << endl;
+
+    // Anything still buffered would otherwise be written out again
+    // by every worker
+    cout.flush();
+    cerr.flush();
+    fflush(stdout);
+    fflush(stderr);
+
+    vector<int> starts = getRunStarts(n, processCount);
+    
+    vector<pid_t> pids;
+    bool good = true;
+    
+    for (int k = 0; k < processCount; ++k) {
+
+        int first = starts[k];
+        int count = starts[k + 1] - first;
+
+        pid_t pid = fork();
+        
+        if (pid < 0) {
+            SVCERR << "ERROR: Failed to start worker process " << k
+                   << ": " << strerror(errno) << endl;
+            good = false;
+            break;
+        }
+
+        if (pid == 0) {
+            runWorker(k, sources, first, count, force); // does not return
+        }
+
+        pids.push_back(pid);
+    }
+
+    for (int k = 0; k < int(pids.size()); ++k) {
+        int status = 0;
+        while (waitpid(pids[k], &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1 || !WIFEXITED(status)) {
+            SVCERR << "ERROR: Worker process " << k
+                   << " exited abnormally" << endl;
+            good = false;
+        } else if (WEXITSTATUS(status) != 0) {
+            // it will have reported its own errors
+            good = false;
+        }
+    }
+
+    if (!joinParts(int(pids.size()))) {
+        good = false;
+    }
+
+    return good;
+#endif
+}
+
+vector<int>
+ExtractionProcessPool::getRunStarts(int n, int processCount) const
+{
+    // Return processCount + 1 indices, the first source of each run
+    // followed by n. Without costs the runs are of equal length.
+    // With them, each run ends at the source that takes its total
+    // closest to an equal share of what is left, leaving at least
+    // one source for each run still to come.
+    
+    vector<int> starts;
+    starts.push_back(0);
+
+    double remaining = 0.0;
+    for (int i = 0; i < n && i < int(m_costs.size()); ++i) {
+        remaining += m_costs[i];
+    }
+
+    if (remaining <= 0.0) {
+        for (int k = 1; k <= processCount; ++k) {
+            starts.push_back(int((long long)n * k / processCount));
+        }
+        return starts;
+    }
+
+    auto cost = [this](int i) {
+        return (i < int(m_costs.size()) ? m_costs[i] : 0.0);
+    };
+    
+    int i = 0;
+    for (int k = 0; k + 1 < processCount; ++k) {
+        double share = remaining / (processCount - k);
+        int last = n - (processCount - k - 1); // leave one for each to come
+        double total = cost(i++);
+        while (i < last && total + cost(i) / 2.0 <= share) {
+            total += cost(i++);
+        }
+        remaining -= total;
+        starts.push_back(i);
+    }
+    starts.push_back(n);
+
+    return starts;
+}
+
+void
+ExtractionProcessPool::runWorker(int k, QStringList sources,
+                                 int first, int count, bool force)
+{
+#ifdef _WIN32
+    (void)k; (void)sources; (void)first; (void)count; (void)force;
+#else
+    // We are in the child process here. Redirect the single-file
+    // and stdout outputs to our own part files, process our share of
+    // the sources as a serial run would, and then leave without
+    // running any of the parent's exit-time cleanup -- in particular
+    // the temporary directory belongs to the parent and must survive
+    // us.
+
+    int rv = 0;
+
+    // Other workers are using the same temporary directory for
+    // their decode caches
+    m_manager.setCleanupAfterEachFile(false);
+
+    try {
+        for (const auto &output: m_outputs) {
+            QString part = getPartPath(output, k);
+            if (output.target == "") {
+                int fd = open(part.toLocal8Bit().data(),
+                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+                    SVCERR << "ERROR: Worker process " << k
+                           << " failed to open part file \"" << part
+                           << "\" for standard output: " << strerror(errno)
+                           << endl;
+                    _exit(1);
+                }
+                close(fd);
+            } else {
+                WriterSetup &w = m_writers[output.writer];
+                map<string, string> params = w.parameters;
+                params["one-file"] = part.toStdString();
+                params.erase("append");
+                w.writer->setParameters(params);
+            }
+        }
+    } catch (const std::exception &e) {
+        SVCERR << "ERROR: Worker process " << k
+               << " failed to set up its output: " << e.what() << endl;
+        _exit(1);
+    }
+
+    for (int i = first; i < first + count; ++i) {
+
+        QString source = sources.at(i);
+
+        SVCERR << "Extracting features for: \"" << source << "\"" << endl;
+        
+        try {
+            for (const auto &w: m_writers) {
+                w.writer->setNofM(i + 1, sources.size());
+            }
+            m_manager.extractFeatures(source);
+            if (m_completionCallback) {
+                m_completionCallback(source, true);
+            }
+        } catch (const std::exception &e) {
+            SVCERR << "ERROR: Feature extraction failed for \""
+                   << source.toStdString() << "\": " << e.what() << endl;
+            if (m_completionCallback) {
+                m_completionCallback(source, false);
+            }
+            rv = 1;
+            if (force) {
+                // print a note only if we have more files to process
+                if (i + 1 < sources.size()) {
+                    SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
+                }
+            } else {
+                SVCERR << "NOTE: If you want to continue with processing any further files after an" << endl
+                       << "error like this, use the --force option" << endl;
+                break;
+            }
+        }
+    }
+
+    // Deleting the writers closes their files
+    for (auto &w: m_writers) {
+        delete w.writer;
+        w.writer = 0;
+    }
+    
+    cout.flush();
+    cerr.flush();
+    fflush(stdout);
+    fflush(stderr);
+
+    _exit(rv);
+#endif
+}
+
+bool
+ExtractionProcessPool::joinParts(int processCount)
+{
+    bool good = true;
+    
+    for (const auto &output: m_outputs) {
+
+        QFile target;
+        bool opened = false;
+        
+        if (output.target == "") {
+            cout.flush();
+            opened = target.open(stdout, QIODevice::WriteOnly);
+        } else {
+            target.setFileName(output.target);
+            opened = target.open(output.append ?
+                                 (QIODevice::WriteOnly | QIODevice::Append) :
+                                 (QIODevice::WriteOnly | QIODevice::Truncate));
+        }
+
+        if (!opened) {
+            SVCERR << "ERROR: Failed to open output file \"" << output.target
+                   << "\" to join worker output into" << endl;
+            good = false;
+            continue;
+        }
+
+        for (int k = 0; k < processCount; ++k) {
+
+            QFile part(getPartPath(output, k));
+            if (!part.exists()) {
+                continue; // worker wrote nothing here
+            }
+            if (!part.open(QIODevice::ReadOnly)) {
+                SVCERR << "ERROR: Failed to read worker output part file \""
+                       << part.fileName() << "\"" << endl;
+                good = false;
+                continue;
+            }
+
+            while (!part.atEnd()) {
+                QByteArray data = part.read(1024 * 1024);
+                if (target.write(data) != data.size()) {
+                    SVCERR << "ERROR: Failed to write to output file \""
+                           << output.target << "\"" << endl;
+                    good = false;
+                    break;
+                }
+            }
+
+            part.close();
+            part.remove();
+        }
+
+        target.close();
+    }
+
+    return good;
+}
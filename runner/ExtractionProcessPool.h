@@ -0,0 +1,119 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _EXTRACTION_PROCESS_POOL_H_
+#define _EXTRACTION_PROCESS_POOL_H_
+
+#include <QString>
+#include <QStringList>
+
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+
+class FeatureExtractionManager;
+class FeatureWriter;
+
+/**
+ * Run feature extraction for many audio files at once, in separate
+ * worker processes rather than threads, for use with plugins that
+ * are not safe to run in more than one thread at a time. Not
+ * available on Windows.
+ *
+ * The manager should already have all of its feature extractors
+ * added. Each worker is forked from the calling process, so it
+ * starts with a copy of the same loaded and initialised plugins, and
+ * takes a contiguous run of the sources.
+ *
+ * Output written to separate files for each audio file needs no
+ * special handling. Output that would go to a single file, or to
+ * stdout, is written by each worker to a part file of its own, and
+ * the parts are joined in order at the end, giving the same result
+ * as a serial run. This is only possible for formats with no
+ * document structure around the features (csv, lab and the default
+ * writer); the others can't be used in a single file with this
+ * class.
+ */
+class ExtractionProcessPool
+{
+public:
+    struct WriterSetup {
+        FeatureWriter *writer;
+        std::string tag;
+        std::map<std::string, std::string> parameters;
+    };
+    
+    ExtractionProcessPool(FeatureExtractionManager &manager,
+                          const std::vector<WriterSetup> &writers,
+                          int processCount);
+    ~ExtractionProcessPool();
+
+    // Return false if the writers are set up in a way we can't
+    // handle (an error will have been printed)
+    bool isOK() const { return m_ok; }
+
+    // Call the given function for each source once it has been
+    // processed or has failed. This is called in the worker process
+    // that handled the source, so it can only usefully record its
+    // result somewhere outside the process, such as in a file.
+    typedef std::function<void(QString source, bool succeeded)>
+        CompletionCallback;
+    void setCompletionCallback(CompletionCallback callback) {
+        m_completionCallback = callback;
+    }
+
+    // Give an estimated relative cost for each of the sources that
+    // will next be passed to extractFeatures, in the same order. Each
+    // worker still takes a contiguous run of sources, so that its
+    // output can be joined up in order, but the runs are chosen to
+    // have roughly equal total cost rather than an equal number of
+    // sources.
+    void setSourceCosts(const std::vector<double> &costs) {
+        m_costs = costs;
+    }
+
+    // Extract features from all of the given sources, returning true
+    // if all succeeded. With force false, a worker stops at its first
+    // failure, but the others carry on with their own sources.
+    bool extractFeatures(QStringList sources, bool force);
+
+private:
+    struct Output {
+        int writer;            // index in m_writers
+        QString target;        // file to join the parts into, or empty for stdout
+        bool append;
+    };
+
+    std::vector<int> getRunStarts(int sourceCount, int processCount) const;
+    QString getPartPath(const Output &output, int process) const;
+    void runWorker(int process, QStringList sources, int first, int count,
+                   bool force);
+    bool joinParts(int processCount);
+
+    FeatureExtractionManager &m_manager;
+    std::vector<WriterSetup> m_writers;
+    int m_processCount;
+    bool m_ok;
+    CompletionCallback m_completionCallback;
+    std::vector<double> m_costs;
+    std::vector<Output> m_outputs;
+    QString m_stdoutPartPath;
+
+    ExtractionProcessPool(const ExtractionProcessPool &) =delete;
+    ExtractionProcessPool &operator=(const ExtractionProcessPool &) =delete;
+};
+
+#endif
@@ -0,0 +1,441 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ExtractionTaskScheduler.h"
+#include "ExtractionWorkerPool.h"
+#include "DecodedAudioBuffer.h"
+#include "MemoryBudget.h"
+
+#include "base/Debug.h"
+
+using namespace std;
+
+ExtractionTaskScheduler::ExtractionTaskScheduler(FeatureExtractionManager &prototype,
+                                                 const vector<FeatureWriter *> &writers,
+                                                 int workerCount) :
+    m_prototype(prototype),
+    m_writers(writers),
+    m_ok(true),
+    m_budget(0),
+    m_startedCount(0),
+    m_nextSource(0),
+    m_committing(0),
+    m_decoding(0),
+    m_inFlight(0),
+    // Allow one decoded file waiting beyond what the workers can be
+    // busy with, so that the next file is ready as the last tasks
+    // for the previous one finish
+    m_maxInFlight(workerCount + 1),
+    m_abort(false)
+{
+    SVCERR << "Initialising " << workerCount << " extraction worker(s)" << endl;
+
+    // Workers only return features to us, and never write, but their
+    // managers still want a writer for each transform. They can have
+    // the real ones.
+    FeatureExtractionManager::WriterMap writerMap;
+    for (auto w: m_writers) {
+        writerMap[w] = w;
+    }
+    
+    for (int i = 0; i < workerCount; ++i) {
+
+        unique_ptr<Worker> worker(new Worker);
+        worker->manager.reset(new FeatureExtractionManager(false));
+
+        if (!worker->manager->initialiseFrom(prototype, writerMap)) {
+            SVCERR << "ERROR: Failed to initialise plugins for extraction worker "
+                   << i << endl;
+            m_ok = false;
+            return;
+        }
+
+        m_workers.push_back(move(worker));
+    }
+}
+
+ExtractionTaskScheduler::~ExtractionTaskScheduler()
+{
+}
+
+void
+ExtractionTaskScheduler::setSourceCosts(const vector<double> &costs)
+{
+    m_costs = costs;
+}
+
+void
+ExtractionTaskScheduler::setMemoryBudget(MemoryBudget *budget,
+                                         const vector<size_t> &footprints)
+{
+    m_budget = budget;
+    m_footprints = footprints;
+}
+
+bool
+ExtractionTaskScheduler::extractFeatures(QStringList sources, bool force)
+{
+    if (!m_ok) return false;
+
+    m_sources = sources;
+    m_order = ExtractionWorkerPool::getProcessingOrder(m_costs,
+                                                       m_sources.size());
+    m_started = vector<char>(m_sources.size(), 0);
+    m_startedCount = 0;
+    m_nextSource = 0;
+    m_committing = 0;
+    m_decoding = 0;
+    m_inFlight = 0;
+    m_abort = false;
+    m_states.clear();
+
+    vector<thread> threads;
+    for (int w = 0; w < int(m_workers.size()); ++w) {
+        threads.push_back(thread([this, w]() { run(w); }));
+    }
+
+    bool good = true;
+
+    for (int i = 0; i < m_sources.size(); ++i) {
+
+        SourceState state;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_committing = i;
+            m_workAvailable.notify_all();
+            m_sourceDone.wait(lock, [this, i]() {
+                    auto si = m_states.find(i);
+                    return si != m_states.end() && si->second.done;
+                });
+            state = move(m_states[i]);
+            m_states.erase(i);
+        }
+
+        bool ok = commit(i, state, force);
+
+        if (m_completionCallback) {
+            m_completionCallback(m_sources.at(i), ok);
+        }
+
+        {
+            // Only now that the features have been written is the
+            // source's footprint really freed
+            lock_guard<mutex> lock(m_mutex);
+            if (m_budget) m_budget->release(state.footprint);
+            --m_inFlight;
+            if (!ok && !force) {
+                m_abort = true;
+            }
+        }
+        m_workAvailable.notify_all();
+
+        if (!ok) {
+            good = false;
+            if (!force) break;
+        }
+    }
+
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    if (m_budget) {
+        // Anything started but not written, after an abort
+        for (const auto &st: m_states) {
+            m_budget->release(st.second.footprint);
+        }
+    }
+
+    m_states.clear();
+    return good;
+}
+
+void
+ExtractionTaskScheduler::run(int w)
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (!m_abort) {
+
+        Task task;
+
+        if (takeOwnTask(w, task)) {
+            lock.unlock();
+            runTask(w, task);
+            lock.lock();
+            continue;
+        }
+
+        int index = takeNextSource();
+        if (index >= 0) {
+            ++m_inFlight;
+            ++m_decoding;
+            m_states[index];
+            lock.unlock();
+            decode(w, index);
+            lock.lock();
+            continue;
+        }
+
+        if (stealTask(w, task)) {
+            lock.unlock();
+            runTask(w, task);
+            lock.lock();
+            continue;
+        }
+
+        if (m_startedCount >= m_sources.size() && m_decoding == 0) {
+            // Nothing left queued anywhere, and nothing more will be
+            // queued; any tasks still running belong to other workers
+            return;
+        }
+
+        m_workAvailable.wait(lock);
+    }
+}
+
+int
+ExtractionTaskScheduler::takeNextSource()
+{
+    // Called with m_mutex held. Return the index of the next source
+    // to decode, or -1 if there is none or we already have as many
+    // in hand as we should, or there is no room in the memory budget.
+
+    while (m_nextSource < int(m_order.size()) &&
+           m_started[m_order[m_nextSource]]) {
+        ++m_nextSource;
+    }
+
+    int index = -1;
+    size_t footprint = 0;
+
+    auto footprintOf = [this](int i) {
+        return (m_budget && i < int(m_footprints.size()) ?
+                m_footprints[i] : size_t(0));
+    };
+    
+    if (m_nextSource < int(m_order.size()) && m_inFlight < m_maxInFlight) {
+        int candidate = m_order[m_nextSource];
+        footprint = footprintOf(candidate);
+        if (!m_budget ||
+            m_budget->tryAcquire(footprint, m_sources.at(candidate))) {
+            index = candidate;
+            ++m_nextSource;
+        }
+    }
+
+    if (index < 0 &&
+        m_committing < m_sources.size() && !m_started[m_committing]) {
+        // When sources are taken out of order, those in hand may all
+        // be waiting to be written after one that hasn't been started
+        // yet, which would then never be started: so start it now,
+        // regardless of the limit. Their footprints are held until
+        // they are written, so that goes for the budget as well
+        index = m_committing;
+        footprint = footprintOf(index);
+        if (m_budget) m_budget->acquireNow(footprint, m_sources.at(index));
+    }
+
+    if (index < 0) {
+        return -1;
+    }
+    
+    m_started[index] = 1;
+    ++m_startedCount;
+    m_states[index].footprint = footprint;
+    
+    return index;
+}
+
+bool
+ExtractionTaskScheduler::takeOwnTask(int w, Task &task)
+{
+    // Called with m_mutex held
+    
+    auto &tasks = m_workers[w]->tasks;
+    if (tasks.empty()) return false;
+    task = tasks.back();
+    tasks.pop_back();
+    return true;
+}
+
+bool
+ExtractionTaskScheduler::stealTask(int w, Task &task)
+{
+    // Called with m_mutex held. Take the oldest task from the first
+    // other worker that has any, starting with our neighbour so that
+    // not everyone descends on the same victim.
+
+    int n = int(m_workers.size());
+    
+    for (int i = 1; i < n; ++i) {
+        auto &tasks = m_workers[(w + i) % n]->tasks;
+        if (!tasks.empty()) {
+            task = tasks.front();
+            tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+ExtractionTaskScheduler::decode(int w, int index)
+{
+    // Called without m_mutex held
+    
+    QString source = m_sources.at(index);
+
+    SVCERR << "Extracting features for: \"" << source << "\"" << endl;
+
+    shared_ptr<DecodedAudioBuffer> buffer;
+    string error;
+    bool failed = false;
+    
+    try {
+        buffer = m_workers[w]->manager->decodeSource(source);
+    } catch (const std::exception &e) {
+        failed = true;
+        error = e.what();
+    } catch (...) {
+        failed = true;
+        error = "unknown exception";
+    }
+
+    int pluginCount = m_workers[w]->manager->getPluginCount();
+    
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        --m_decoding;
+
+        SourceState &state = m_states[index];
+
+        if (failed || pluginCount == 0) {
+            state.failed = failed;
+            state.error = error;
+            state.done = true;
+            m_sourceDone.notify_all();
+        } else {
+            state.buffer = buffer;
+            state.metadata = buffer->getTrackMetadata();
+            state.features.resize(pluginCount);
+            state.pending = pluginCount;
+            for (int p = 0; p < pluginCount; ++p) {
+                m_workers[w]->tasks.push_back({ index, p });
+            }
+        }
+    }
+
+    m_workAvailable.notify_all();
+}
+
+void
+ExtractionTaskScheduler::runTask(int w, const Task &task)
+{
+    // Called without m_mutex held
+
+    SourceState *state = 0;
+    shared_ptr<DecodedAudioBuffer> buffer;
+    bool skip = false;
+    
+    {
+        lock_guard<mutex> lock(m_mutex);
+        state = &m_states[task.source];
+        buffer = state->buffer;
+        // No point in carrying on with a file that has already failed
+        skip = state->failed;
+    }
+
+    FeatureExtractionManager::PluginFeatures features;
+    string error;
+    bool failed = false;
+    
+    if (!skip) {
+        try {
+            m_workers[w]->manager->extractPluginFeatures
+                (task.plugin, *buffer, features);
+        } catch (const std::exception &e) {
+            failed = true;
+            error = e.what();
+        } catch (...) {
+            failed = true;
+            error = "unknown exception";
+        }
+    }
+
+    buffer.reset();
+    
+    lock_guard<mutex> lock(m_mutex);
+
+    if (failed) {
+        if (!state->failed) {
+            state->failed = true;
+            state->error = error;
+        }
+    } else if (!skip) {
+        state->features[task.plugin] = move(features);
+    }
+
+    if (--state->pending == 0) {
+        state->buffer.reset(); // we only need the features now
+        state->done = true;
+        m_sourceDone.notify_all();
+    }
+}
+
+bool
+ExtractionTaskScheduler::commit(int index, SourceState &state, bool force)
+{
+    QString source = m_sources.at(index);
+    bool failed = state.failed;
+    string error = state.error;
+
+    try {
+        for (auto w: m_writers) {
+            w->setNofM(index + 1, m_sources.size());
+        }
+        if (!failed) {
+            m_prototype.writePluginFeatures(source, state.metadata,
+                                            state.features);
+        }
+    } catch (const std::exception &e) {
+        if (!failed) {
+            failed = true;
+            error = e.what();
+        }
+    }
+
+    if (!failed) {
+        return true;
+    }
+
+    SVCERR << "ERROR: Feature extraction failed for \""
+           << source.toStdString() << "\": " << error << endl;
+
+    if (force) {
+        // print a note only if we have more files to process
+        if (index + 1 < m_sources.size()) {
+            SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
+        }
+    } else {
+        SVCERR << "NOTE: If you want to continue with processing any further files after an" << endl
+               << "error like this, use the --force option" << endl;
+    }
+
+    return false;
+}
@@ -0,0 +1,150 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _EXTRACTION_TASK_SCHEDULER_H_
+#define _EXTRACTION_TASK_SCHEDULER_H_
+
+#include "FeatureExtractionManager.h"
+
+#include <QStringList>
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+class FeatureWriter;
+class DecodedAudioBuffer;
+class MemoryBudget;
+
+/**
+ * Run feature extraction for many audio files using a set of worker
+ * threads, with a separate task for each plugin on each file. This
+ * keeps all the workers busy even when a few expensive plugins, or
+ * one long file, would otherwise leave most of them idle at the end
+ * of a run.
+ *
+ * Each file is decoded once, into memory, by whichever worker picks
+ * it up, and that worker queues a task for each plugin. Workers take
+ * tasks from their own queue first, then decode a new file if there
+ * is one (and not too many are already waiting), and only then take
+ * tasks queued by other workers. Each worker has its own
+ * FeatureExtractionManager, so its own instance of every plugin.
+ *
+ * The results for each file are written from the calling thread, in
+ * the order the files were supplied and in the same order within
+ * each file as a serial run would write them.
+ */
+class ExtractionTaskScheduler
+{
+public:
+    // Create the given number of workers, each with a plugin chain
+    // copied from the prototype manager, which must already have had
+    // all of its feature extractors added. The prototype is also used
+    // to write the results, so it must outlive this object.
+    ExtractionTaskScheduler(FeatureExtractionManager &prototype,
+                            const std::vector<FeatureWriter *> &writers,
+                            int workerCount);
+    ~ExtractionTaskScheduler();
+
+    bool isOK() const { return m_ok; }
+
+    // As ExtractionWorkerPool::setCompletionCallback
+    typedef std::function<void(QString source, bool succeeded)>
+        CompletionCallback;
+    void setCompletionCallback(CompletionCallback callback) {
+        m_completionCallback = callback;
+    }
+
+    // As ExtractionWorkerPool::setSourceCosts. The most costly
+    // sources are decoded first.
+    void setSourceCosts(const std::vector<double> &costs);
+
+    // As ExtractionWorkerPool::setMemoryBudget. A source's footprint
+    // is taken from the budget when it is decoded and returned when
+    // its features have been written.
+    void setMemoryBudget(MemoryBudget *budget,
+                         const std::vector<size_t> &footprints);
+
+    // Extract features from all of the given sources, returning true
+    // if all succeeded. Failures are reported, and force handled, as
+    // by ExtractionWorkerPool.
+    bool extractFeatures(QStringList sources, bool force);
+
+private:
+    struct Task {
+        int source;
+        int plugin;
+    };
+
+    struct Worker {
+        std::unique_ptr<FeatureExtractionManager> manager;
+        std::deque<Task> tasks;
+    };
+
+    struct SourceState {
+        SourceState() : footprint(0), pending(0), done(false), failed(false) { }
+        std::shared_ptr<DecodedAudioBuffer> buffer;
+        size_t footprint;
+        FeatureWriter::TrackMetadata metadata;
+        std::vector<FeatureExtractionManager::PluginFeatures> features;
+        int pending;
+        bool done;
+        bool failed;
+        std::string error;
+    };
+
+    void run(int worker);
+    int takeNextSource();
+    bool takeOwnTask(int worker, Task &task);
+    bool stealTask(int worker, Task &task);
+    void runTask(int worker, const Task &task);
+    void decode(int worker, int index);
+    bool commit(int index, SourceState &state, bool force);
+
+    FeatureExtractionManager &m_prototype;
+    std::vector<FeatureWriter *> m_writers;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    bool m_ok;
+    CompletionCallback m_completionCallback;
+
+    QStringList m_sources;
+    std::vector<double> m_costs;
+    std::vector<int> m_order;   // indices into m_sources, in decoding order
+    std::vector<char> m_started;
+    MemoryBudget *m_budget;
+    std::vector<size_t> m_footprints;
+    int m_startedCount;
+    int m_nextSource;           // index into m_order
+    int m_committing;           // index into m_sources
+    int m_decoding;
+    int m_inFlight;
+    int m_maxInFlight;
+    bool m_abort;
+    std::map<int, SourceState> m_states;
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_sourceDone;
+
+    ExtractionTaskScheduler(const ExtractionTaskScheduler &) =delete;
+    ExtractionTaskScheduler &operator=(const ExtractionTaskScheduler &) =delete;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ExtractionWorkerPool.h"
+#include "FeatureExtractionManager.h"
+#include "MemoryBudget.h"
+
+#include "base/Debug.h"
+
+#include <algorithm>
+
+using namespace std;
+
+ExtractionWorkerPool::ExtractionWorkerPool(const FeatureExtractionManager &prototype,
+                                           const vector<FeatureWriter *> &writers,
+                                           int workerCount) :
+    m_writers(writers),
+    m_ok(true),
+    m_budget(0),
+    m_startedCount(0),
+    m_next(0),
+    m_committing(0),
+    m_inFlight(0),
+    m_maxInFlight(workerCount * 2),
+    m_abort(false)
+{
+    SVCERR << "Initialising " << workerCount << " extraction worker(s)" << endl;
+
+    for (int i = 0; i < workerCount; ++i) {
+
+        unique_ptr<Worker> worker(new Worker);
+        FeatureExtractionManager::WriterMap writerMap;
+
+        for (auto w: m_writers) {
+            BufferingFeatureWriter *bw = new BufferingFeatureWriter(w);
+            worker->writers.push_back(unique_ptr<BufferingFeatureWriter>(bw));
+            writerMap[w] = bw;
+        }
+
+        // Workers don't show progress -- several progress meters
+        // all updating the same line would be no use to anyone
+        worker->manager.reset(new FeatureExtractionManager(false));
+
+        // The temporary directory is shared between workers, so
+        // leave it alone until everything is finished
+        worker->manager->setCleanupAfterEachFile(false);
+
+        if (!worker->manager->initialiseFrom(prototype, writerMap)) {
+            SVCERR << "ERROR: Failed to initialise plugins for extraction worker "
+                   << i << endl;
+            m_ok = false;
+            return;
+        }
+
+        m_workers.push_back(move(worker));
+    }
+}
+
+ExtractionWorkerPool::~ExtractionWorkerPool()
+{
+}
+
+void
+ExtractionWorkerPool::setSourceCosts(const vector<double> &costs)
+{
+    m_costs = costs;
+}
+
+vector<int>
+ExtractionWorkerPool::getProcessingOrder(const vector<double> &costs, int n)
+{
+    vector<int> order;
+    for (int i = 0; i < n; ++i) {
+        order.push_back(i);
+    }
+
+    auto cost = [&costs](int i) {
+        return (i < int(costs.size()) ? costs[i] : 0.0);
+    };
+    
+    stable_sort(order.begin(), order.end(),
+                [&cost](int a, int b) { return cost(a) > cost(b); });
+
+    return order;
+}
+
+void
+ExtractionWorkerPool::setMemoryBudget(MemoryBudget *budget,
+                                      const vector<size_t> &footprints)
+{
+    m_budget = budget;
+    m_footprints = footprints;
+}
+
+bool
+ExtractionWorkerPool::extractFeatures(QStringList sources, bool force)
+{
+    if (!m_ok) return false;
+
+    m_sources = sources;
+    m_order = getProcessingOrder(m_costs, m_sources.size());
+    m_started = vector<char>(m_sources.size(), 0);
+    m_startedCount = 0;
+    m_next = 0;
+    m_committing = 0;
+    m_inFlight = 0;
+    m_abort = false;
+    m_results.clear();
+
+    vector<thread> threads;
+    for (auto &w: m_workers) {
+        threads.push_back(thread([this, &w]() { run(w.get()); }));
+    }
+
+    bool good = true;
+
+    for (int i = 0; i < m_sources.size(); ++i) {
+
+        Result result;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_condition.wait(lock, [this, i]() {
+                    return m_results.find(i) != m_results.end();
+                });
+            result = m_results[i];
+            m_results.erase(i);
+        }
+
+        bool ok = commit(i, result, force);
+
+        if (m_completionCallback) {
+            m_completionCallback(m_sources.at(i), ok);
+        }
+
+        {
+            // The recorded output is only gone now that it has been
+            // written, so this is when its footprint comes back
+            lock_guard<mutex> lock(m_mutex);
+            if (m_budget) m_budget->release(result.footprint);
+            m_committing = i + 1;
+            --m_inFlight;
+            if (!ok && !force) {
+                m_abort = true;
+            }
+        }
+        m_condition.notify_all();
+
+        if (!ok) {
+            good = false;
+            if (!force) break;
+        }
+    }
+
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    if (m_budget) {
+        // Anything finished but not written, after an abort
+        for (const auto &r: m_results) {
+            m_budget->release(r.second.footprint);
+        }
+    }
+
+    m_results.clear();
+    return good;
+}
+
+int
+ExtractionWorkerPool::takeNextSource(size_t &footprint)
+{
+    // Called with m_mutex held. Return the index of the next source
+    // to process, having taken its footprint from the memory budget,
+    // or -1 if there is none we can start yet, because we already
+    // have as many in hand as we should or there is no room in the
+    // budget.
+
+    while (m_next < int(m_order.size()) && m_started[m_order[m_next]]) {
+        ++m_next;
+    }
+
+    int index = -1;
+    footprint = 0;
+    
+    auto footprintOf = [this](int i) {
+        return (m_budget && i < int(m_footprints.size()) ?
+                m_footprints[i] : size_t(0));
+    };
+    
+    if (m_next < int(m_order.size()) && m_inFlight < m_maxInFlight) {
+        int candidate = m_order[m_next];
+        footprint = footprintOf(candidate);
+        if (!m_budget ||
+            m_budget->tryAcquire(footprint, m_sources.at(candidate))) {
+            index = candidate;
+        }
+    }
+
+    if (index < 0 &&
+        m_committing < m_sources.size() && !m_started[m_committing]) {
+        // Those in hand, and the budget, may be taken up entirely by
+        // results waiting to be written after this source, in which
+        // case it would never be started: so start it now regardless
+        // of either limit
+        index = m_committing;
+        footprint = footprintOf(index);
+        if (m_budget) m_budget->acquireNow(footprint, m_sources.at(index));
+    }
+
+    if (index < 0) {
+        return -1;
+    }
+    
+    m_started[index] = 1;
+    ++m_startedCount;
+    ++m_inFlight;
+    
+    return index;
+}
+
+void
+ExtractionWorkerPool::run(Worker *worker)
+{
+    while (true) {
+
+        int index = -1;
+        size_t footprint = 0;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+            while (!m_abort) {
+                index = takeNextSource(footprint);
+                if (index >= 0 || m_startedCount >= m_sources.size()) {
+                    break;
+                }
+                // Wait for something to be written, which will make
+                // room for another source
+                m_condition.wait(lock);
+            }
+            if (index < 0) {
+                return;
+            }
+        }
+
+        QString source = m_sources.at(index);
+
+        SVCERR << "Extracting features for: \"" << source << "\"" << endl;
+
+        Result result;
+
+        try {
+            worker->manager->extractFeatures(source);
+        } catch (const std::exception &e) {
+            result.failed = true;
+            result.error = e.what();
+        } catch (...) {
+            result.failed = true;
+            result.error = "unknown exception";
+        }
+
+        result.footprint = footprint;
+
+        for (auto &bw: worker->writers) {
+            result.recordings.push_back(bw->takeRecording());
+        }
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_results[index] = result;
+        }
+
+        m_condition.notify_all();
+    }
+}
+
+bool
+ExtractionWorkerPool::commit(int index, const Result &result, bool force)
+{
+    QString source = m_sources.at(index);
+    bool failed = result.failed;
+    string error = result.error;
+
+    // If extraction failed part-way, this still passes on whatever
+    // was written before the failure, as a serial run would have done
+
+    try {
+        for (auto w: m_writers) {
+            w->setNofM(index + 1, m_sources.size());
+        }
+        for (int j = 0; j < (int)m_writers.size(); ++j) {
+            result.recordings[j]->replay(m_writers[j]);
+        }
+    } catch (const std::exception &e) {
+        if (!failed) {
+            failed = true;
+            error = e.what();
+        }
+    }
+
+    if (!failed) {
+        return true;
+    }
+
+    SVCERR << "ERROR: Feature extraction failed for \""
+           << source.toStdString() << "\": " << error << endl;
+
+    if (force) {
+        // print a note only if we have more files to process
+        if (index + 1 < m_sources.size()) {
+            SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
+        }
+    } else {
+        SVCERR << "NOTE: If you want to continue with processing any further files after an" << endl
+               << "error like this, use the --force option" << endl;
+    }
+
+    return false;
+}
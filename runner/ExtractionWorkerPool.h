@@ -0,0 +1,143 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _EXTRACTION_WORKER_POOL_H_
+#define _EXTRACTION_WORKER_POOL_H_
+
+#include "BufferingFeatureWriter.h"
+
+#include <QStringList>
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+class FeatureExtractionManager;
+class FeatureWriter;
+class MemoryBudget;
+
+/**
+ * Run feature extraction for many audio files at once, one file per
+ * worker thread. Each worker has its own FeatureExtractionManager,
+ * with its own plugin instances, and writes into buffering writers
+ * rather than the real ones. The recorded output for each file is
+ * then passed on to the real writers from the calling thread, in the
+ * order the files were supplied, so the results are the same as for
+ * a serial run.
+ */
+class ExtractionWorkerPool
+{
+public:
+    // Create the given number of workers, each with a plugin chain
+    // copied from the prototype manager, which must already have had
+    // all of its feature extractors added. The plugins are loaded
+    // and initialised here, on the calling thread.
+    ExtractionWorkerPool(const FeatureExtractionManager &prototype,
+                         const std::vector<FeatureWriter *> &writers,
+                         int workerCount);
+    ~ExtractionWorkerPool();
+
+    bool isOK() const { return m_ok; }
+
+    int getWorkerCount() const { return int(m_workers.size()); }
+
+    // Call the given function for each source once its output has
+    // been written, or once it has been found to have failed
+    typedef std::function<void(QString source, bool succeeded)>
+        CompletionCallback;
+    void setCompletionCallback(CompletionCallback callback) {
+        m_completionCallback = callback;
+    }
+
+    // Give an estimated relative cost for each of the sources that
+    // will next be passed to extractFeatures, in the same order. The
+    // most costly sources are then started first, so that a long file
+    // doesn't end up running on its own at the end. Output is still
+    // written in the order of the sources, so no more than twice as
+    // many sources as workers are allowed in hand at once, to limit
+    // how much finished output can pile up waiting for an earlier one.
+    void setSourceCosts(const std::vector<double> &costs);
+
+    // Take the estimated memory footprint of each source (in the
+    // same order as for setSourceCosts) from the given budget while
+    // it is being processed and until its output has been written,
+    // waiting to start a source until there is room for it. The
+    // budget is not owned by this object.
+    void setMemoryBudget(MemoryBudget *budget,
+                         const std::vector<size_t> &footprints);
+
+    // Return the indices 0 to n-1 ordered by descending cost, keeping
+    // the original order among sources of equal cost. Sources beyond
+    // the end of the costs vector are taken to have no cost.
+    static std::vector<int> getProcessingOrder(const std::vector<double> &costs,
+                                               int n);
+
+    // Extract features from all of the given sources, returning true
+    // if all succeeded. The writers are told about each source with
+    // setNofM as in a serial run. A failure is reported when the
+    // source it belongs to comes up in order; if force is false, no
+    // further output is written after that.
+    bool extractFeatures(QStringList sources, bool force);
+
+private:
+    struct Worker {
+        std::unique_ptr<FeatureExtractionManager> manager;
+        std::vector<std::unique_ptr<BufferingFeatureWriter>> writers;
+    };
+
+    struct Result {
+        Result() : failed(false), footprint(0) { }
+        bool failed;
+        size_t footprint;
+        std::string error;
+        // One per writer, in the same order as m_writers
+        std::vector<std::shared_ptr<BufferingFeatureWriter::Recording>> recordings;
+    };
+
+    void run(Worker *worker);
+    int takeNextSource(size_t &footprint);
+    bool commit(int index, const Result &result, bool force);
+
+    std::vector<FeatureWriter *> m_writers;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    bool m_ok;
+    CompletionCallback m_completionCallback;
+
+    QStringList m_sources;
+    std::vector<double> m_costs;
+    std::vector<int> m_order;   // indices into m_sources, in processing order
+    std::vector<char> m_started;
+    MemoryBudget *m_budget;
+    std::vector<size_t> m_footprints;
+    int m_startedCount;
+    int m_next;                 // index into m_order
+    int m_committing;           // index into m_sources
+    int m_inFlight;             // started but not yet written
+    int m_maxInFlight;
+    bool m_abort;
+    std::map<int, Result> m_results;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+
+    ExtractionWorkerPool(const ExtractionWorkerPool &) =delete;
+    ExtractionWorkerPool &operator=(const ExtractionWorkerPool &) =delete;
+};
+
+#endif
@@ -15,6 +15,19 @@
 
 #include "FeatureExtractionManager.h"
 #include "MultiplexedReader.h"
+#include "TaskPool.h"
+#include "BoundedQueue.h"
+#include "DecodedAudioBuffer.h"
+#include "StreamingAudioFileReader.h"
+#include "MappedAudioFileReader.h"
+#include "DecodeCache.h"
+#include "DecodeMemoryPolicy.h"
+#include "InMemoryAudioFileReader.h"
+#include "SourcePrefetcher.h"
+#include "PipeAudioFileReader.h"
+#include "AudioFileProbe.h"
+#include "DeinterleavingReader.h"
+#include "ReadAheadBuffer.h"
 
 #include <vamp-hostsdk/PluginChannelAdapter.h>
 #include <vamp-hostsdk/PluginBufferingAdapter.h>
@@ -23,10 +36,16 @@
 #include <vamp-hostsdk/PluginWrapper.h>
 #include <vamp-hostsdk/PluginLoader.h>
 
+#include "bqresample/Resampler.h"
+
 #include "base/Debug.h"
 #include "base/Exceptions.h"
 
 #include <iostream>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 using namespace std;
 
@@ -49,6 +68,7 @@ using Vamp::HostExt::PluginWrapper;
 #include "transform/FeatureWriter.h"
 
 #include <QTextStream>
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 
@@ -69,7 +89,23 @@ FeatureExtractionManager::FeatureExtractionManager(bool verbose) :
     m_defaultSampleRate(0),
     m_sampleRate(0),
     m_channels(0),
-    m_normalise(false)
+    m_normalise(false),
+    m_cleanupAfterEachFile(true),
+    m_probeDurations(false),
+    m_pluginThreads(1),
+    m_multiplexThreads(1),
+    m_pipelined(false),
+    m_streaming(false),
+    m_decodeCache(0),
+    m_decodeMemory(0),
+    m_prefetchDepth(0),
+    m_prefetchBytes(0),
+    m_blockData(0),
+    m_splitSegments(1),
+    m_segmentsPrepared(false),
+    m_segmenting(false),
+    m_segmentFeedEnd(0),
+    m_excerptDuration(0.0)
 {
 }
 
@@ -77,6 +113,9 @@ FeatureExtractionManager::~FeatureExtractionManager()
 {
     SVDEBUG << "FeatureExtractionManager::~FeatureExtractionManager: cleaning up"
             << endl;
+
+    // Before anything its threads might be using
+    m_prefetcher.reset();
     
     foreach (AudioFileReader *r, m_readyReaders) {
         delete r;
@@ -115,6 +154,180 @@ void FeatureExtractionManager::setNormalise(bool normalise)
     m_normalise = normalise;
 }
 
+void FeatureExtractionManager::setPluginThreads(int threads)
+{
+    m_pluginThreads = std::max(1, threads);
+}
+
+void FeatureExtractionManager::setMultiplexThreads(int threads)
+{
+    m_multiplexThreads = std::max(1, threads);
+}
+
+void FeatureExtractionManager::setPipelined(bool pipelined)
+{
+    m_pipelined = pipelined;
+}
+
+void FeatureExtractionManager::setStreaming(bool streaming)
+{
+    m_streaming = streaming;
+}
+
+void FeatureExtractionManager::setDecodeCache(DecodeCache *cache)
+{
+    m_decodeCache = cache;
+}
+
+void FeatureExtractionManager::setDecodeMemory(DecodeMemoryPolicy *policy)
+{
+    m_decodeMemory = policy;
+}
+
+void FeatureExtractionManager::setRawFormat(QString format)
+{
+    m_rawFormat = format;
+}
+
+void FeatureExtractionManager::setPrefetch(int depth, size_t maxBytes)
+{
+    m_prefetchDepth = depth;
+    m_prefetchBytes = maxBytes;
+    m_prefetcher.reset();
+}
+
+void FeatureExtractionManager::prefetchSources(QStringList sources)
+{
+    if (m_prefetchDepth <= 0) return;
+
+    if (!m_prefetcher) {
+        m_prefetcher.reset(new SourcePrefetcher
+                           ([this](QString source) {
+                               return openReader(source, true);
+                           },
+                            m_prefetchDepth, m_prefetchBytes));
+    }
+
+    // A reader we already have open (from addSource) is used as it
+    // is. The estimate is made here because addSource may still be
+    // adding to what it is made from.
+    foreach (QString source, sources) {
+        if (!m_readyReaders.contains(source)) {
+            m_prefetcher->add(source, estimateDecodedSize(source));
+        }
+    }
+}
+
+void FeatureExtractionManager::setSplitTransforms(const set<TransformId> &ids,
+                                                  int segments)
+{
+    m_splitTransformIds = ids;
+    m_splitSegments = std::max(1, segments);
+    m_segmentsPrepared = false;
+}
+
+bool FeatureExtractionManager::parseChannelLayout(QString text,
+                                                  ChannelLayout &layout)
+{
+    text = text.toLower();
+    if (text == "native") {
+        layout = ChannelLayout(ChannelLayout::Native);
+        return true;
+    }
+    if (text == "mono") {
+        layout = ChannelLayout(ChannelLayout::Mono);
+        return true;
+    }
+    bool ok = false;
+    int channel = text.toInt(&ok);
+    if (!ok || channel < 1) {
+        return false;
+    }
+    layout = ChannelLayout(ChannelLayout::Single, channel - 1);
+    return true;
+}
+
+bool FeatureExtractionManager::parseExcerpts(QString text,
+                                             vector<Excerpt> &excerpts)
+{
+    vector<Excerpt> parsed;
+    for (QString item: text.split(',')) {
+        Excerpt excerpt;
+        item = item.trimmed();
+        if (item.endsWith('%')) {
+            item.chop(1);
+            excerpt.relative = true;
+        }
+        bool ok = false;
+        double value = item.toDouble(&ok);
+        if (!ok || value < 0.0 || (excerpt.relative && value > 100.0)) {
+            return false;
+        }
+        excerpt.start = (excerpt.relative ? value / 100.0 : value);
+        parsed.push_back(excerpt);
+    }
+    excerpts = parsed;
+    return true;
+}
+
+void FeatureExtractionManager::setExcerpts(const vector<Excerpt> &excerpts,
+                                           double duration)
+{
+    m_excerpts = excerpts;
+    m_excerptDuration = duration;
+}
+
+void FeatureExtractionManager::setRegions(const RegionMap &regions)
+{
+    m_regions.clear();
+    for (const auto &r: regions) {
+        m_regions[r.first] = r.second;
+    }
+    for (const auto &r: regions) {
+        QString path = QFileInfo(r.first).absoluteFilePath();
+        if (m_regions.find(path) == m_regions.end()) {
+            m_regions[path] = r.second;
+        }
+    }
+}
+
+bool FeatureExtractionManager::hasRegionsFor(QString audioSource) const
+{
+    return m_regions.empty() ||
+        m_regions.find(audioSource) != m_regions.end() ||
+        m_regions.find(QFileInfo(audioSource).absoluteFilePath()) !=
+        m_regions.end();
+}
+
+void FeatureExtractionManager::setChannelLayouts(const map<TransformId, ChannelLayout> &layouts)
+{
+    m_channelLayouts = layouts;
+}
+
+bool FeatureExtractionManager::checkChannelLayouts() const
+{
+    bool good = true;
+    for (const auto &l: m_channelLayouts) {
+        if (m_usedChannelLayouts.find(l.first) == m_usedChannelLayouts.end()) {
+            SVCERR << "WARNING: Transform \"" << l.first << "\" was given"
+                   << " a channel layout, but is not among the requested"
+                   << " transforms" << endl;
+            good = false;
+        }
+    }
+    return good;
+}
+
+void FeatureExtractionManager::setCleanupAfterEachFile(bool cleanup)
+{
+    m_cleanupAfterEachFile = cleanup;
+}
+
+void FeatureExtractionManager::setProbeDurations(bool probe)
+{
+    m_probeDurations = probe;
+}
+
 static PluginSummarisingAdapter::SummaryType
 getSummaryType(string name)
 {
@@ -199,10 +412,32 @@ bool FeatureExtractionManager::addFeatureExtractor
         m_sampleRate = transform.getSampleRate();
     }
 
-    if (transform.getSampleRate() != m_sampleRate) {
-        SVCERR << "WARNING: Transform sample rate " << transform.getSampleRate() << " does not match previously specified transform rate of " << m_sampleRate << " -- only a single rate is supported for each run" << endl;
-        SVCERR << "WARNING: Using previous rate of " << m_sampleRate << " for this transform as well" << endl;
-        transform.setSampleRate(m_sampleRate);
+    ChannelLayout layout;
+    if (m_channelLayouts.find(transform.getIdentifier()) !=
+        m_channelLayouts.end()) {
+        layout = m_channelLayouts[transform.getIdentifier()];
+        m_usedChannelLayouts.insert(transform.getIdentifier());
+    }
+
+    if (layout.type == ChannelLayout::Single &&
+        m_channels > 0 && layout.channel >= m_channels) {
+        SVCERR << "ERROR: Transform \""
+               << transform.getIdentifier().toStdString()
+               << "\" asks for channel " << layout.channel + 1
+               << ", but the input has only " << m_channels
+               << " channel(s)" << endl;
+        return false;
+    }
+
+    if (m_transformPluginMap.empty()) {
+        m_layout = layout;
+    }
+
+    if (transform.getSampleRate() != m_sampleRate || !(layout == m_layout)) {
+        // Run it alongside the others, from audio resampled to its
+        // own rate and arranged in its own layout
+        return getGroupManager(transform.getSampleRate(), layout)
+            ->addFeatureExtractor(transform, writers);
     }
 
     shared_ptr<Plugin> plugin = nullptr;
@@ -343,8 +578,8 @@ bool FeatureExtractionManager::addFeatureExtractor
                 plugin = psa;
             }
 
-            if (!plugin->initialise(m_channels, m_blockSize, m_blockSize)) {
-                SVCERR << "ERROR: Plugin initialise (channels = " << m_channels << ", stepSize = " << m_blockSize << ", blockSize = " << m_blockSize << ") failed." << endl;    
+            if (!plugin->initialise(getPluginChannels(), m_blockSize, m_blockSize)) {
+                SVCERR << "ERROR: Plugin initialise (channels = " << getPluginChannels() << ", stepSize = " << m_blockSize << ", blockSize = " << m_blockSize << ") failed." << endl;    
                 return false;
             }
 
@@ -453,6 +688,55 @@ bool FeatureExtractionManager::addFeatureExtractor
     return true;
 }
 
+FeatureExtractionManager *
+FeatureExtractionManager::getGroupManager(sv_samplerate_t rate,
+                                          const ChannelLayout &layout)
+{
+    for (const auto &mgr: m_groupManagers) {
+        if (mgr->m_sampleRate == rate && mgr->m_layout == layout) {
+            return mgr.get();
+        }
+    }
+
+    if (rate != m_sampleRate) {
+        SVCERR << "NOTE: Transform sample rate " << rate
+               << " differs from previously specified transform rate of "
+               << m_sampleRate << "; audio will be read once at the highest"
+               << " rate needed and resampled for the others" << endl;
+    } else {
+        SVCERR << "NOTE: Transform channel layout differs from that of"
+               << " previously specified transform; audio will be read once"
+               << " and arranged separately for each layout" << endl;
+    }
+
+    unique_ptr<FeatureExtractionManager> mgr
+        (new FeatureExtractionManager(false));
+
+    mgr->m_blockSize = m_blockSize;
+    mgr->m_defaultSampleRate = m_defaultSampleRate;
+    mgr->m_sampleRate = rate;
+    mgr->m_channels = m_channels;
+    mgr->m_pluginThreads = m_pluginThreads;
+    mgr->m_summaries = m_summaries;
+    mgr->m_summariesOnly = m_summariesOnly;
+    mgr->m_boundaries = m_boundaries;
+    mgr->m_channelLayouts = m_channelLayouts;
+    mgr->m_layout = layout;
+
+    m_groupManagers.push_back(std::move(mgr));
+    return m_groupManagers.back().get();
+}
+
+sv_samplerate_t
+FeatureExtractionManager::getReadRate() const
+{
+    sv_samplerate_t rate = m_sampleRate;
+    for (const auto &mgr: m_groupManagers) {
+        rate = std::max(rate, mgr->m_sampleRate);
+    }
+    return rate;
+}
+
 bool FeatureExtractionManager::addDefaultFeatureExtractor
 (TransformId transformId, const vector<FeatureWriter*> &writers)
 {
@@ -604,17 +888,119 @@ bool FeatureExtractionManager::addFeatureExtractorFromFile
     return false;
 }
 
+bool FeatureExtractionManager::initialiseFrom(const FeatureExtractionManager &other,
+                                              const WriterMap &writerMap)
+{
+    m_blockSize = other.m_blockSize;
+    m_defaultSampleRate = other.m_defaultSampleRate;
+    m_sampleRate = other.m_sampleRate;
+    m_channels = other.m_channels;
+    m_normalise = other.m_normalise;
+    m_pluginThreads = other.m_pluginThreads;
+    m_multiplexThreads = other.m_multiplexThreads;
+    m_pipelined = other.m_pipelined;
+    m_streaming = other.m_streaming;
+    m_decodeCache = other.m_decodeCache;
+    m_decodeMemory = other.m_decodeMemory;
+    m_splitTransformIds = other.m_splitTransformIds;
+    m_splitSegments = other.m_splitSegments;
+    m_summaries = other.m_summaries;
+    m_summariesOnly = other.m_summariesOnly;
+    m_boundaries = other.m_boundaries;
+    m_channelLayouts = other.m_channelLayouts;
+    m_excerpts = other.m_excerpts;
+    m_excerptDuration = other.m_excerptDuration;
+    m_regions = other.m_regions;
+
+    // The transforms in the other manager's plugin map have already
+    // had their rate, step and block size and output filled in, so
+    // adding them again here gives us plugins configured identically
+    // (and shared between transforms in the same way). Going through
+    // m_orderedPlugins keeps the plugins in the same order as well.
+    // Transforms at other rates or with other layouts find their way
+    // to group managers set up in the same order as the other
+    // manager's.
+
+    vector<const FeatureExtractionManager *> managers { &other };
+    for (const auto &mgr: other.m_groupManagers) {
+        managers.push_back(mgr.get());
+    }
+
+    for (auto source: managers) {
+
+        for (auto plugin: source->m_orderedPlugins) {
+
+            PluginMap::const_iterator pi = source->m_plugins.find(plugin);
+
+            for (TransformWriterMap::const_iterator ti = pi->second.begin();
+                 ti != pi->second.end(); ++ti) {
+
+                vector<FeatureWriter *> writers;
+                for (auto w: ti->second) {
+                    WriterMap::const_iterator wi = writerMap.find(w);
+                    if (wi == writerMap.end()) {
+                        SVCERR << "ERROR: No replacement writer supplied for writer \""
+                               << w->getWriterTag() << "\"" << endl;
+                        return false;
+                    }
+                    writers.push_back(wi->second);
+                }
+
+                if (!addFeatureExtractor(ti->first, writers)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
 void FeatureExtractionManager::addSource(QString audioSource, bool willMultiplex)
 {
     SVCERR << "Have audio source: \"" << audioSource.toStdString() << "\"" << endl;
 
-    // We don't actually do anything with it here, unless it's the
-    // first audio source and we need it to establish default channel
-    // count and sample rate
+    // We don't actually read any audio here. We check that local
+    // files exist and read their headers, for the channel count and
+    // sample rate (if this is the first source and we need them for
+    // defaults) and for the duration. A file is only opened in full
+    // if its headers can't tell us something we need. We don't fetch
+    // remote files unless we need their defaults. A pipe can only
+    // be read once, so for those we open the reader now and keep it
+
+    bool needDefaults = (m_channels == 0 || m_defaultSampleRate == 0);
+    bool remote = FileSource::isRemote(audioSource);
+
+    AudioFileProbe::Info info;
+    bool probed = false;
+    bool fromHeaders = false;
+
+    if (PipeAudioFileReader::isPipe(audioSource)) {
+
+        if (m_normalise) {
+            throw FileOperationFailed
+                (audioSource, "audio from a pipe can't be normalised");
+        }
+
+        AudioFileReader *reader =
+            PipeAudioFileReader::create(audioSource, m_rawFormat);
+        if (!reader) {
+            throw FailedToOpenFile(audioSource);
+        }
+
+        info.channels = reader->getChannelCount();
+        info.sampleRate = reader->getSampleRate();
+        info.frameCount = 0;
+        probed = true;
 
-    if (m_channels == 0 || m_defaultSampleRate == 0) {
+        m_readyReaders[audioSource] = reader;
+        
+    } else if (needDefaults || !remote) {
 
-        ProgressPrinter retrievalProgress("Retrieving first input file to determine default rate and channel count...");
+        ProgressPrinter retrievalProgress
+            (needDefaults ?
+             "Retrieving first input file to determine default rate and channel count..." :
+             "Opening input file to check it...");
 
         FileSource source(audioSource, m_verbose ? &retrievalProgress : 0);
         if (!source.isAvailable()) {
@@ -629,42 +1015,82 @@ void FeatureExtractionManager::addSource(QString audioSource, bool willMultiplex
     
         source.waitForData();
 
-        // Open to determine validity, channel count, sample rate only
-        // (then close, and open again later with actual desired rate &c)
+        probed = AudioFileProbe::probe(source, info);
 
-        AudioFileReaderFactory::Parameters params;
-        params.normalisation = (m_normalise ?
-                                AudioFileReaderFactory::Normalisation::Peak :
-                                AudioFileReaderFactory::Normalisation::None);
+        bool needReader =
+            (!probed && (needDefaults || m_probeDurations)) ||
+            (probed && info.frameCount == 0 && m_probeDurations);
+
+        fromHeaders = (probed && !needReader);
         
-        AudioFileReader *reader =
-            AudioFileReaderFactory::createReader
-            (source, params, m_verbose ? &retrievalProgress : 0);
+        if (needReader) {
+
+            // Open to determine validity, channel count, sample rate
+            // and duration only (then close, and open again later
+            // with actual desired rate &c). If we are only after the
+            // duration, don't ask for normalisation, which would
+            // mean reading the whole file
+
+            AudioFileReaderFactory::Parameters params;
+            params.normalisation = (m_normalise && needDefaults ?
+                                    AudioFileReaderFactory::Normalisation::Peak :
+                                    AudioFileReaderFactory::Normalisation::None);
+        
+            AudioFileReader *reader =
+                AudioFileReaderFactory::createReader
+                (source, params, m_verbose ? &retrievalProgress : 0);
     
-        if (!reader) {
-            throw FailedToOpenFile(audioSource);
+            if (!reader) {
+                throw FailedToOpenFile(audioSource);
+            }
+
+            info.channels = reader->getChannelCount();
+            info.sampleRate = reader->getNativeRate();
+            info.frameCount = reader->getFrameCount();
+            probed = true;
+
+            if (needDefaults) {
+                m_readyReaders[audioSource] = reader;
+            } else {
+                delete reader;
+            }
         }
 
         if (m_verbose) retrievalProgress.done();
+    }
+
+    if (probed) {
 
         SVCERR << "File or URL \"" << audioSource.toStdString() << "\" opened successfully" << endl;
 
         if (!willMultiplex) {
             if (m_channels == 0) {
-                m_channels = reader->getChannelCount();
+                m_channels = info.channels;
                 SVCERR << "Taking default channel count of "
-                     << reader->getChannelCount() << " from audio file" << endl;
+                     << info.channels << " from audio file" << endl;
             }
         }
 
         if (m_defaultSampleRate == 0) {
-            m_defaultSampleRate = reader->getNativeRate();
+            m_defaultSampleRate = info.sampleRate;
             SVCERR << "Taking default sample rate of "
-                 << reader->getNativeRate() << "Hz from audio file" << endl;
+                 << info.sampleRate << "Hz from audio file" << endl;
             SVCERR << "(Note: Default may be overridden by transforms)" << endl;
         }
 
-        m_readyReaders[audioSource] = reader;
+        if (info.frameCount > 0) {
+            m_sourceDurations[audioSource] =
+                double(info.frameCount) / info.sampleRate;
+            if (m_probeDurations) {
+                SVCERR << "Found duration of "
+                       << m_sourceDurations[audioSource] << "s and "
+                       << info.channels << " channel(s) for \""
+                       << audioSource.toStdString() << "\", from "
+                       << (fromHeaders ? "file headers" : "opening file")
+                       << endl;
+            }
+        }
+        m_sourceChannels[audioSource] = info.channels;
     }
 
     if (willMultiplex) {
@@ -674,6 +1100,90 @@ void FeatureExtractionManager::addSource(QString audioSource, bool willMultiplex
     }
 }
 
+double FeatureExtractionManager::getSourceDuration(QString audioSource) const
+{
+    return m_sourceDurations.value(audioSource, 0.0);
+}
+
+size_t FeatureExtractionManager::estimateDecodedSize(QString audioSource) const
+{
+    // The most a reader could hold: every channel of the file, at
+    // the rate we read at. If we couldn't find out how long the
+    // file is, we can't say
+    double duration = getSourceDuration(audioSource);
+    if (duration <= 0.0) {
+        return SourcePrefetcher::unknownSize;
+    }
+    double frames = duration * getReadRate();
+    int channels = m_sourceChannels.value(audioSource, m_channels);
+    return size_t(frames * std::max(channels, m_channels) * sizeof(float));
+}
+
+size_t FeatureExtractionManager::estimateMemoryFootprint(QString audioSource,
+                                                        bool outputBuffered) const
+{
+    double duration = getSourceDuration(audioSource);
+    double rate = (m_sampleRate != 0 ? getReadRate() : m_defaultSampleRate);
+
+    double bytes = duration * rate * m_channels * sizeof(float);
+
+    bytes += estimateFeatureBytes(duration, outputBuffered);
+    for (const auto &mgr: m_groupManagers) {
+        bytes += mgr->estimateFeatureBytes(duration, outputBuffered);
+    }
+
+    return size_t(bytes);
+}
+
+double FeatureExtractionManager::estimateFeatureBytes(double duration,
+                                                      bool outputBuffered) const
+{
+    double rate = (m_sampleRate != 0 ? m_sampleRate : m_defaultSampleRate);
+    double frames = duration * rate;
+
+    double bytes = 0.0;
+
+    // Each feature is a vector of values with timestamps and a label
+    // around it. A summarising adapter keeps something comparable
+    // for every value it will summarise.
+    const double bytesPerValue = sizeof(float) * 2;
+    const double bytesPerFeature = 96;
+
+    for (const auto &pi: m_plugins) {
+
+        auto poi = m_pluginOutputs.find(pi.first);
+        if (poi == m_pluginOutputs.end()) continue;
+
+        for (const auto &ti: pi.second) {
+
+            const Transform &transform = ti.first;
+
+            bool summarised = (!m_summaries.empty() ||
+                               transform.getSummaryType() != Transform::NoSummary);
+            if (!summarised && !outputBuffered) continue;
+
+            auto oi = poi->second.find(transform.getOutput().toStdString());
+            if (oi == poi->second.end()) continue;
+            const Vamp::Plugin::OutputDescriptor &desc = oi->second;
+
+            double values = (desc.hasFixedBinCount ? desc.binCount : 1);
+
+            // For variable-rate outputs we have no idea, so assume
+            // (generously) one feature per step
+            double count = frames / std::max(1, transform.getStepSize());
+            if (desc.sampleType ==
+                Vamp::Plugin::OutputDescriptor::FixedSampleRate &&
+                desc.sampleRate > 0) {
+                count = duration * desc.sampleRate;
+            }
+
+            bytes += count * (values * bytesPerValue + bytesPerFeature);
+        }
+    }
+
+    return bytes;
+}
+
 void FeatureExtractionManager::extractFeatures(QString audioSource)
 {
     if (m_plugins.empty()) return;
@@ -712,321 +1222,1556 @@ void FeatureExtractionManager::extractFeaturesMultiplexed(QStringList sources)
 
     QList<AudioFileReader *> readers;
     foreach (QString source, sources) {
-        AudioFileReader *reader = prepareReader(source);
+        AudioFileReader *reader = prepareReader(source, true);
         readers.push_back(reader);
     }
 
-    AudioFileReader *reader = new MultiplexedReader(readers);
+    AudioFileReader *reader = new MultiplexedReader(readers,
+                                                    m_multiplexThreads);
     extractFeaturesFor(reader, nominalSource); // Note this also deletes reader
 }
 
+static bool
+isOpenEnded(const AudioFileReader *reader)
+{
+    auto dr = dynamic_cast<const DeinterleavingReader *>(reader);
+    return dr && dr->isOpenEnded();
+}
+
+// The end frame of an open-ended reader until we reach it
+static const sv_frame_t unknownEndFrame =
+    std::numeric_limits<sv_frame_t>::max();
+
 AudioFileReader *
-FeatureExtractionManager::prepareReader(QString source)
+FeatureExtractionManager::prepareReader(QString source, bool needLength)
 {
     AudioFileReader *reader = 0;
+    sv_samplerate_t rate = getReadRate();
+
     if (m_readyReaders.contains(source)) {
         reader = m_readyReaders[source];
         m_readyReaders.remove(source);
-        if (reader->getSampleRate() != m_sampleRate) {
-            // can't use this; open it again
+        if (reader->getSampleRate() != rate) {
+            // can't use this; open it again, unless it's a pipe
             delete reader;
             reader = 0;
+            if (PipeAudioFileReader::isPipe(source)) {
+                throw FileOperationFailed
+                    (source, QString("audio from a pipe can't be resampled, "
+                                     "and the transforms need %1Hz")
+                     .arg(rate));
+            }
+        } else if (m_decodeCache && !isOpenEnded(reader)) {
+            m_decodeCache->store(reader->getLocalFilename(), reader,
+                                 rate, m_normalise);
         }
     }
 
-    if (!reader) {
-        ProgressPrinter retrievalProgress("Retrieving audio data...");
-        FileSource fs(source, m_verbose ? &retrievalProgress : 0);
-        fs.waitForData();
-
-        AudioFileReaderFactory::Parameters params;
-        params.targetRate = m_sampleRate;
-        params.normalisation = (m_normalise ?
-                                AudioFileReaderFactory::Normalisation::Peak :
-                                AudioFileReaderFactory::Normalisation::None);
-        
-        reader = AudioFileReaderFactory::createReader
-            (fs, params, m_verbose ? &retrievalProgress : 0);
-        if (m_verbose) retrievalProgress.done();
+    if (!reader && m_prefetcher) {
+        reader = m_prefetcher->take(source);
+        if (reader && needLength && isOpenEnded(reader) &&
+            !PipeAudioFileReader::isPipe(source)) {
+            // Prefetched as a stream, but we can't use one here
+            delete reader;
+            reader = 0;
+        }
     }
-    
+
     if (!reader) {
-        throw FailedToOpenFile(source);
+        reader = openReader(source, false, needLength);
     }
+
     if (reader->getChannelCount() != m_channels ||
-        reader->getNativeRate() != m_sampleRate) {
+        reader->getNativeRate() != rate) {
         SVCERR << "NOTE: File will be mixed or resampled for processing, to: "
              << m_channels << "ch at " 
-             << m_sampleRate << "Hz" << endl;
+             << rate << "Hz" << endl;
     }
     return reader;
 }
 
-void
-FeatureExtractionManager::extractFeaturesFor(AudioFileReader *reader,
-                                             QString audioSource)
+static void
+removeRetrievedCopy(QString source, QString localFilename)
 {
-    // Note: This also deletes reader
+    // A remote source is retrieved into the temporary directory. A
+    // local one is read where it is, and must of course be left alone
+    if (localFilename == "" || localFilename == source ||
+        QFileInfo(localFilename).absoluteFilePath() ==
+        QFileInfo(source).absoluteFilePath()) {
+        return;
+    }
+    QString tempPath = QDir(TempDirectory::getInstance()->getPath())
+        .absolutePath() + "/";
+    if (!QFileInfo(localFilename).absoluteFilePath().startsWith(tempPath)) {
+        return;
+    }
+    if (QFile::remove(localFilename)) {
+        SVDEBUG << "FeatureExtractionManager: removed retrieved copy \""
+                << localFilename << "\" of \"" << source << "\"" << endl;
+    }
+}
 
-    SVCERR << "Audio file \"" << audioSource.toStdString() << "\": "
-         << reader->getChannelCount() << "ch at " 
-         << reader->getNativeRate() << "Hz" << endl;
+static float
+getNormalisingGain(float peak)
+{
+    return (peak > 0.f ? 1.f / peak : 1.f);
+}
 
-    // allocate audio buffers
-    float **data = new float *[m_channels];
-    for (int c = 0; c < m_channels; ++c) {
-        data[c] = new float[m_blockSize];
-    }
+AudioFileReader *
+FeatureExtractionManager::openReader(QString source, bool background,
+                                     bool needLength)
+{
+    // This may be called from a prefetcher thread, so it must not
+    // touch anything that changes during extraction, and it reports
+    // progress only when called from the extraction thread
     
-    struct LifespanMgr { // unintrusive hack introduced to ensure
-                         // destruction on exceptions
-        AudioFileReader *m_r;
-        int m_c;
-        float **m_d;
-        LifespanMgr(AudioFileReader *r, int c, float **d) :
-            m_r(r), m_c(c), m_d(d) { }
-        ~LifespanMgr() { destroy(); }
-        void destroy() {
-            if (!m_r) return;
-            delete m_r;
-            for (int i = 0; i < m_c; ++i) delete[] m_d[i];
-            delete[] m_d;
-            m_r = 0;
-        }
-    };
-    LifespanMgr lifemgr(reader, m_channels, data);
+    AudioFileReader *reader = 0;
+    sv_samplerate_t rate = getReadRate();
+    bool decoded = false; // so worth keeping in the decode cache
+    bool reporting = (m_verbose && !background);
 
-    sv_frame_t frameCount = reader->getFrameCount();
-    
-    SVDEBUG << "FeatureExtractionManager: file has " << frameCount << " frames" << endl;
+    {
+        ProgressPrinter retrievalProgress("Retrieving audio data...");
+        FileSource fs(source, reporting ? &retrievalProgress : 0);
+        fs.waitForData();
 
-    sv_frame_t earliestStartFrame = 0;
-    sv_frame_t latestEndFrame = frameCount;
-    bool haveExtents = false;
+        QString localFilename = fs.getLocalFilename();
 
-    for (auto plugin: m_orderedPlugins) {
+        // Normalising needs only a gain, once the peak is known. It
+        // may have been recorded in the decode cache by an earlier
+        // run; otherwise the readers below that see all of the audio
+        // as they open find it for themselves.
+        float peak = 0.f;
+        bool havePeak = false;
+        if (m_normalise && m_decodeCache) {
+            havePeak = m_decodeCache->getPeak(localFilename, rate, peak);
+        }
 
-        PluginMap::iterator pi = m_plugins.find(plugin);
+        // Uncompressed files already at our rate can be read in
+        // place, with no decoding. Finding the peak of one costs
+        // little more than reading through it.
+        MappedAudioFileReader *mapped =
+            MappedAudioFileReader::create(fs, rate);
+        if (mapped && m_normalise) {
+            if (!havePeak) {
+                peak = mapped->findPeak();
+                havePeak = true;
+                if (m_decodeCache) {
+                    m_decodeCache->storePeak(localFilename, rate, peak);
+                }
+            }
+            mapped->setGain(getNormalisingGain(peak));
+        }
+        reader = mapped;
+
+        if (!reader && m_decodeCache) {
+            mapped = m_decodeCache->open(localFilename, rate, m_normalise);
+            if (!mapped && m_normalise && havePeak) {
+                // Unnormalised audio will do, given its peak
+                mapped = m_decodeCache->open(localFilename, rate, false);
+                if (mapped) {
+                    mapped->setGain(getNormalisingGain(peak));
+                }
+            }
+            reader = mapped;
+        }
 
-        SVDEBUG << "FeatureExtractionManager: Calling reset on " << plugin << endl;
-        plugin->reset();
+        // Split transforms and excerpts read from several places at
+        // once or out of order, so can't be read from a stream, and a
+        // stream can only be normalised if we already know its peak.
+        // A stream's length isn't known until we reach its end, so
+        // it can't be used where that is needed first either, as for
+        // placing regions
+        if (!reader && m_streaming && (!m_normalise || havePeak) &&
+            !needLength && m_splitTransformIds.empty() &&
+            m_excerpts.empty() && m_regions.empty()) {
+            StreamingAudioFileReader *streaming =
+                StreamingAudioFileReader::create(fs, rate);
+            if (streaming && m_normalise) {
+                streaming->setGain(getNormalisingGain(peak));
+            }
+            reader = streaming;
+        }
+
+        if (!reader && m_decodeMemory) {
+            InMemoryAudioFileReader *inMemory =
+                InMemoryAudioFileReader::create(fs, rate, m_decodeMemory);
+            if (inMemory) {
+                if (m_normalise) {
+                    inMemory->setGain(getNormalisingGain(inMemory->getPeak()));
+                }
+                if (m_decodeCache) {
+                    m_decodeCache->storePeak(localFilename, rate,
+                                             inMemory->getPeak());
+                }
+                decoded = true;
+            }
+            reader = inMemory;
+        }
+
+        if (!reader) {
+            AudioFileReaderFactory::Parameters params;
+            params.targetRate = rate;
+            params.normalisation = (m_normalise ?
+                                    AudioFileReaderFactory::Normalisation::Peak :
+                                    AudioFileReaderFactory::Normalisation::None);
+        
+            reader = AudioFileReaderFactory::createReader
+                (fs, params, reporting ? &retrievalProgress : 0);
+            decoded = true;
+        }
+        
+        if (reporting) retrievalProgress.done();
+    }
+    
+    if (!reader) {
+        throw FailedToOpenFile(source);
+    }
+    if (decoded && m_decodeCache) {
+        m_decodeCache->store(reader->getLocalFilename(), reader,
+                             rate, m_normalise);
+    }
+    return reader;
+}
+
+static sv_frame_t
+lcm(sv_frame_t a, sv_frame_t b)
+{
+    sv_frame_t x = a, y = b;
+    while (y != 0) {
+        sv_frame_t t = x % y;
+        x = y;
+        y = t;
+    }
+    return (a / x) * b;
+}
+
+void
+FeatureExtractionManager::getFrameRange(sv_frame_t frameCount,
+                                        sv_frame_t &startFrame,
+                                        sv_frame_t &endFrame)
+{
+    // The range of frames we need to read to cover every transform's
+    // start time and duration, for a file of the given length
+
+    sv_frame_t earliestStartFrame = 0;
+    sv_frame_t latestEndFrame = frameCount;
+    bool haveExtents = false;
+
+    for (auto plugin: m_orderedPlugins) {
+
+        PluginMap::iterator pi = m_plugins.find(plugin);
 
         for (TransformWriterMap::iterator ti = pi->second.begin();
              ti != pi->second.end(); ++ti) {
 
-            const Transform &transform = ti->first;
+            const Transform &transform = ti->first;
+
+            sv_frame_t transformStart = RealTime::realTime2Frame
+                (transform.getStartTime(), m_sampleRate);
+            sv_frame_t duration = RealTime::realTime2Frame
+                (transform.getDuration(), m_sampleRate);
+            if (duration == 0) {
+                duration = frameCount - transformStart;
+            }
+
+            if (!haveExtents || transformStart < earliestStartFrame) {
+                earliestStartFrame = transformStart;
+            }
+            if (!haveExtents || transformStart + duration > latestEndFrame) {
+                latestEndFrame = transformStart + duration;
+            }
+
+/*
+            SVDEBUG << "startFrame for transform " << transformStart << endl;
+            SVDEBUG << "duration for transform " << duration << endl;
+            SVDEBUG << "earliestStartFrame becomes " << earliestStartFrame << endl;
+            SVDEBUG << "latestEndFrame becomes " << latestEndFrame << endl;
+*/
+            haveExtents = true;
+
+            string outputId = transform.getOutput().toStdString();
+            if (m_pluginOutputs[plugin].find(outputId) ==
+                m_pluginOutputs[plugin].end()) {
+                // We shouldn't actually reach this point:
+                // addFeatureExtractor tests whether the output exists
+                SVCERR << "ERROR: Nonexistent plugin output \"" << outputId << "\" requested for transform \""
+                     << transform.getIdentifier().toStdString() << "\", ignoring this transform"
+                     << endl;
+
+                SVDEBUG << "Known outputs for all plugins are as follows:" << endl;
+                for (PluginOutputMap::const_iterator k = m_pluginOutputs.begin();
+                     k != m_pluginOutputs.end(); ++k) {
+                    SVDEBUG << "Plugin " << k->first << ": ";
+                    if (k->second.empty()) {
+                        SVDEBUG << "(none)";
+                    }
+                    for (OutputMap::const_iterator i = k->second.begin();
+                         i != k->second.end(); ++i) {
+                        SVDEBUG << "\"" << i->first << "\" ";
+                    }
+                    SVDEBUG << endl;
+                }
+            }
+        }
+    }
+    
+    startFrame = earliestStartFrame;
+    endFrame = latestEndFrame;
+}
+
+bool
+FeatureExtractionManager::isRangeOpenEnded() const
+{
+    for (const auto &pi: m_plugins) {
+        for (const auto &ti: pi.second) {
+            if (RealTime::realTime2Frame(ti.first.getDuration(),
+                                         m_sampleRate) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void
+FeatureExtractionManager::extractFeaturesFor(AudioFileReader *reader,
+                                             QString audioSource)
+{
+    // Note: This also deletes reader
+
+    SVCERR << "Audio file \"" << audioSource.toStdString() << "\": "
+         << reader->getChannelCount() << "ch at " 
+         << reader->getNativeRate() << "Hz" << endl;
+
+    // allocate audio buffers
+    float **data = new float *[m_channels];
+    for (int c = 0; c < m_channels; ++c) {
+        data[c] = new float[m_blockSize];
+    }
+    
+    struct LifespanMgr { // unintrusive hack introduced to ensure
+                         // destruction on exceptions
+        AudioFileReader *m_r;
+        int m_c;
+        float **m_d;
+        LifespanMgr(AudioFileReader *r, int c, float **d) :
+            m_r(r), m_c(c), m_d(d) { }
+        ~LifespanMgr() { destroy(); }
+        void destroy() {
+            if (!m_r) return;
+            delete m_r;
+            for (int i = 0; i < m_c; ++i) delete[] m_d[i];
+            delete[] m_d;
+            m_r = 0;
+        }
+    };
+    LifespanMgr lifemgr(reader, m_channels, data);
+
+    // Where a remote source was retrieved to, for cleaning up after
+    QString localFilename = reader->getLocalFilename();
+
+    sv_frame_t frameCount = reader->getFrameCount();
+    
+    SVDEBUG << "FeatureExtractionManager: file has " << frameCount << " frames" << endl;
+
+    sv_frame_t startFrame = 0, endFrame = 0;
+    getFrameRange(frameCount, startFrame, endFrame);
+
+    // We'll find out where the end is when we get there, unless
+    // every transform has a duration and so the end is known already
+    bool openEnded = isOpenEnded(reader);
+    if (openEnded && isRangeOpenEnded()) {
+        endFrame = unknownEndFrame;
+    }
+
+    // Excerpts and regions are placed using the length of the file
+    bool windowed = ((!m_excerpts.empty() || !m_regions.empty()) &&
+                     !hasTransformGroups());
+    if (windowed && openEnded) {
+        throw FileOperationFailed
+            (audioSource, "audio from a pipe can't be read in excerpts or regions");
+    }
+
+    FeatureWriter::TrackMetadata metadata = getTrackMetadata(reader);
+    if (openEnded && getSourceDuration(audioSource) > 0.0) {
+        // A streamed file was probed for its duration when added,
+        // which is better than nothing
+        metadata.duration =
+            RealTime::fromSeconds(getSourceDuration(audioSource));
+    }
+    
+    setTrackMetadata(audioSource, metadata);
+    prepareBlockProcessing();
+
+    for (const auto &mgr: m_groupManagers) {
+        mgr->setTrackMetadata(audioSource, metadata);
+        mgr->prepareBlockProcessing();
+    }
+
+    // If any plugins can be split, we keep the first segment of the
+    // file for our own instances of them, and give each of the rest
+    // to a segment manager running on a thread of its own. Segment
+    // boundaries fall on both our block grid and every split
+    // plugin's step grid, so each instance sees its blocks at the
+    // same positions as a single instance would have done, and each
+    // segment is read from some way before its start (and after its
+    // end) so that the plugins have the context they need there.
+
+    m_segmenting = false;
+    int segments = 0;
+    vector<sv_frame_t> bounds;
+    vector<SegmentFeatures> segmentFeatures;
+    vector<std::exception_ptr> segmentErrors;
+
+    struct Joiner { // ensure threads are gone before the reader is
+        vector<std::thread> threads;
+        ~Joiner() { join(); }
+        void join() {
+            for (auto &t: threads) if (t.joinable()) t.join();
+        }
+    } segmentThreads;
+
+    if (!openEnded && !hasTransformGroups() && !windowed &&
+        prepareSegments()) {
+
+        sv_frame_t grid = m_blockSize;
+        sv_frame_t context = 0;
+        for (int p: m_splitPlugins) {
+            const Transform &t = m_plugins[m_orderedPlugins[p]].begin()->first;
+            grid = lcm(grid, std::max(1, t.getStepSize()));
+            context = std::max(context,
+                               sv_frame_t(t.getBlockSize() + t.getStepSize()));
+        }
+        sv_frame_t preroll = ((context + grid - 1) / grid) * grid;
+        sv_frame_t length = endFrame - startFrame;
+
+        // Don't split so finely that the overlap between segments
+        // becomes a significant part of the work
+        segments = int(m_segmentManagers.size()) + 1;
+        while (segments > 1 && length / segments < preroll * 8) {
+            --segments;
+        }
+
+        if (segments > 1) {
+            for (int k = 0; k < segments; ++k) {
+                bounds.push_back(startFrame +
+                                 ((length * k / segments) / grid) * grid);
+            }
+            bounds.push_back(endFrame);
+            m_segmenting = true;
+            m_segmentFeedEnd = std::min(endFrame, bounds[1] + preroll);
+            m_segmentLimit = RealTime::frame2RealTime(bounds[1], m_sampleRate);
+            SVDEBUG << "FeatureExtractionManager: splitting into " << segments
+                    << " segments with pre-roll " << preroll << endl;
+        }
+
+        segmentFeatures.resize(segments);
+        segmentErrors.resize(segments);
+
+        for (int k = 1; k < segments; ++k) {
+            sv_frame_t from = bounds[k] - preroll;
+            sv_frame_t to = std::min(endFrame, bounds[k+1] + preroll);
+            RealTime keepFrom = RealTime::frame2RealTime(bounds[k], m_sampleRate);
+            RealTime keepTo = RealTime::frame2RealTime(bounds[k+1], m_sampleRate);
+            bool last = (k + 1 == segments);
+            FeatureExtractionManager *mgr = m_segmentManagers[k-1].get();
+            segmentThreads.threads.push_back
+                (std::thread([=, &segmentFeatures, &segmentErrors]() {
+                        try {
+                            mgr->extractSegment(reader, from, to, keepFrom,
+                                                last ? 0 : &keepTo,
+                                                segmentFeatures[k]);
+                        } catch (...) {
+                            segmentErrors[k] = std::current_exception();
+                        }
+                    }));
+        }
+    }
+
+    ProgressPrinter extractionProgress("Extracting and writing features...");
+
+    if (hasTransformGroups()) {
+        extractBlocksGrouped(reader, data, audioSource, openEnded,
+                               extractionProgress);
+    } else if (windowed) {
+        extractWindows(reader, data, audioSource,
+                       m_excerpts.empty() ?
+                       getRegionWindows(audioSource, frameCount) :
+                       getExcerptWindows(audioSource, frameCount),
+                       extractionProgress);
+    } else if (m_pipelined) {
+        extractBlocksPipelined(reader, audioSource, startFrame, endFrame,
+                               extractionProgress);
+    } else {
+        extractBlocks(reader, data, audioSource, startFrame, endFrame,
+                      extractionProgress);
+    }
+
+    SVDEBUG << "FeatureExtractionManager: deleting audio file reader" << endl;
+
+    segmentThreads.join();
+    for (auto e: segmentErrors) {
+        if (e) std::rethrow_exception(e);
+    }
+
+    lifemgr.destroy(); // deletes reader, data
+
+    if (!windowed) {
+        writeRemainingFeatures(audioSource, segments, segmentFeatures);
+    }
+
+    for (const auto &mgr: m_groupManagers) {
+        mgr->writeRemainingFeatures(audioSource, 0, {});
+    }
+
+    if (m_verbose) extractionProgress.done();
+
+    finish();
+
+    if (m_cleanupAfterEachFile) {
+        // Prefetched readers may be decoding into the temporary
+        // directory, so we can only clear it out while none is
+        // waiting, which with a steady stream of sources may be
+        // never. So we also remove what was retrieved for this
+        // source in particular; each reader removes its own decode
+        // cache file when deleted anyway.
+        auto cleanup = []() { TempDirectory::getInstance()->cleanup(); };
+        if (!m_prefetcher) {
+            cleanup();
+        } else if (!m_prefetcher->runIfIdle(cleanup) &&
+                   !m_prefetcher->isWanted(audioSource)) {
+            removeRetrievedCopy(audioSource, localFilename);
+        }
+    }
+}
+
+void
+FeatureExtractionManager::prepareBlockProcessing()
+{
+    for (auto plugin: m_orderedPlugins) {
+        SVDEBUG << "FeatureExtractionManager: Calling reset on " << plugin << endl;
+        plugin->reset();
+    }
+
+    // Each plugin's process call for a block is a separate task, so
+    // that independent plugins can run at the same time if we have
+    // more than one plugin thread. They all read the same data
+    // buffers, but each has its own feature set to return results
+    // in, and we write those in m_orderedPlugins order only once all
+    // the plugins have finished with the block, so the output is
+    // the same however many threads we use.
+
+    int pluginCount = int(m_orderedPlugins.size());
+    m_featureSets = vector<Plugin::FeatureSet>(pluginCount);
+    m_active = vector<char>(pluginCount, 0);
+
+    m_processTasks.clear();
+    for (int p = 0; p < pluginCount; ++p) {
+        m_processTasks.push_back([this, p]() {
+                m_featureSets[p].clear();
+                if (m_active[p]) {
+                    m_featureSets[p] = m_orderedPlugins[p]->process
+                        (m_blockData, m_blockTimestamp.toVampRealTime());
+                }
+            });
+    }
+
+    if (m_pluginThreads > 1 && pluginCount > 1) {
+        int threads = std::min(m_pluginThreads, pluginCount);
+        if (!m_taskPool || m_taskPool->getSize() != threads) {
+            m_taskPool.reset(new TaskPool(threads));
+        }
+    } else {
+        m_taskPool.reset();
+    }
+}
+
+void
+FeatureExtractionManager::writeRemainingFeatures(QString audioSource,
+                                                 int segments,
+                                                 const vector<SegmentFeatures> &segmentFeatures)
+{
+    int pluginCount = int(m_orderedPlugins.size());
+
+    vector<TaskPool::Task> remainingTasks;
+    for (int p = 0; p < pluginCount; ++p) {
+        remainingTasks.push_back([this, p]() {
+                m_featureSets[p] = m_orderedPlugins[p]->getRemainingFeatures();
+            });
+    }
+
+    if (m_taskPool) {
+        m_taskPool->run(remainingTasks);
+    } else {
+        for (const auto &task: remainingTasks) task();
+    }
+
+    for (int p = 0; p < pluginCount; ++p) {
+
+        auto plugin = m_orderedPlugins[p];
+        Plugin::FeatureSet featureSet = m_featureSets[p];
+
+        if (m_segmenting && m_isSplit[p]) {
+            featureSet = selectFeatures(featureSet, 0, &m_segmentLimit);
+        }
+
+        if (!m_summariesOnly) {
+            writeFeatures(audioSource, plugin, featureSet);
+        }
+
+        if (m_segmenting && m_isSplit[p] && !m_summariesOnly) {
+            // Then everything from the other segments, in order
+            int j = int(std::find(m_splitPlugins.begin(), m_splitPlugins.end(), p)
+                        - m_splitPlugins.begin());
+            for (int k = 1; k < segments; ++k) {
+                for (const auto &fs: segmentFeatures[k][j]) {
+                    writeFeatures(audioSource, plugin, fs);
+                }
+            }
+        }
+
+        writeSummaries(audioSource, plugin);
+    }
+
+}
+
+sv_frame_t
+FeatureExtractionManager::readBlock(ReadAheadBuffer &source,
+                                    sv_frame_t frame,
+                                    float *const *data) const
+{
+    // We have to do our own channel handling here; we can't just
+    // leave it to the plugin adapter because the same plugin
+    // adapter may have to serve for input files with various
+    // numbers of channels (so the adapter is simply configured
+    // with a fixed channel count).
+
+    return source.readChannels(frame, m_blockSize, m_channels, data);
+}
+
+bool
+FeatureExtractionManager::isPastEnd(AudioFileReader *reader,
+                                    sv_frame_t frame, sv_frame_t got,
+                                    sv_frame_t &endFrame)
+{
+    if (got == 0 && endFrame == unknownEndFrame) {
+        // Now we know the length, the range is found just as it
+        // would have been for a file of this length
+        auto dr = dynamic_cast<const DeinterleavingReader *>(reader);
+        sv_frame_t startFrame = 0;
+        getFrameRange(dr->getFramesRead(), startFrame, endFrame);
+        SVDEBUG << "FeatureExtractionManager: open-ended audio has "
+                << dr->getFramesRead() << " frames" << endl;
+    }
+    return frame >= endFrame;
+}
+
+const float *
+FeatureExtractionManager::getDirectBlock(AudioFileReader *reader,
+                                         sv_frame_t frame) const
+{
+    if (m_channels != 1) return 0;
+    auto dr = dynamic_cast<const DeinterleavingReader *>(reader);
+    if (!dr) return 0;
+    return dr->getChannelData(frame, m_blockSize);
+}
+
+void
+FeatureExtractionManager::processBlock(const float *const *data, sv_frame_t i)
+{
+    // Results go to m_featureSets, with m_active showing which of
+    // them are meaningful
+
+    m_blockData = data;
+    m_blockTimestamp = RealTime::frame2RealTime(i, m_sampleRate);
+
+    // Skip any plugin none of whose transforms have come around
+    // yet
+    for (int p = 0; p < int(m_orderedPlugins.size()); ++p) {
+        m_active[p] = isInRange(m_orderedPlugins[p], i);
+        if (m_segmenting && m_isSplit[p] && i >= m_segmentFeedEnd) {
+            // The rest of the file is being handled by the segment
+            // managers
+            m_active[p] = false;
+        }
+    }
+
+    if (m_taskPool) {
+        m_taskPool->run(m_processTasks);
+    } else {
+        for (const auto &task: m_processTasks) task();
+    }
+
+    m_blockData = 0;
+}
+
+void
+FeatureExtractionManager::writeBlockFeatures(QString audioSource,
+                                             const vector<Plugin::FeatureSet> &featureSets,
+                                             const vector<char> &active)
+{
+    if (m_summariesOnly) return;
+    
+    for (int p = 0; p < int(m_orderedPlugins.size()); ++p) {
+        if (!active[p]) continue;
+        if (m_segmenting && m_isSplit[p]) {
+            writeFeatures(audioSource, m_orderedPlugins[p],
+                          selectFeatures(featureSets[p], 0, &m_segmentLimit));
+        } else {
+            writeFeatures(audioSource, m_orderedPlugins[p], featureSets[p]);
+        }
+    }
+}
+
+void
+FeatureExtractionManager::extractBlocks(AudioFileReader *reader,
+                                        float **data,
+                                        QString audioSource,
+                                        sv_frame_t startFrame,
+                                        sv_frame_t endFrame,
+                                        ProgressPrinter &extractionProgress)
+{
+    int progress = 0;
+    bool showProgress = (m_verbose && endFrame != unknownEndFrame);
+
+    ReadAheadBuffer source(reader);
+
+    for (sv_frame_t i = startFrame; i < endFrame; i += m_blockSize) {
+        
+        const float *direct = getDirectBlock(reader, i);
+
+        if (direct) {
+            processBlock(&direct, i);
+        } else {
+            sv_frame_t got = readBlock(source, i, data);
+            if (isPastEnd(reader, i, got, endFrame)) {
+                break;
+            }
+            processBlock(data, i);
+        }
+
+        writeBlockFeatures(audioSource, m_featureSets, m_active);
+
+        if (!showProgress) continue;
+
+        int pp = progress;
+        progress = int((double(i - startFrame) * 100.0) /
+                       double(endFrame - startFrame) + 0.1);
+        if (progress > pp) extractionProgress.setProgress(progress);
+    }
+}
+
+vector<FeatureExtractionManager::Window>
+FeatureExtractionManager::getExcerptWindows(QString audioSource,
+                                            sv_frame_t frameCount) const
+{
+    vector<Window> windows;
+    sv_frame_t length = sv_frame_t(round(m_excerptDuration * m_sampleRate));
+
+    for (int k = 0; k < int(m_excerpts.size()); ++k) {
+
+        const Excerpt &excerpt = m_excerpts[k];
+        sv_frame_t startFrame = sv_frame_t
+            (round(excerpt.relative ?
+                   excerpt.start * double(frameCount) :
+                   excerpt.start * m_sampleRate));
+
+        if (startFrame >= frameCount) {
+            SVCERR << "NOTE: Excerpt " << k + 1 << " would start after the end of \""
+                   << audioSource.toStdString() << "\", skipping it" << endl;
+            continue;
+        }
+
+        windows.push_back({ startFrame,
+                            std::min(frameCount, startFrame + length),
+                            QString("excerpt %1").arg(k + 1).toStdString() });
+    }
+
+    return windows;
+}
+
+vector<FeatureExtractionManager::Window>
+FeatureExtractionManager::getRegionWindows(QString audioSource,
+                                           sv_frame_t frameCount) const
+{
+    auto ri = m_regions.find(audioSource);
+    if (ri == m_regions.end()) {
+        ri = m_regions.find(QFileInfo(audioSource).absoluteFilePath());
+    }
+    if (ri == m_regions.end()) {
+        SVCERR << "NOTE: No regions listed for \""
+               << audioSource.toStdString() << "\", skipping it" << endl;
+        return {};
+    }
+
+    vector<Window> windows;
+    for (const Region &region: ri->second) {
+        sv_frame_t startFrame = std::max
+            (sv_frame_t(0), sv_frame_t(round(region.start * m_sampleRate)));
+        sv_frame_t endFrame = std::min
+            (frameCount, sv_frame_t(round(region.end * m_sampleRate)));
+        if (endFrame > startFrame) {
+            windows.push_back({ startFrame, endFrame, "" });
+        }
+    }
+
+    // In order, so that streamed audio is read forwards, and joined
+    // where they overlap or touch
+    std::sort(windows.begin(), windows.end(),
+              [](const Window &a, const Window &b) {
+                  return a.start < b.start;
+              });
+
+    vector<Window> joined;
+    for (const Window &w: windows) {
+        if (!joined.empty() && w.start <= joined.back().end) {
+            joined.back().end = std::max(joined.back().end, w.end);
+        } else {
+            joined.push_back(w);
+        }
+    }
+
+    // Each region has its own summaries, so its features are labelled
+    // with where it lies, as excerpts are with their numbers
+    for (Window &w: joined) {
+        w.label = QString("region %1-%2")
+            .arg(double(w.start) / m_sampleRate)
+            .arg(double(w.end) / m_sampleRate)
+            .toStdString();
+    }
+
+    return joined;
+}
+
+void
+FeatureExtractionManager::extractWindows(AudioFileReader *reader,
+                                         float **data,
+                                         QString audioSource,
+                                         const vector<Window> &windows,
+                                         ProgressPrinter &extractionProgress)
+{
+    for (int k = 0; k < int(windows.size()); ++k) {
+
+        const Window &w = windows[k];
+
+        SVDEBUG << "FeatureExtractionManager: window " << k + 1
+                << " runs from frame " << w.start << " to " << w.end << endl;
+
+        // The first window gets the plugins as prepared for the whole
+        // file; each after it starts them afresh
+        if (k > 0) {
+            prepareBlockProcessing();
+        }
+
+        m_windowLabel = w.label;
+
+        extractBlocks(reader, data, audioSource, w.start, w.end,
+                      extractionProgress);
+        writeRemainingFeatures(audioSource, 0, {});
+    }
+
+    m_windowLabel = "";
+}
+
+// The resampler doesn't tell us how far its output lags its input,
+// so find out by resampling an impulse with a resampler set up the
+// same way and seeing where the peak comes out
+static int
+getResamplerDelay(const breakfastquay::Resampler::Parameters &params,
+                  double ratio, int blockSize)
+{
+    breakfastquay::Resampler probe(params, 1);
+
+    vector<float> in(blockSize, 0.f);
+    int capacity = int(ceil(blockSize * ratio)) + 1;
+    vector<float> out(capacity, 0.f);
+    const float *inPtr = in.data();
+    float *outPtr = out.data();
+
+    int produced = 0, delay = 0;
+    float peak = 0.f;
+
+    // Far longer than any filter the resampler might use
+    const int blocks = 16;
+
+    in[0] = 1.f;
+    for (int k = 0; k < blocks; ++k) {
+        int got = probe.resample(&outPtr, capacity, &inPtr, blockSize, ratio);
+        for (int i = 0; i < got; ++i) {
+            if (fabsf(out[i]) > peak) {
+                peak = fabsf(out[i]);
+                delay = produced + i;
+            }
+        }
+        produced += got;
+        in[0] = 0.f;
+    }
+
+    return delay;
+}
+
+// One group's share of the work in extractBlocksGrouped: a manager
+// whose plugins run at one rate with one channel layout, and, unless
+// that is the rate we read at, a resampler and the resampled audio
+// not yet processed
+struct FeatureExtractionManager::GroupBranch
+{
+    FeatureExtractionManager *manager;
+    int channels;
+    double ratio;
+    std::unique_ptr<breakfastquay::Resampler> resampler;
+    vector<vector<float>> buffers;
+    vector<float *> pointers;
+    int fill;
+    int delay;              // resampled frames still to drop at the start
+    sv_frame_t frame;       // at the manager's rate, of the block in hand
+    sv_frame_t endFrame;    // likewise
+};
+
+void
+FeatureExtractionManager::extractBlocksGrouped(AudioFileReader *reader,
+                                                 float **data,
+                                                 QString audioSource,
+                                                 bool openEnded,
+                                                 ProgressPrinter &extractionProgress)
+{
+    // As extractBlocks, but with our transforms and those of our
+    // group managers run from a single read of the audio. We read at
+    // the highest rate of any of them, with all our channels. Each
+    // block read is arranged in each group's layout -- any mixdown
+    // being made only once, for all the groups that want it -- and
+    // goes straight to the plugins of groups at the rate we read at,
+    // or through a resampler for the others, which process whole
+    // blocks of their own as they become available. Everything
+    // happens in this thread, so the output order is fixed: each
+    // block's features from us, then from each group manager in
+    // turn. We always read from the start, leaving any later start
+    // times to isInRange, and carry on past the end (with silence)
+    // until every group has covered its range.
+
+    sv_samplerate_t readRate = getReadRate();
+
+    vector<std::unique_ptr<GroupBranch>> branches;
+
+    vector<FeatureExtractionManager *> managers { this };
+    for (const auto &mgr: m_groupManagers) {
+        managers.push_back(mgr.get());
+    }
+
+    for (auto mgr: managers) {
+
+        std::unique_ptr<GroupBranch> branch(new GroupBranch);
+        branch->manager = mgr;
+        branch->channels = mgr->getPluginChannels();
+        branch->ratio = mgr->m_sampleRate / readRate;
+        branch->fill = 0;
+        branch->delay = 0;
+        branch->frame = 0;
+        branch->endFrame = unknownEndFrame;
+
+        if (mgr->m_sampleRate != readRate) {
+            breakfastquay::Resampler::Parameters params;
+            params.quality = breakfastquay::Resampler::FastestTolerable;
+            params.dynamism = breakfastquay::Resampler::RatioMostlyFixed;
+            params.initialSampleRate = readRate;
+            params.maxBufferSize = m_blockSize;
+            branch->resampler.reset
+                (new breakfastquay::Resampler(params, branch->channels));
+            // Drop the resampler's delay from the start, so that the
+            // branch's features are timed as they would be from
+            // reading at its own rate
+            branch->delay = getResamplerDelay(params, branch->ratio,
+                                              m_blockSize);
+            SVDEBUG << "FeatureExtractionManager: resampler to "
+                    << mgr->m_sampleRate << "Hz has a delay of "
+                    << branch->delay << " frames" << endl;
+            // Room for a block in hand plus everything one more
+            // block of input can produce
+            int capacity = m_blockSize * 2 +
+                int(ceil(m_blockSize * branch->ratio));
+            for (int c = 0; c < branch->channels; ++c) {
+                branch->buffers.push_back(vector<float>(capacity, 0.f));
+                branch->pointers.push_back(0);
+            }
+        }
+
+        branches.push_back(std::move(branch));
+    }
+
+    // The mixdown, made as DeinterleavingReader::deinterleave would
+    // make it, if anyone needs one and we have more than one channel
+    bool mixing = false;
+    for (const auto &b: branches) {
+        if (b->manager->m_layout.type == ChannelLayout::Mono) {
+            mixing = (m_channels > 1);
+        }
+    }
+    vector<float> mixdown(m_blockSize, 0.f);
+    const float *mixed = mixdown.data();
+
+    auto findEnds = [&](sv_frame_t frames) {
+        for (auto &b: branches) {
+            sv_frame_t start = 0;
+            b->manager->getFrameRange
+                (sv_frame_t(round(double(frames) * b->ratio)),
+                 start, b->endFrame);
+        }
+    };
+
+    auto pending = [&]() {
+        for (const auto &b: branches) {
+            if (b->frame < b->endFrame) return true;
+        }
+        return false;
+    };
+
+    // For progress purposes only, the furthest we need to read
+    auto readEnd = [&]() {
+        sv_frame_t end = 0;
+        for (const auto &b: branches) {
+            end = std::max(end, sv_frame_t(ceil(double(b->endFrame) /
+                                                b->ratio)));
+        }
+        return std::max(end, sv_frame_t(1));
+    };
+
+    // As in extractFeaturesFor, an open-ended read still has known
+    // ends if every transform in every group has a duration
+    bool known = !openEnded;
+    if (!known) {
+        known = true;
+        for (auto mgr: managers) {
+            if (mgr->isRangeOpenEnded()) known = false;
+        }
+    }
+    if (known) {
+        findEnds(openEnded ? 0 : reader->getFrameCount());
+    }
+    
+    int progress = 0;
+    bool showProgress = (m_verbose && known);
+    sv_frame_t progressEnd = (known ? readEnd() : 0);
+
+    ReadAheadBuffer source(reader);
+
+    for (sv_frame_t i = 0; pending(); i += m_blockSize) {
+
+        const float *direct = getDirectBlock(reader, i);
+        const float *const *input = data;
+
+        if (direct) {
+            input = &direct;
+        } else {
+            sv_frame_t got = readBlock(source, i, data);
+            if (got == 0 && !known) {
+                auto dr = dynamic_cast<const DeinterleavingReader *>(reader);
+                SVDEBUG << "FeatureExtractionManager: open-ended audio has "
+                        << dr->getFramesRead() << " frames" << endl;
+                findEnds(dr->getFramesRead());
+                known = true;
+                if (!pending()) break;
+            }
+        }
+
+        if (mixing) {
+            for (sv_frame_t j = 0; j < m_blockSize; ++j) {
+                float sum = 0.f;
+                for (int c = 0; c < m_channels; ++c) {
+                    sum += input[c][j];
+                }
+                mixdown[j] = sum / float(m_channels);
+            }
+        }
+
+        for (auto &b: branches) {
+            const ChannelLayout &layout = b->manager->m_layout;
+            if (layout.type == ChannelLayout::Single) {
+                feedBranch(*b, input + layout.channel, audioSource);
+            } else if (layout.type == ChannelLayout::Mono && mixing) {
+                feedBranch(*b, &mixed, audioSource);
+            } else {
+                feedBranch(*b, input, audioSource);
+            }
+        }
+
+        if (!showProgress) continue;
+
+        int pp = progress;
+        progress = int((double(i) * 100.0) / double(progressEnd) + 0.1);
+        if (progress > pp && progress <= 100) {
+            extractionProgress.setProgress(progress);
+        }
+    }
+}
+
+void
+FeatureExtractionManager::feedBranch(GroupBranch &b,
+                                     const float *const *data,
+                                     QString audioSource)
+{
+    if (!b.resampler) {
+        runBranchBlock(b, data, audioSource);
+        return;
+    }
+
+    int capacity = int(b.buffers[0].size());
+    for (int c = 0; c < b.channels; ++c) {
+        b.pointers[c] = b.buffers[c].data() + b.fill;
+    }
+
+    int got = b.resampler->resample(b.pointers.data(), capacity - b.fill,
+                                    data, m_blockSize, b.ratio);
+
+    if (b.delay > 0) {
+        int drop = std::min(b.delay, got);
+        for (auto &buffer: b.buffers) {
+            std::copy(buffer.begin() + b.fill + drop,
+                      buffer.begin() + b.fill + got,
+                      buffer.begin() + b.fill);
+        }
+        got -= drop;
+        b.delay -= drop;
+    }
+
+    b.fill += got;
+
+    while (b.fill >= m_blockSize) {
+        for (int c = 0; c < b.channels; ++c) {
+            b.pointers[c] = b.buffers[c].data();
+        }
+        runBranchBlock(b, b.pointers.data(), audioSource);
+        for (auto &buffer: b.buffers) {
+            std::copy(buffer.begin() + m_blockSize, buffer.begin() + b.fill,
+                      buffer.begin());
+        }
+        b.fill -= m_blockSize;
+    }
+}
+
+void
+FeatureExtractionManager::runBranchBlock(GroupBranch &b,
+                                         const float *const *data,
+                                         QString audioSource)
+{
+    if (b.frame < b.endFrame) {
+        FeatureExtractionManager *mgr = b.manager;
+        mgr->processBlock(data, b.frame);
+        mgr->writeBlockFeatures(audioSource, mgr->m_featureSets,
+                                mgr->m_active);
+    }
+    b.frame += m_blockSize;
+}
+
+void
+FeatureExtractionManager::extractBlocksPipelined(AudioFileReader *reader,
+                                                 QString audioSource,
+                                                 sv_frame_t startFrame,
+                                                 sv_frame_t endFrame,
+                                                 ProgressPrinter &extractionProgress)
+{
+    // As extractBlocks, but with decoding and writing each done on
+    // a thread of its own. The decode thread reads and mixes blocks
+    // into a small ring of buffers, which come back to it once the
+    // plugins have finished with them; the writer thread takes the
+    // feature sets from each block in turn. Both queues are bounded,
+    // so whichever stage is slowest holds up the others rather than
+    // letting memory usage grow.
+
+    const int decodeDepth = 8;
+    const int writeDepth = 32;
+    
+    struct Block {
+        sv_frame_t frame;
+        vector<vector<float>> channels;
+        vector<float *> pointers;
+    };
+
+    struct BlockFeatures {
+        vector<Plugin::FeatureSet> featureSets;
+        vector<char> active;
+    };
+
+    vector<Block> ring(decodeDepth);
+    BoundedQueue<Block *> freeBlocks(decodeDepth);
+    BoundedQueue<Block *> fullBlocks(decodeDepth);
+    BoundedQueue<BlockFeatures> features(writeDepth);
+
+    for (auto &block: ring) {
+        block.channels = vector<vector<float>>
+            (m_channels, vector<float>(m_blockSize, 0.f));
+        for (auto &c: block.channels) {
+            block.pointers.push_back(c.data());
+        }
+        freeBlocks.push(&block);
+    }
 
-            sv_frame_t startFrame = RealTime::realTime2Frame
-                (transform.getStartTime(), m_sampleRate);
-            sv_frame_t duration = RealTime::realTime2Frame
-                (transform.getDuration(), m_sampleRate);
-            if (duration == 0) {
-                duration = frameCount - startFrame;
+    std::exception_ptr decodeException, writeException;
+
+    auto decode = [&]() {
+        try {
+            sv_frame_t end = endFrame;
+            ReadAheadBuffer source(reader);
+            for (sv_frame_t i = startFrame; i < end; i += m_blockSize) {
+                Block *block = 0;
+                if (!freeBlocks.pop(block)) break;
+                sv_frame_t got = readBlock(source, i, block->pointers.data());
+                if (isPastEnd(reader, i, got, end)) break;
+                block->frame = i;
+                if (!fullBlocks.push(block)) break;
             }
+        } catch (...) {
+            decodeException = std::current_exception();
+        }
+        fullBlocks.close();
+    };
 
-            if (!haveExtents || startFrame < earliestStartFrame) {
-                earliestStartFrame = startFrame;
-            }
-            if (!haveExtents || startFrame + duration > latestEndFrame) {
-                latestEndFrame = startFrame + duration;
+    auto write = [&]() {
+        try {
+            BlockFeatures bf;
+            while (features.pop(bf)) {
+                writeBlockFeatures(audioSource, bf.featureSets, bf.active);
             }
+        } catch (...) {
+            writeException = std::current_exception();
+        }
+        features.close();
+    };
 
-/*
-            SVDEBUG << "startFrame for transform " << startFrame << endl;
-            SVDEBUG << "duration for transform " << duration << endl;
-            SVDEBUG << "earliestStartFrame becomes " << earliestStartFrame << endl;
-            SVDEBUG << "latestEndFrame becomes " << latestEndFrame << endl;
-*/
-            haveExtents = true;
+    // Make sure both threads are stopped and joined before we
+    // return, however we leave, as the reader belongs to our caller
+    // and the queues and ring are about to go away
+    
+    struct Stages {
+        std::thread decoder, writer;
+        BoundedQueue<Block *> &free, &full;
+        BoundedQueue<BlockFeatures> &features;
+        Stages(BoundedQueue<Block *> &fr, BoundedQueue<Block *> &fu,
+               BoundedQueue<BlockFeatures> &fe) :
+            free(fr), full(fu), features(fe) { }
+        ~Stages() {
+            free.close();
+            full.close();
+            features.close();
+            if (decoder.joinable()) decoder.join();
+            if (writer.joinable()) writer.join();
+        }
+    } stages(freeBlocks, fullBlocks, features);
 
-            string outputId = transform.getOutput().toStdString();
-            if (m_pluginOutputs[plugin].find(outputId) ==
-                m_pluginOutputs[plugin].end()) {
-                // We shouldn't actually reach this point:
-                // addFeatureExtractor tests whether the output exists
-                SVCERR << "ERROR: Nonexistent plugin output \"" << outputId << "\" requested for transform \""
-                     << transform.getIdentifier().toStdString() << "\", ignoring this transform"
-                     << endl;
+    stages.decoder = std::thread(decode);
+    stages.writer = std::thread(write);
 
-                SVDEBUG << "Known outputs for all plugins are as follows:" << endl;
-                for (PluginOutputMap::const_iterator k = m_pluginOutputs.begin();
-                     k != m_pluginOutputs.end(); ++k) {
-                    SVDEBUG << "Plugin " << k->first << ": ";
-                    if (k->second.empty()) {
-                        SVDEBUG << "(none)";
-                    }
-                    for (OutputMap::const_iterator i = k->second.begin();
-                         i != k->second.end(); ++i) {
-                        SVDEBUG << "\"" << i->first << "\" ";
-                    }
-                    SVDEBUG << endl;
-                }
-            }
-        }
-    }
-    
-    sv_frame_t startFrame = earliestStartFrame;
-    sv_frame_t endFrame = latestEndFrame;
-    
-    for (auto plugin: m_orderedPlugins) {
+    int progress = 0;
+    bool showProgress = (m_verbose && endFrame != unknownEndFrame);
+    Block *block = 0;
 
-        PluginMap::iterator pi = m_plugins.find(plugin);
+    while (fullBlocks.pop(block)) {
 
-        for (TransformWriterMap::const_iterator ti = pi->second.begin();
-             ti != pi->second.end(); ++ti) {
+        sv_frame_t i = block->frame;
         
-            const vector<FeatureWriter *> &writers = ti->second;
-            
-            for (int j = 0; j < (int)writers.size(); ++j) {
-                FeatureWriter::TrackMetadata m;
-                m.title = reader->getTitle();
-                m.maker = reader->getMaker();
-                m.duration = RealTime::frame2RealTime(reader->getFrameCount(),
-                                                      reader->getSampleRate());
-                writers[j]->setTrackMetadata(audioSource, m);
-            }
+        processBlock(block->pointers.data(), i);
+
+        freeBlocks.push(block);
+
+        BlockFeatures bf;
+        bf.featureSets = m_featureSets;
+        bf.active = m_active;
+        if (!features.push(std::move(bf))) {
+            break; // writer has failed
         }
+
+        if (!showProgress) continue;
+
+        int pp = progress;
+        progress = int((double(i - startFrame) * 100.0) /
+                       double(endFrame - startFrame) + 0.1);
+        if (progress > pp) extractionProgress.setProgress(progress);
     }
 
-    ProgressPrinter extractionProgress("Extracting and writing features...");
-    int progress = 0;
+    features.close();
+    freeBlocks.close();
 
-    for (sv_frame_t i = startFrame; i < endFrame; i += m_blockSize) {
-        
-        //!!! inefficient, although much of the inefficiency may be
-        // susceptible to compiler optimisation
-        
-        auto frames = reader->getInterleavedFrames(i, m_blockSize);
-        
-        // We have to do our own channel handling here; we can't just
-        // leave it to the plugin adapter because the same plugin
-        // adapter may have to serve for input files with various
-        // numbers of channels (so the adapter is simply configured
-        // with a fixed channel count).
+    stages.decoder.join();
+    stages.writer.join();
 
-        int rc = reader->getChannelCount();
+    if (decodeException) std::rethrow_exception(decodeException);
+    if (writeException) std::rethrow_exception(writeException);
+}
 
-        // m_channels is the number of channels we need for the plugin
+bool
+FeatureExtractionManager::prepareSegments()
+{
+    // Work out which plugins we can split, and set up the segment
+    // managers for them, the first time we are asked. Return true if
+    // there is anything to split.
+    
+    if (m_segmentsPrepared) {
+        return !m_splitPlugins.empty();
+    }
+    
+    m_segmentsPrepared = true;
+    m_splitPlugins.clear();
+    m_segmentManagers.clear();
+    m_isSplit = vector<char>(m_orderedPlugins.size(), 0);
 
-        int index;
-        int fc = (int)frames.size();
+    if (m_splitTransformIds.empty() || m_splitSegments < 2) {
+        return false;
+    }
 
-        if (m_channels == 1) { // only case in which we can sensibly mix down
-            for (int j = 0; j < m_blockSize; ++j) {
-                data[0][j] = 0.f;
-            }
-            for (int c = 0; c < rc; ++c) {
-                for (int j = 0; j < m_blockSize; ++j) {
-                    index = j * rc + c;
-                    if (index < fc) data[0][j] += frames[index];
-                }
-            }
-            for (int j = 0; j < m_blockSize; ++j) {
-                data[0][j] /= float(rc);
+    set<TransformId> found;
+    
+    for (int p = 0; p < int(m_orderedPlugins.size()); ++p) {
+
+        const TransformWriterMap &tm = m_plugins[m_orderedPlugins[p]];
+        int requested = 0;
+        bool suitable = m_summaries.empty();
+
+        for (TransformWriterMap::const_iterator ti = tm.begin();
+             ti != tm.end(); ++ti) {
+            const Transform &t = ti->first;
+            if (m_splitTransformIds.find(t.getIdentifier()) !=
+                m_splitTransformIds.end()) {
+                found.insert(t.getIdentifier());
+                ++requested;
             }
-        } else {                
-            for (int c = 0; c < m_channels; ++c) {
-                for (int j = 0; j < m_blockSize; ++j) {
-                    data[c][j] = 0.f;
-                }
-                if (c < rc) {
-                    for (int j = 0; j < m_blockSize; ++j) {
-                        index = j * rc + c;
-                        if (index < fc) data[c][j] += frames[index];
-                    }
-                }
+            if (t.getSummaryType() != Transform::NoSummary ||
+                t.getStartTime() != RealTime::zeroTime ||
+                t.getDuration() != RealTime::zeroTime) {
+                suitable = false;
             }
-        }                
+        }
 
-        RealTime timestamp = RealTime::frame2RealTime(i, m_sampleRate);
+        if (requested == 0) {
+            continue;
+        }
+
+        QString id = tm.begin()->first.getIdentifier();
         
-        for (auto plugin: m_orderedPlugins) {
+        if (requested < int(tm.size())) {
+            SVCERR << "WARNING: Plugin for transform \"" << id
+                   << "\" is shared with transforms that were not listed for"
+                   << " splitting, so it will not be split" << endl;
+            continue;
+        }
+        
+        if (!suitable) {
+            SVCERR << "WARNING: Transform \"" << id << "\" has a summary type,"
+                   << " start time or duration, so it will not be split"
+                   << endl;
+            continue;
+        }
 
-            PluginMap::iterator pi = m_plugins.find(plugin);
+        m_splitPlugins.push_back(p);
+        m_isSplit[p] = 1;
+    }
 
-            // Skip any plugin none of whose transforms have come
-            // around yet. (Though actually, all transforms for a
-            // given plugin must have the same start time -- they can
-            // only differ in output and summary type.)
-            bool inRange = false;
-            for (TransformWriterMap::const_iterator ti = pi->second.begin();
-                 ti != pi->second.end(); ++ti) {
-                sv_frame_t startFrame = RealTime::realTime2Frame
-                    (ti->first.getStartTime(), m_sampleRate);
-                if (i >= startFrame || i + m_blockSize > startFrame) {
-                    inRange = true;
-                    break;
-                }
-            }
-            if (!inRange) {
-                continue;
-            }
+    for (auto id: m_splitTransformIds) {
+        if (found.find(id) == found.end()) {
+            SVCERR << "WARNING: Transform \"" << id << "\" was listed for"
+                   << " splitting, but is not among the requested transforms"
+                   << endl;
+        }
+    }
+
+    if (m_splitPlugins.empty()) {
+        return false;
+    }
+
+    // Each segment manager has its own instances of the split
+    // plugins, added in the same order as ours so that its plugin
+    // indices correspond to those in m_splitPlugins. They have no
+    // writers, as they just return their features to us.
+    
+    for (int k = 1; k < m_splitSegments; ++k) {
 
-            Plugin::FeatureSet featureSet =
-                plugin->process(data, timestamp.toVampRealTime());
+        unique_ptr<FeatureExtractionManager> mgr
+            (new FeatureExtractionManager(false));
 
-            if (!m_summariesOnly) {
-                writeFeatures(audioSource, plugin, featureSet);
+        mgr->m_blockSize = m_blockSize;
+        mgr->m_defaultSampleRate = m_defaultSampleRate;
+        mgr->m_sampleRate = m_sampleRate;
+        mgr->m_channels = m_channels;
+        
+        for (int p: m_splitPlugins) {
+            const TransformWriterMap &tm = m_plugins[m_orderedPlugins[p]];
+            for (TransformWriterMap::const_iterator ti = tm.begin();
+                 ti != tm.end(); ++ti) {
+                if (!mgr->addFeatureExtractor(ti->first,
+                                              vector<FeatureWriter *>())) {
+                    SVCERR << "ERROR: Failed to set up plugin for segment "
+                           << k << ", processing without splitting" << endl;
+                    m_splitPlugins.clear();
+                    m_segmentManagers.clear();
+                    m_isSplit = vector<char>(m_orderedPlugins.size(), 0);
+                    return false;
+                }
             }
         }
 
-        int pp = progress;
-        progress = int((double(i - startFrame) * 100.0) /
-                       double(endFrame - startFrame) + 0.1);
-        if (progress > pp && m_verbose) extractionProgress.setProgress(progress);
+        m_segmentManagers.push_back(std::move(mgr));
     }
 
-    SVDEBUG << "FeatureExtractionManager: deleting audio file reader" << endl;
+    SVCERR << "NOTE: Splitting " << m_splitPlugins.size()
+           << " plugin(s) into up to " << m_splitSegments
+           << " segments per file" << endl;
+
+    return true;
+}
+
+void
+FeatureExtractionManager::extractSegment(AudioFileReader *reader,
+                                         sv_frame_t from,
+                                         sv_frame_t to,
+                                         RealTime keepFrom,
+                                         const RealTime *keepTo,
+                                         SegmentFeatures &results)
+{
+    // Run all of our plugins over the given range of the reader,
+    // keeping the features from keepFrom up to keepTo (or the end,
+    // if keepTo is null). This runs on its own thread, alongside
+    // other segment managers and the manager that owns us, so it
+    // reads into its own buffers and writes nothing.
+
+    int pluginCount = int(m_orderedPlugins.size());
+    results = SegmentFeatures(pluginCount);
+
+    vector<vector<float>> buffers(m_channels, vector<float>(m_blockSize));
+    vector<float *> data;
+    for (auto &b: buffers) {
+        data.push_back(b.data());
+    }
 
-    lifemgr.destroy(); // deletes reader, data
-        
     for (auto plugin: m_orderedPlugins) {
+        plugin->reset();
+    }
 
-        Plugin::FeatureSet featureSet = plugin->getRemainingFeatures();
+    ReadAheadBuffer source(reader);
 
-        if (!m_summariesOnly) {
-            writeFeatures(audioSource, plugin, featureSet);
+    for (sv_frame_t i = from; i < to; i += m_blockSize) {
+
+        const float *direct = getDirectBlock(reader, i);
+        const float *const *input = &direct;
+        if (!direct) {
+            readBlock(source, i, data.data());
+            input = data.data();
         }
 
-        if (!m_summaries.empty()) {
-            // Summaries requested on the command line, for all transforms
-            auto adapter =
-                dynamic_pointer_cast<PluginSummarisingAdapter>(plugin);
-            if (!adapter) {
-                SVCERR << "WARNING: Summaries requested, but plugin is not a summarising adapter" << endl;
-            } else {
-                for (SummaryNameSet::const_iterator sni = m_summaries.begin();
-                     sni != m_summaries.end(); ++sni) {
-                    featureSet.clear();
-                    //!!! problem here -- we are requesting summaries
-                    //!!! for all outputs, but they in principle have
-                    //!!! different averaging requirements depending
-                    //!!! on whether their features have duration or
-                    //!!! not
-                    featureSet = adapter->getSummaryForAllOutputs
-                        (getSummaryType(*sni),
-                         PluginSummarisingAdapter::ContinuousTimeAverage);
-                    writeFeatures(audioSource, plugin, featureSet,
-                                  Transform::stringToSummaryType(sni->c_str()));
-                }
+        RealTime timestamp = RealTime::frame2RealTime(i, m_sampleRate);
+
+        for (int p = 0; p < pluginCount; ++p) {
+            Plugin::FeatureSet fs = selectFeatures
+                (m_orderedPlugins[p]->process
+                 (input, timestamp.toVampRealTime()),
+                 &keepFrom, keepTo);
+            if (!fs.empty()) {
+                results[p].push_back(fs);
             }
         }
-
-        // Summaries specified in transform definitions themselves
-        writeSummaries(audioSource, plugin);
     }
 
-    if (m_verbose) extractionProgress.done();
+    for (int p = 0; p < pluginCount; ++p) {
+        Plugin::FeatureSet fs = selectFeatures
+            (m_orderedPlugins[p]->getRemainingFeatures(), &keepFrom, keepTo);
+        if (!fs.empty()) {
+            results[p].push_back(fs);
+        }
+    }
+}
 
-    finish();
+Plugin::FeatureSet
+FeatureExtractionManager::selectFeatures(const Plugin::FeatureSet &features,
+                                         const RealTime *from,
+                                         const RealTime *to)
+{
+    // Return only those features timestamped within [from, to). A
+    // null from or to means no limit in that direction. Features
+    // without timestamps are kept (the buffering adapter gives
+    // timestamps to all features from fixed-rate outputs, so this
+    // shouldn't arise in practice).
     
-    TempDirectory::getInstance()->cleanup();
+    Plugin::FeatureSet selected;
+
+    for (const auto &output: features) {
+        Plugin::FeatureList list;
+        for (const auto &f: output.second) {
+            if (f.hasTimestamp) {
+                RealTime t = RealTime::fromVampRealTime(f.timestamp);
+                if (from && t < *from) continue;
+                if (to && t >= *to) continue;
+            }
+            list.push_back(f);
+        }
+        if (!list.empty()) {
+            selected[output.first] = list;
+        }
+    }
+
+    return selected;
+}
+
+bool
+FeatureExtractionManager::isInRange(shared_ptr<Plugin> plugin,
+                                    sv_frame_t i) const
+{
+    // Though actually, all transforms for a given plugin must have
+    // the same start time -- they can only differ in output and
+    // summary type
+
+    PluginMap::const_iterator pi = m_plugins.find(plugin);
+
+    for (TransformWriterMap::const_iterator ti = pi->second.begin();
+         ti != pi->second.end(); ++ti) {
+        sv_frame_t startFrame = RealTime::realTime2Frame
+            (ti->first.getStartTime(), m_sampleRate);
+        if (i >= startFrame || i + m_blockSize > startFrame) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
 void
 FeatureExtractionManager::writeSummaries(QString audioSource,
                                          shared_ptr<Plugin> plugin)
 {
+    SummaryList summaries = getSummaries(plugin);
+
+    for (const auto &summary: summaries) {
+        writeFeatures(audioSource, plugin, summary.second, summary.first);
+    }
+}
+
+FeatureExtractionManager::SummaryList
+FeatureExtractionManager::getSummaries(shared_ptr<Plugin> plugin)
+{
+    SummaryList summaries;
+
+    if (!m_summaries.empty()) {
+        // Summaries requested on the command line, for all transforms
+        auto adapter =
+            dynamic_pointer_cast<PluginSummarisingAdapter>(plugin);
+        if (!adapter) {
+            SVCERR << "WARNING: Summaries requested, but plugin is not a summarising adapter" << endl;
+        } else {
+            for (SummaryNameSet::const_iterator sni = m_summaries.begin();
+                 sni != m_summaries.end(); ++sni) {
+                //!!! problem here -- we are requesting summaries
+                //!!! for all outputs, but they in principle have
+                //!!! different averaging requirements depending
+                //!!! on whether their features have duration or
+                //!!! not
+                Plugin::FeatureSet featureSet = adapter->getSummaryForAllOutputs
+                    (getSummaryType(*sni),
+                     PluginSummarisingAdapter::ContinuousTimeAverage);
+                summaries.push_back
+                    ({ Transform::stringToSummaryType(sni->c_str()), featureSet });
+            }
+        }
+    }
+
+    // Summaries specified in transform definitions themselves
+    
     // caller should have ensured plugin is in m_plugins
     PluginMap::iterator pi = m_plugins.find(plugin);
 
@@ -1035,7 +2780,7 @@ FeatureExtractionManager::writeSummaries(QString audioSource,
         
         const Transform &transform = ti->first;
 
-        SVDEBUG << "FeatureExtractionManager::writeSummaries: plugin is " << plugin
+        SVDEBUG << "FeatureExtractionManager::getSummaries: plugin is " << plugin
                 << ", found transform: " << transform.toXmlString() << endl;
         
         Transform::SummaryType summaryType = transform.getSummaryType();
@@ -1043,13 +2788,13 @@ FeatureExtractionManager::writeSummaries(QString audioSource,
             (PluginSummarisingAdapter::SummaryType)summaryType;
 
         if (transform.getSummaryType() == Transform::NoSummary) {
-            SVDEBUG << "FeatureExtractionManager::writeSummaries: no summary for this transform" << endl;
+            SVDEBUG << "FeatureExtractionManager::getSummaries: no summary for this transform" << endl;
             continue;
         }
 
         auto adapter = dynamic_pointer_cast<PluginSummarisingAdapter>(plugin);
         if (!adapter) {
-            SVCERR << "FeatureExtractionManager::writeSummaries: INTERNAL ERROR: Summary requested for transform, but plugin is not a summarising adapter" << endl;
+            SVCERR << "FeatureExtractionManager::getSummaries: INTERNAL ERROR: Summary requested for transform, but plugin is not a summarising adapter" << endl;
             continue;
         }
 
@@ -1058,8 +2803,10 @@ FeatureExtractionManager::writeSummaries(QString audioSource,
 
         SVDEBUG << "summary type " << int(pType) << " for transform:" << endl << transform.toXmlString().toStdString()<< endl << "... feature set with " << featureSet.size() << " elts" << endl;
 
-        writeFeatures(audioSource, plugin, featureSet, summaryType);
+        summaries.push_back({ summaryType, featureSet });
     }
+
+    return summaries;
 }
 
 void FeatureExtractionManager::writeFeatures(QString audioSource,
@@ -1106,16 +2853,175 @@ void FeatureExtractionManager::writeFeatures(QString audioSource,
         Plugin::FeatureSet::const_iterator fsi = features.find(outputIndex);
         if (fsi == features.end()) continue;
 
+        const Plugin::FeatureList *list = &fsi->second;
+        Plugin::FeatureList labelled;
+        if (m_windowLabel != "") {
+            labelled = *list;
+            for (auto &f: labelled) {
+                f.label = (f.label == "" ? m_windowLabel :
+                           m_windowLabel + ": " + f.label);
+            }
+            list = &labelled;
+        }
+
 //        SVDEBUG << "this transform has " << writers.size() << " writer(s)" << endl;
         
         for (int j = 0; j < (int)writers.size(); ++j) {
             writers[j]->write
-                (audioSource, transform, desc, fsi->second,
+                (audioSource, transform, desc, *list,
                  Transform::summaryTypeToString(summaryType).toStdString());
         }
     }
 }
 
+FeatureWriter::TrackMetadata
+FeatureExtractionManager::getTrackMetadata(AudioFileReader *reader) const
+{
+    FeatureWriter::TrackMetadata m;
+    m.title = reader->getTitle();
+    m.maker = reader->getMaker();
+    m.duration = RealTime::frame2RealTime(reader->getFrameCount(),
+                                          reader->getSampleRate());
+    return m;
+}
+
+void FeatureExtractionManager::setTrackMetadata(QString audioSource,
+                                                const FeatureWriter::TrackMetadata &m)
+{
+    for (auto plugin: m_orderedPlugins) {
+
+        PluginMap::iterator pi = m_plugins.find(plugin);
+
+        for (TransformWriterMap::const_iterator ti = pi->second.begin();
+             ti != pi->second.end(); ++ti) {
+        
+            const vector<FeatureWriter *> &writers = ti->second;
+            
+            for (int j = 0; j < (int)writers.size(); ++j) {
+                writers[j]->setTrackMetadata(audioSource, m);
+            }
+        }
+    }
+}
+
+shared_ptr<DecodedAudioBuffer>
+FeatureExtractionManager::decodeSource(QString audioSource)
+{
+    if (m_sampleRate == 0) {
+        throw FileOperationFailed
+            (audioSource, "internal error: have sources and plugins, but no sample rate");
+    }
+    if (m_channels == 0) {
+        throw FileOperationFailed
+            (audioSource, "internal error: have sources and plugins, but no channel count");
+    }
+
+    std::unique_ptr<AudioFileReader> reader(prepareReader(audioSource, true));
+
+    SVCERR << "Audio file \"" << audioSource.toStdString() << "\": "
+         << reader->getChannelCount() << "ch at " 
+         << reader->getNativeRate() << "Hz" << endl;
+
+    sv_frame_t startFrame = 0, endFrame = 0;
+    getFrameRange(reader->getFrameCount(), startFrame, endFrame);
+
+    auto buffer = make_shared<DecodedAudioBuffer>
+        (m_channels, m_blockSize, startFrame, endFrame);
+
+    buffer->setTrackMetadata(getTrackMetadata(reader.get()));
+
+    vector<float *> data(m_channels);
+    ReadAheadBuffer source(reader.get());
+    
+    for (int b = 0; b < buffer->getBlockCount(); ++b) {
+        for (int c = 0; c < m_channels; ++c) {
+            data[c] = buffer->getBlockData(c, b);
+        }
+        readBlock(source, buffer->getBlockFrame(b), data.data());
+    }
+
+    return buffer;
+}
+
+void
+FeatureExtractionManager::extractPluginFeatures(int p,
+                                                const DecodedAudioBuffer &buffer,
+                                                PluginFeatures &features)
+{
+    auto plugin = m_orderedPlugins[p];
+
+    plugin->reset();
+    
+    features.blocks.clear();
+    features.blocks.reserve(buffer.getBlockCount());
+
+    vector<const float *> data(m_channels);
+
+    for (int b = 0; b < buffer.getBlockCount(); ++b) {
+
+        sv_frame_t i = buffer.getBlockFrame(b);
+        
+        if (!isInRange(plugin, i)) {
+            features.blocks.push_back(Plugin::FeatureSet());
+            continue;
+        }
+        
+        for (int c = 0; c < m_channels; ++c) {
+            data[c] = buffer.getBlockData(c, b);
+        }
+        
+        features.blocks.push_back
+            (plugin->process(data.data(),
+                             RealTime::frame2RealTime(i, m_sampleRate)
+                             .toVampRealTime()));
+    }
+
+    features.remaining = plugin->getRemainingFeatures();
+    features.summaries = getSummaries(plugin);
+}
+
+void
+FeatureExtractionManager::writePluginFeatures(QString audioSource,
+                                              const FeatureWriter::TrackMetadata &metadata,
+                                              const vector<PluginFeatures> &features)
+{
+    // Write everything in the same order as extractFeatures would
+    // have done, a block at a time across all plugins
+    
+    testOutputFiles(audioSource);
+    setTrackMetadata(audioSource, metadata);
+
+    int pluginCount = int(m_orderedPlugins.size());
+    int blockCount = 0;
+    for (const auto &f: features) {
+        blockCount = std::max(blockCount, int(f.blocks.size()));
+    }
+
+    if (!m_summariesOnly) {
+        for (int b = 0; b < blockCount; ++b) {
+            for (int p = 0; p < pluginCount; ++p) {
+                if (b < int(features[p].blocks.size())) {
+                    writeFeatures(audioSource, m_orderedPlugins[p],
+                                  features[p].blocks[b]);
+                }
+            }
+        }
+    }
+
+    for (int p = 0; p < pluginCount; ++p) {
+        if (!m_summariesOnly) {
+            writeFeatures(audioSource, m_orderedPlugins[p],
+                          features[p].remaining);
+        }
+        for (const auto &summary: features[p].summaries) {
+            writeFeatures(audioSource, m_orderedPlugins[p],
+                          summary.second, summary.first);
+        }
+    }
+
+    finish();
+}
+
 void FeatureExtractionManager::testOutputFiles(QString audioSource)
 {
     for (PluginMap::iterator pi = m_plugins.begin();
@@ -1131,6 +3037,10 @@ void FeatureExtractionManager::testOutputFiles(QString audioSource)
             }
         }
     }
+
+    for (const auto &mgr: m_groupManagers) {
+        mgr->testOutputFiles(audioSource);
+    }
 }
 
 void FeatureExtractionManager::finish()
@@ -1150,4 +3060,8 @@ void FeatureExtractionManager::finish()
             }
         }
     }
+
+    for (const auto &mgr: m_groupManagers) {
+        mgr->finish();
+    }
 }
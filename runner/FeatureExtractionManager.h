@@ -20,12 +20,15 @@
 #include <set>
 #include <string>
 #include <memory>
+#include <functional>
 
 #include <QMap>
 
 #include <vamp-hostsdk/Plugin.h>
 #include <vamp-hostsdk/PluginSummarisingAdapter.h>
 #include <transform/Transform.h>
+#include <transform/FeatureWriter.h>
+#include <base/BaseTypes.h>
 
 using std::vector;
 using std::set;
@@ -36,6 +39,13 @@ using std::shared_ptr;
 
 class FeatureWriter;
 class AudioFileReader;
+class TaskPool;
+class ProgressPrinter;
+class DecodedAudioBuffer;
+class DecodeCache;
+class DecodeMemoryPolicy;
+class SourcePrefetcher;
+class ReadAheadBuffer;
 
 class FeatureExtractionManager
 {
@@ -47,11 +57,163 @@ public:
     void setDefaultSampleRate(sv_samplerate_t sampleRate);
     void setNormalise(bool normalise);
 
+    // Run up to this many plugins at once on each block of audio
+    // (default 1). Features are still written in the same order.
+    void setPluginThreads(int threads);
+
+    // Read from up to this many of the sources at once when
+    // multiplexing them (default 1)
+    void setMultiplexThreads(int threads);
+
+    // Decode audio, run plugins and write features on three separate
+    // threads, so that slow decoding or output need not hold up the
+    // plugins (default false).
+    void setPipelined(bool pipelined);
+
+    // Decode each file on demand as it is read, just ahead of the
+    // read position, rather than decoding it all before starting
+    // (default false). This keeps memory use down and gets features
+    // out sooner, but is not available with split transforms,
+    // excerpts or regions, when multiplexing or decoding for
+    // extractPluginFeatures, or with normalisation unless the decode
+    // cache knows the file's peak, and not for every file format;
+    // other files are read as usual. A streamed file's length is
+    // found only by reading to its end, as for a pipe.
+    void setStreaming(bool streaming);
+
+    // Look for decoded audio in the given cache before decoding a
+    // file, and store it there after decoding (default none). Peak
+    // levels found while reading are recorded there too, so that
+    // later normalised runs need not find them again. The cache must
+    // outlive this manager and any initialised from it.
+    void setDecodeCache(DecodeCache *cache);
+
+    // Decode compressed files into memory, so far as the given policy
+    // allows, and spill the rest to a compact file, rather than
+    // decoding them into float WAV files in the temporary directory
+    // (default none). The policy must outlive this manager and any
+    // initialised from it.
+    void setDecodeMemory(DecodeMemoryPolicy *policy);
+
+    // Expect audio from standard input or a named pipe to be raw
+    // samples in the given format, rather than a WAV stream (see
+    // PipeAudioFileReader::parseRawFormat; default none).
+    void setRawFormat(QString format);
+
+    // Open up to depth sources in the background, ahead of their
+    // being asked for by extractFeatures or extractFeaturesMultiplexed,
+    // so long as the decoded audio held by those waiting would come
+    // to no more than maxBytes (default depth 0, i.e. none). The
+    // sources to open are given to prefetchSources, in the order they
+    // will be asked for, and this must only be called once all
+    // feature extractors have been added. Not copied by
+    // initialiseFrom.
+    void setPrefetch(int depth, size_t maxBytes);
+    void prefetchSources(QStringList sources);
+
+    // Allow the plugins for the given transforms to be run on
+    // several separate parts of each input file at once, with one
+    // plugin instance per part, splitting each file into up to
+    // segments parts (default 1, i.e. no splitting). This is only
+    // valid for plugins whose output at any point depends only on
+    // the audio close to that point, so it must be requested for
+    // each transform individually.
+    void setSplitTransforms(const set<TransformId> &transformIds,
+                            int segments);
+
+    // A window of each source to extract features from, starting
+    // either at a time in seconds or at a proportion of the source's
+    // duration
+    struct Excerpt {
+        Excerpt() : relative(false), start(0.0) { }
+        bool relative;
+        double start; // seconds, or from 0 to 1 if relative
+    };
+
+    // Parse a comma-separated list of excerpt starts, each a number
+    // of seconds or a percentage such as "25%", returning false if
+    // any is neither
+    static bool parseExcerpts(QString text, vector<Excerpt> &excerpts);
+
+    // Extract features only from the given excerpts of each source,
+    // each of the given duration in seconds, rather than from all of
+    // it (default none, i.e. all of it). The plugins are reset
+    // before each excerpt, and the label of every feature, summaries
+    // included, is prefixed with the number of the excerpt it came
+    // from. Not used for transforms run in groups (see
+    // addFeatureExtractor), nor by decodeSource and
+    // extractPluginFeatures; not available for audio from a pipe.
+    void setExcerpts(const vector<Excerpt> &excerpts, double duration);
+
+    // A span of a source to extract features from, in seconds
+    struct Region {
+        Region() : start(0.0), end(0.0) { }
+        Region(double s, double e) : start(s), end(e) { }
+        double start;
+        double end;
+    };
+    typedef map<QString, vector<Region>> RegionMap;
+
+    // Extract features only from within the regions listed for each
+    // source, rather than from all of it (default none, i.e. all of
+    // it). Sources are found in the map by name as given, or failing
+    // that by absolute path, and those with no regions listed are
+    // skipped. Overlapping and touching regions are joined, and the
+    // plugins are reset at each gap between them; timestamps are
+    // those in the source as a whole. Labels, including those of
+    // summaries, are prefixed "region <start>-<end>" (in seconds).
+    // Only the regions are read from a source that can seek. Sources
+    // are not streamed (see setStreaming) when regions are set. Not
+    // used in the same cases as setExcerpts, and not together with
+    // it.
+    void setRegions(const RegionMap &regions);
+
+    // Return true if features would be extracted from the given
+    // source at all, i.e. if no regions are set or some are listed
+    // for it, so that callers can avoid opening sources that would
+    // only be skipped.
+    bool hasRegionsFor(QString audioSource) const;
+
+    // How the channels read from each source are given to a
+    // transform: all of them as they are (the default), mixed down to
+    // one, or just one of them (numbered from 0)
+    struct ChannelLayout {
+        enum Type { Native, Mono, Single };
+        ChannelLayout() : type(Native), channel(0) { }
+        ChannelLayout(Type t, int c = 0) : type(t), channel(c) { }
+        bool operator==(const ChannelLayout &other) const {
+            return type == other.type &&
+                (type != Single || channel == other.channel);
+        }
+        Type type;
+        int channel;
+    };
+
+    // Parse a layout given as "native", "mono" or a channel number
+    // counting from 1, returning false if it is none of those
+    static bool parseChannelLayout(QString text, ChannelLayout &layout);
+
+    // Give the transforms with the given ids the given channel
+    // layouts, rather than the native one. This must be called
+    // before the transforms are added.
+    void setChannelLayouts(const map<TransformId, ChannelLayout> &layouts);
+
+    // Print a warning for each id given to setChannelLayouts that
+    // matches none of the transforms added since, returning false if
+    // there were any. Call once all the transforms have been added.
+    bool checkChannelLayouts() const;
+
     bool setSummaryTypes(const set<string> &summaryTypes,
                          const Vamp::HostExt::PluginSummarisingAdapter::SegmentBoundaries &boundaries);
 
     void setSummariesOnly(bool summariesOnly);
 
+    // Add a transform to be run on every source. Transforms may ask
+    // for different sample rates and channel layouts: each source is
+    // read once, at the highest rate any transform needs, and
+    // resampled from that for transforms at lower rates, and mixed
+    // down once per block for all transforms that want a mixdown,
+    // all in the same pass.
     bool addFeatureExtractor(Transform transform,
                              const vector<FeatureWriter*> &writers);
 
@@ -61,11 +223,44 @@ public:
     bool addDefaultFeatureExtractor(TransformId transformId,
                                     const vector<FeatureWriter*> &writers);
 
+    // Set this manager up as an independent copy of another one: the
+    // same rate, channel count and summary options, and a freshly
+    // loaded and initialised plugin for each of the other manager's
+    // transforms. Each writer used by the other manager is replaced
+    // by the one it maps to in writerMap. This is how each worker in
+    // a parallel run gets its own plugin chain.
+    typedef map<FeatureWriter *, FeatureWriter *> WriterMap;
+    bool initialiseFrom(const FeatureExtractionManager &other,
+                        const WriterMap &writerMap);
+
+    // Whether to clean up the temporary directory after each file is
+    // done (the default). Managers running alongside one another must
+    // not do this, or they would remove each other's decode caches.
+    void setCleanupAfterEachFile(bool cleanup);
+
+    // Whether addSource should find out the duration of every local
+    // source even if it means opening the file in full, because its
+    // headers don't say (default false)
+    void setProbeDurations(bool probe);
+
     // Make a note of an audio or playlist file which will be passed
     // to extractFeatures later.  Amongst other things, this may
     // initialise the default sample rate and channel count
     void addSource(QString audioSource, bool willMultiplex);
 
+    // Return the duration in seconds of a source found when it was
+    // added, or 0 if it was not probed
+    double getSourceDuration(QString audioSource) const;
+
+    // Estimate how much memory extracting features from a source
+    // will take, in bytes, from its duration (see above) and the
+    // transforms in use: the decoded audio, plus the features kept
+    // for summaries, plus all other features too if outputBuffered
+    // is true (as when the output is held back to be written in
+    // order). This is only a rough guide.
+    size_t estimateMemoryFootprint(QString audioSource,
+                                   bool outputBuffered) const;
+
     // Extract features from the given audio or playlist file.  If the
     // file is a playlist and force is true, continue extracting even
     // if a file in the playlist fails.
@@ -76,6 +271,47 @@ public:
     // supplied sources.
     void extractFeaturesMultiplexed(QStringList sources);
 
+    // The following allow extraction for a file to be split up into
+    // a separate task for each plugin (see ExtractionTaskScheduler).
+    // decodeSource reads the whole of an audio file into memory,
+    // ready for processing; extractPluginFeatures runs one plugin
+    // (by index, in the order they were added) over that; and
+    // writePluginFeatures writes the results from all plugins in the
+    // order extractFeatures would have done. Different managers
+    // initialised from one another may take part in this, as they
+    // have the same plugins in the same order.
+
+    typedef vector<pair<Transform::SummaryType, Vamp::Plugin::FeatureSet>>
+        SummaryList;
+
+    struct PluginFeatures {
+        vector<Vamp::Plugin::FeatureSet> blocks;
+        Vamp::Plugin::FeatureSet remaining;
+        SummaryList summaries;
+    };
+
+    int getPluginCount() const { return int(m_orderedPlugins.size()); }
+
+    // Return true if the transforms added need more than one sample
+    // rate, or any channel layout other than the native one, so that
+    // each source has to be read for several groups of transforms at
+    // once. The per-plugin functions here don't support this, so
+    // must not be used if it returns true.
+    bool hasTransformGroups() const {
+        return !m_groupManagers.empty() ||
+            !(m_layout == ChannelLayout());
+    }
+    
+    shared_ptr<DecodedAudioBuffer> decodeSource(QString audioSource);
+
+    void extractPluginFeatures(int pluginIndex,
+                               const DecodedAudioBuffer &buffer,
+                               PluginFeatures &features);
+
+    void writePluginFeatures(QString audioSource,
+                             const FeatureWriter::TrackMetadata &metadata,
+                             const vector<PluginFeatures> &features);
+
 private:
     bool m_verbose;
 
@@ -129,19 +365,136 @@ private:
     bool m_summariesOnly; // command line flag
     Vamp::HostExt::PluginSummarisingAdapter::SegmentBoundaries m_boundaries;
 
-    AudioFileReader *prepareReader(QString audioSource);
+    // The rate we read sources at: the highest rate of any of our
+    // transforms
+    sv_samplerate_t getReadRate() const;
+
+    // Return the manager for transforms at the given rate and
+    // layout, other than our own, creating it if need be
+    FeatureExtractionManager *getGroupManager(sv_samplerate_t rate,
+                                              const ChannelLayout &layout);
+
+    // The number of channels our plugins are given
+    int getPluginChannels() const {
+        return (m_layout.type == ChannelLayout::Native ? m_channels : 1);
+    }
+
+    double estimateFeatureBytes(double duration, bool outputBuffered) const;
+
+    // If needLength is true, the reader returned has a frame count,
+    // i.e. it isn't open-ended, unless the source is a pipe
+    AudioFileReader *prepareReader(QString audioSource,
+                                   bool needLength = false);
+    AudioFileReader *openReader(QString audioSource, bool background,
+                                bool needLength = false);
+    size_t estimateDecodedSize(QString audioSource) const;
 
     void extractFeaturesFor(AudioFileReader *reader, QString audioSource);
 
+    void getFrameRange(sv_frame_t frameCount,
+                       sv_frame_t &startFrame, sv_frame_t &endFrame);
+
+    // Return true if the end frame found by getFrameRange depends on
+    // the length of the audio, i.e. if any transform lacks a duration
+    bool isRangeOpenEnded() const;
+
     void writeSummaries(QString audioSource,
                         std::shared_ptr<Vamp::Plugin>);
 
+    SummaryList getSummaries(std::shared_ptr<Vamp::Plugin>);
+
+    FeatureWriter::TrackMetadata getTrackMetadata(AudioFileReader *) const;
+    void setTrackMetadata(QString audioSource,
+                          const FeatureWriter::TrackMetadata &);
+
     void writeFeatures(QString audioSource,
                        std::shared_ptr<Vamp::Plugin>,
                        const Vamp::Plugin::FeatureSet &,
                        Transform::SummaryType summaryType =
                        Transform::NoSummary);
 
+    bool isInRange(std::shared_ptr<Vamp::Plugin>, sv_frame_t frame) const;
+
+    // Read one block from the given frame into data, mixed to our
+    // channel count, through a ReadAheadBuffer made for the reader
+    // by the caller. Return the number of frames of actual audio
+    // read.
+    sv_frame_t readBlock(ReadAheadBuffer &source, sv_frame_t frame,
+                         float *const *data) const;
+
+    // Return true if a block at the given frame, from which got
+    // frames were read, lies beyond endFrame. For an open-ended
+    // reader endFrame starts out unknown, and is found from the
+    // reader's length once a read first comes back empty.
+    bool isPastEnd(AudioFileReader *reader, sv_frame_t frame,
+                   sv_frame_t got, sv_frame_t &endFrame);
+
+    // Return the block at the given frame as it lies in the reader,
+    // if we need only one channel and the reader has it in memory
+    // in the form we want, or 0 if the block must be read in
+    const float *getDirectBlock(AudioFileReader *reader,
+                                sv_frame_t frame) const;
+
+    void processBlock(const float *const *data, sv_frame_t frame);
+
+    void writeBlockFeatures(QString audioSource,
+                            const vector<Vamp::Plugin::FeatureSet> &,
+                            const vector<char> &active);
+
+    void extractBlocks(AudioFileReader *reader, float **data,
+                       QString audioSource,
+                       sv_frame_t startFrame, sv_frame_t endFrame,
+                       ProgressPrinter &progress);
+
+    // A range of frames to run extractBlocks over, for excerpts and
+    // regions, and the label to give its features
+    struct Window {
+        sv_frame_t start;
+        sv_frame_t end;
+        string label;
+    };
+    vector<Window> getExcerptWindows(QString audioSource,
+                                     sv_frame_t frameCount) const;
+    vector<Window> getRegionWindows(QString audioSource,
+                                    sv_frame_t frameCount) const;
+
+    // Run extractBlocks over each window in turn, writing all of the
+    // features for one before starting the next
+    void extractWindows(AudioFileReader *reader, float **data,
+                        QString audioSource, const vector<Window> &windows,
+                        ProgressPrinter &progress);
+
+    struct GroupBranch;
+    void extractBlocksGrouped(AudioFileReader *reader, float **data,
+                                QString audioSource, bool openEnded,
+                                ProgressPrinter &progress);
+    void feedBranch(GroupBranch &branch, const float *const *data,
+                    QString audioSource);
+    void runBranchBlock(GroupBranch &branch, const float *const *data,
+                        QString audioSource);
+
+    void extractBlocksPipelined(AudioFileReader *reader,
+                                QString audioSource,
+                                sv_frame_t startFrame, sv_frame_t endFrame,
+                                ProgressPrinter &progress);
+
+    bool prepareSegments();
+
+    typedef vector<vector<Vamp::Plugin::FeatureSet>> SegmentFeatures;
+
+    void extractSegment(AudioFileReader *reader,
+                        sv_frame_t from, sv_frame_t to,
+                        RealTime keepFrom, const RealTime *keepTo,
+                        SegmentFeatures &results);
+
+    static Vamp::Plugin::FeatureSet selectFeatures
+    (const Vamp::Plugin::FeatureSet &features,
+     const RealTime *from, const RealTime *to);
+
+    void prepareBlockProcessing();
+    void writeRemainingFeatures(QString audioSource, int segments,
+                                const vector<SegmentFeatures> &segmentFeatures);
+
     void testOutputFiles(QString audioSource);
     void finish();
 
@@ -150,6 +503,71 @@ private:
     sv_samplerate_t m_sampleRate;
     int m_channels;
     bool m_normalise;
+    bool m_cleanupAfterEachFile;
+    bool m_probeDurations;
+    QMap<QString, double> m_sourceDurations;
+    QMap<QString, int> m_sourceChannels;
+
+    int m_pluginThreads;
+    int m_multiplexThreads;
+    std::unique_ptr<TaskPool> m_taskPool;
+    bool m_pipelined;
+    bool m_streaming;
+    DecodeCache *m_decodeCache;
+    DecodeMemoryPolicy *m_decodeMemory;
+    QString m_rawFormat;
+    int m_prefetchDepth;
+    size_t m_prefetchBytes;
+    std::unique_ptr<SourcePrefetcher> m_prefetcher;
+
+    // State for the block currently being processed. processBlock
+    // runs m_processTasks, which call each plugin with m_blockData
+    // and leave the results in m_featureSets, for those plugins
+    // marked in m_active.
+    const float *const *m_blockData;
+    RealTime m_blockTimestamp;
+    vector<Vamp::Plugin::FeatureSet> m_featureSets;
+    vector<char> m_active;
+    vector<std::function<void()>> m_processTasks;
+
+    // Segment-parallel extraction. m_splitPlugins holds the indices
+    // in m_orderedPlugins of the plugins we can split, and each of
+    // m_segmentManagers has its own instance of each of those
+    // plugins, in the same order. For the file currently being
+    // processed, m_segmenting says whether we are splitting it, in
+    // which case our own instances of the split plugins only see the
+    // audio up to m_segmentFeedEnd and only report features before
+    // m_segmentLimit.
+    set<TransformId> m_splitTransformIds;
+    int m_splitSegments;
+    bool m_segmentsPrepared;
+    vector<int> m_splitPlugins;
+    vector<char> m_isSplit;
+    vector<std::unique_ptr<FeatureExtractionManager>> m_segmentManagers;
+    bool m_segmenting;
+    sv_frame_t m_segmentFeedEnd;
+    RealTime m_segmentLimit;
+
+    // Our transforms all have the rate m_sampleRate and the channel
+    // layout m_layout, those of the first transform added. Any at
+    // another rate or with another layout are run by a manager of
+    // their own for each rate and layout, with the same writers,
+    // which we feed with audio resampled and mixed from what we read
+    // (see extractBlocksGrouped). These managers have no sources of
+    // their own. In all of them, m_channels is the number of
+    // channels read.
+    map<TransformId, ChannelLayout> m_channelLayouts;
+    set<TransformId> m_usedChannelLayouts;
+    ChannelLayout m_layout;
+    vector<std::unique_ptr<FeatureExtractionManager>> m_groupManagers;
+
+    // Excerpt and region extraction (see setExcerpts and
+    // setRegions). While a window is being processed, m_windowLabel
+    // is what writeFeatures prefixes to each label.
+    vector<Excerpt> m_excerpts;
+    double m_excerptDuration;
+    RegionMap m_regions;
+    string m_windowLabel;
 
     QMap<QString, AudioFileReader *> m_readyReaders;
 };
@@ -0,0 +1,384 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "InMemoryAudioFileReader.h"
+#include "DecodeMemoryPolicy.h"
+
+#include "base/Debug.h"
+
+#include <bqaudiostream/AudioReadStream.h>
+#include <bqaudiostream/AudioReadStreamFactory.h>
+
+#include <QTemporaryFile>
+#include <QDir>
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// Frames to decode at a time
+static const sv_frame_t decodeChunk = 16384;
+
+static bool
+isBigEndianHost()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 0;
+}
+
+InMemoryAudioFileReader *
+InMemoryAudioFileReader::create(FileSource source,
+                                sv_samplerate_t targetRate,
+                                DecodeMemoryPolicy *policy)
+{
+    if (!source.isAvailable()) {
+        return 0;
+    }
+    source.waitForData();
+
+    QString path = source.getLocalFilename();
+    breakfastquay::AudioReadStream *stream = 0;
+
+    try {
+        stream = breakfastquay::AudioReadStreamFactory::createReadStream
+            (path.toLocal8Bit().data());
+    } catch (const std::exception &e) {
+        SVDEBUG << "InMemoryAudioFileReader: no decoder for \"" << path
+                << "\": " << e.what() << endl;
+        return 0;
+    }
+
+    std::unique_ptr<breakfastquay::AudioReadStream> owned(stream);
+    if (!stream || !stream->isOK() ||
+        stream->getChannelCount() == 0 || stream->getSampleRate() == 0) {
+        return 0;
+    }
+
+    if (targetRate != 0 && targetRate != stream->getSampleRate()) {
+        stream->setRetrievalSampleRate(size_t(targetRate));
+    }
+
+    InMemoryAudioFileReader *reader =
+        new InMemoryAudioFileReader(source, policy);
+
+    reader->m_channelCount = int(stream->getChannelCount());
+    reader->m_nativeRate = sv_samplerate_t(stream->getSampleRate());
+    reader->m_sampleRate = sv_samplerate_t(stream->getRetrievalSampleRate());
+    reader->m_title = QString::fromStdString(stream->getTrackName());
+    reader->m_maker = QString::fromStdString(stream->getArtistName());
+
+    bool ok = false;
+    try {
+        ok = reader->decode(stream);
+    } catch (const std::exception &e) {
+        SVDEBUG << "InMemoryAudioFileReader: failed to decode \"" << path
+                << "\": " << e.what() << endl;
+    }
+
+    if (!ok || reader->m_frameCount == 0) {
+        delete reader;
+        return 0;
+    }
+
+    SVDEBUG << "InMemoryAudioFileReader: decoded \"" << source.getLocation()
+            << "\": " << reader->m_channelCount << "ch, "
+            << reader->m_frameCount << " frames at " << reader->m_sampleRate
+            << "Hz, " << reader->m_spilledFrames << " of them spilled"
+            << endl;
+
+    return reader;
+}
+
+InMemoryAudioFileReader::InMemoryAudioFileReader(FileSource source,
+                                                 DecodeMemoryPolicy *policy) :
+    m_source(source),
+    m_policy(policy),
+    m_nativeRate(0),
+    m_peak(0.f),
+    m_memoryFrames(0),
+    m_held(0),
+    m_spilled(0),
+    m_bytesPerFrame(0),
+    m_spilledFrames(0)
+{
+    m_frameCount = 0;
+}
+
+InMemoryAudioFileReader::~InMemoryAudioFileReader()
+{
+    // The spill file is unmapped and removed along with m_spillFile
+    m_policy->release(m_held);
+}
+
+bool
+InMemoryAudioFileReader::decode(breakfastquay::AudioReadStream *stream)
+{
+    int ch = m_channelCount;
+    size_t frameBytes = ch * sizeof(float);
+
+    // Reserve room for as much as we expect to be allowed to keep,
+    // so the vector needn't be reallocated (and briefly held twice)
+    // as it grows
+    sv_frame_t expected = sv_frame_t
+        (ceil(double(stream->getEstimatedFrameCount()) *
+              m_sampleRate / m_nativeRate));
+    size_t reserve = std::min(size_t(expected) * frameBytes,
+                              m_policy->getAvailable());
+    m_memory.reserve(reserve / sizeof(float));
+
+    floatvec_t chunk(decodeChunk * ch);
+    bool spilling = false;
+
+    while (true) {
+
+        size_t got = stream->getInterleavedFrames(decodeChunk, chunk.data());
+        if (got == 0) {
+            break;
+        }
+
+        for (size_t i = 0; i < got * ch; ++i) {
+            m_peak = std::max(m_peak, fabsf(chunk[i]));
+        }
+
+        // Once anything has been spilled, everything after it is
+        // spilled too, so the audio in memory is all one piece
+
+        if (!spilling && m_policy->tryTake(got * frameBytes)) {
+            m_held += got * frameBytes;
+            m_memory.insert(m_memory.end(),
+                            chunk.begin(), chunk.begin() + got * ch);
+            m_memoryFrames += got;
+            continue;
+        }
+
+        spilling = true;
+        if (!spill(chunk.data(), got)) {
+            return false;
+        }
+    }
+
+    m_frameCount = m_memoryFrames + m_spilledFrames;
+
+    if (m_spillFile) {
+        if (!m_spillFile->flush()) {
+            SVCERR << "ERROR: Failed to write spill file \""
+                   << m_spillFile->fileName() << "\"" << endl;
+            return false;
+        }
+        m_spilled = m_spillFile->map(0, m_spillFile->size());
+        if (!m_spilled) {
+            SVCERR << "ERROR: Failed to map spill file \""
+                   << m_spillFile->fileName() << "\"" << endl;
+            return false;
+        }
+    }
+
+    m_policy->recordSource(size_t(m_frameCount) * frameBytes,
+                           size_t(m_spilledFrames) * frameBytes,
+                           size_t(m_spilledFrames) * m_bytesPerFrame);
+    return true;
+}
+
+bool
+InMemoryAudioFileReader::spill(const float *frames, sv_frame_t n)
+{
+    int ch = m_channelCount;
+    bool int16 = (m_policy->getSpillFormat() ==
+                  DecodeMemoryPolicy::SpillFormat::Int16);
+
+    if (!m_spillFile) {
+
+        QString dir = m_policy->getSpillDirectory();
+        QDir().mkpath(dir);
+
+        m_spillFile.reset(new QTemporaryFile(dir + "/spill-XXXXXX.raw"));
+        if (!m_spillFile->open()) {
+            SVCERR << "ERROR: Failed to create spill file in \""
+                   << dir << "\"" << endl;
+            return false;
+        }
+
+        // Written in a layout that MappedAudioFileReader::convert
+        // can read back from: headerless, little-endian integers or
+        // floats in our own byte order
+        if (int16) {
+            m_spillLayout.encoding = MappedAudioFileReader::Encoding::Int16;
+            m_spillLayout.bigEndian = false;
+            m_spillLayout.bytesPerSample = 2;
+        } else {
+            m_spillLayout.encoding = MappedAudioFileReader::Encoding::Float32;
+            m_spillLayout.bigEndian = isBigEndianHost();
+            m_spillLayout.bytesPerSample = 4;
+        }
+        m_spillLayout.channels = ch;
+        m_spillLayout.sampleRate = m_sampleRate;
+        m_bytesPerFrame = m_spillLayout.bytesPerSample * ch;
+    }
+
+    qint64 bytes = qint64(n) * m_bytesPerFrame;
+    qint64 written = 0;
+
+    if (int16) {
+        // Scaled to match the 1/32768 that convert reads back with
+        vector<unsigned char> encoded(bytes);
+        for (sv_frame_t i = 0; i < n * ch; ++i) {
+            long v = lrintf(frames[i] * 32768.f);
+            v = std::max(-32768L, std::min(32767L, v));
+            uint16_t u = uint16_t(int16_t(v));
+            encoded[i*2] = (unsigned char)(u & 0xff);
+            encoded[i*2 + 1] = (unsigned char)(u >> 8);
+        }
+        written = m_spillFile->write
+            (reinterpret_cast<const char *>(encoded.data()), bytes);
+    } else {
+        written = m_spillFile->write
+            (reinterpret_cast<const char *>(frames), bytes);
+    }
+
+    if (written != bytes) {
+        SVCERR << "ERROR: Failed to write spill file \""
+               << m_spillFile->fileName() << "\"" << endl;
+        return false;
+    }
+
+    m_spilledFrames += n;
+    m_spillLayout.frameCount = m_spilledFrames;
+    return true;
+}
+
+void
+InMemoryAudioFileReader::convertSpilled(sv_frame_t start, sv_frame_t n,
+                                        int c, float *out, int outStride,
+                                        bool add) const
+{
+    const unsigned char *in =
+        m_spilled + (start - m_memoryFrames) * m_bytesPerFrame;
+    MappedAudioFileReader::convert(m_spillLayout, in, c, n,
+                                   out, outStride, add);
+}
+
+floatvec_t
+InMemoryAudioFileReader::getInterleavedFrames(sv_frame_t start,
+                                              sv_frame_t count) const
+{
+    if (start < 0 || start >= m_frameCount) {
+        return {};
+    }
+    sv_frame_t n = std::min(count, m_frameCount - start);
+    int rc = m_channelCount;
+
+    sv_frame_t inMemory = std::max(sv_frame_t(0),
+                                   std::min(n, m_memoryFrames - start));
+
+    floatvec_t frames(n * rc);
+
+    if (inMemory > 0) {
+        std::copy(m_memory.begin() + start * rc,
+                  m_memory.begin() + (start + inMemory) * rc,
+                  frames.begin());
+    }
+
+    if (n > inMemory) {
+        for (int c = 0; c < rc; ++c) {
+            convertSpilled(start + inMemory, n - inMemory, c,
+                           frames.data() + inMemory * rc + c, rc, false);
+        }
+    }
+
+    applyGain(frames.data(), n * rc);
+    return frames;
+}
+
+sv_frame_t
+InMemoryAudioFileReader::readChannels(sv_frame_t start,
+                                      sv_frame_t count,
+                                      int channels,
+                                      float *const *buffers) const
+{
+    sv_frame_t n = 0;
+    if (start >= 0 && start < m_frameCount) {
+        n = std::min(count, m_frameCount - start);
+    }
+
+    int rc = m_channelCount;
+
+    sv_frame_t inMemory = 0;
+    if (n > 0) {
+        inMemory = std::max(sv_frame_t(0),
+                            std::min(n, m_memoryFrames - start));
+    }
+
+    if (inMemory > 0) {
+        deinterleave(m_memory.data() + start * rc, inMemory, rc,
+                     inMemory, channels, buffers);
+    }
+
+    sv_frame_t spilled = n - inMemory;
+
+    if (spilled > 0) {
+
+        sv_frame_t from = start + inMemory;
+
+        if (channels == 1 && rc > 1) {
+
+            // Summed from zero in channel order and then divided, as
+            // in DeinterleavingReader::deinterleave
+
+            float *out = buffers[0] + inMemory;
+            std::fill(out, out + spilled, 0.f);
+            for (int c = 0; c < rc; ++c) {
+                convertSpilled(from, spilled, c, out, 1, true);
+            }
+            for (sv_frame_t i = 0; i < spilled; ++i) {
+                out[i] /= float(rc);
+            }
+
+        } else {
+
+            for (int c = 0; c < channels; ++c) {
+                float *out = buffers[c] + inMemory;
+                if (c < rc) {
+                    convertSpilled(from, spilled, c, out, 1, false);
+                } else {
+                    std::fill(out, out + spilled, 0.f);
+                }
+            }
+        }
+    }
+
+    applyGain(channels, buffers, n);
+
+    for (int c = 0; c < channels; ++c) {
+        std::fill(buffers[c] + n, buffers[c] + count, 0.f);
+    }
+
+    return n;
+}
+
+const float *
+InMemoryAudioFileReader::getChannelData(sv_frame_t start,
+                                        sv_frame_t count) const
+{
+    if (m_channelCount != 1 || m_gain != 1.f ||
+        start < 0 || start + count > m_memoryFrames) {
+        return 0;
+    }
+    return m_memory.data() + start;
+}
@@ -0,0 +1,130 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _IN_MEMORY_AUDIO_FILE_READER_H_
+#define _IN_MEMORY_AUDIO_FILE_READER_H_
+
+#include "data/fileio/AudioFileReader.h"
+#include "data/fileio/FileSource.h"
+
+#include "DeinterleavingReader.h"
+#include "MappedAudioFileReader.h"
+
+#include <QString>
+
+#include <memory>
+
+class QTemporaryFile;
+class DecodeMemoryPolicy;
+
+namespace breakfastquay {
+    class AudioReadStream;
+}
+
+/**
+ * An AudioFileReader that decodes (and resamples) a whole file when
+ * it is opened, keeping the decoded audio in memory for as long as
+ * the DecodeMemoryPolicy allows, rather than writing it all to a
+ * float WAV file in the temporary directory as the ordinary readers
+ * do. Once the policy's allowance has been used up, the rest of the
+ * file is written to a spill file in the policy's spill format, and
+ * read back from there in place by mapping it.
+ *
+ * The peak level is found as the audio is decoded, so that it can be
+ * normalised by setting a gain (see DeinterleavingReader::setGain)
+ * without reading it all again. Anything above full scale is clipped
+ * when spilled as 16-bit integers, whatever the gain.
+ */
+class InMemoryAudioFileReader : public AudioFileReader,
+                                public DeinterleavingReader
+{
+    Q_OBJECT
+
+public:
+    // Return a reader for the given file, with audio resampled to the
+    // given rate (or the file's own rate if 0), or return 0 if there
+    // is no decoder here for it or a spill file can't be written.
+    static InMemoryAudioFileReader *create(FileSource source,
+                                           sv_samplerate_t targetRate,
+                                           DecodeMemoryPolicy *policy);
+
+    virtual ~InMemoryAudioFileReader();
+
+    virtual QString getError() const override { return ""; }
+    virtual bool isQuicklySeekable() const override { return true; }
+
+    virtual QString getTitle() const override { return m_title; }
+    virtual QString getMaker() const override { return m_maker; }
+
+    virtual QString getLocation() const { return m_source.getLocation(); }
+    virtual QString getLocalFilename() const { return m_source.getLocalFilename(); }
+
+    virtual sv_samplerate_t getNativeRate() const override { return m_nativeRate; }
+
+    virtual floatvec_t getInterleavedFrames
+    (sv_frame_t start, sv_frame_t count) const override;
+
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const override;
+
+    virtual const float *getChannelData(sv_frame_t start,
+                                        sv_frame_t count) const override;
+
+    // Return the largest absolute sample value in the decoded audio,
+    // before any gain
+    float getPeak() const { return m_peak; }
+
+private:
+    InMemoryAudioFileReader(FileSource source, DecodeMemoryPolicy *policy);
+
+    // Decode everything from the given stream, returning false if a
+    // spill file was needed and couldn't be written
+    bool decode(breakfastquay::AudioReadStream *stream);
+
+    // Convert n frames of channel c of spilled audio, from frame
+    // start onwards (counting from the start of the file), into out
+    // with the given stride
+    void convertSpilled(sv_frame_t start, sv_frame_t n, int c,
+                        float *out, int outStride, bool add) const;
+
+    // Write interleaved audio to the spill file in the spill format
+    bool spill(const float *frames, sv_frame_t n);
+
+    FileSource m_source;
+    DecodeMemoryPolicy *m_policy;
+    QString m_title;
+    QString m_maker;
+    sv_samplerate_t m_nativeRate;
+    float m_peak;
+
+    // The first m_memoryFrames frames of interleaved audio, and the
+    // number of bytes taken from the policy for them
+    floatvec_t m_memory;
+    sv_frame_t m_memoryFrames;
+    size_t m_held;
+
+    // The rest, in the spill file
+    std::unique_ptr<QTemporaryFile> m_spillFile;
+    const unsigned char *m_spilled;
+    MappedAudioFileReader::Layout m_spillLayout;
+    int m_bytesPerFrame;
+    sv_frame_t m_spilledFrames;
+
+    InMemoryAudioFileReader(const InMemoryAudioFileReader &) =delete;
+    InMemoryAudioFileReader &operator=(const InMemoryAudioFileReader &) =delete;
+};
+
+#endif
@@ -0,0 +1,564 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MappedAudioFileReader.h"
+
+#include "base/Debug.h"
+
+#include <QFile>
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static bool
+isBigEndianHost()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 0;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+        (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static uint16_t
+le16(const unsigned char *p)
+{
+    return uint16_t(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+be32(const unsigned char *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+        (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint16_t
+be16(const unsigned char *p)
+{
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+static QString
+chunkText(const unsigned char *p, size_t size)
+{
+    // Text chunks are usually, but not always, nul-terminated
+    size_t n = 0;
+    while (n < size && p[n]) ++n;
+    return QString::fromUtf8(reinterpret_cast<const char *>(p), int(n));
+}
+
+bool
+MappedAudioFileReader::parseWav(const unsigned char *p, size_t size,
+                                Layout &layout)
+{
+    if (size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
+        return false;
+    }
+
+    bool haveFormat = false, haveData = false;
+    int format = 0, bits = 0, blockAlign = 0;
+    size_t dataSize = 0;
+    
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+
+        const unsigned char *chunk = p + pos;
+        size_t chunkSize = le32(chunk + 4);
+        size_t bodySize = std::min(chunkSize, size - pos - 8);
+        const unsigned char *body = chunk + 8;
+        
+        if (!memcmp(chunk, "fmt ", 4) && bodySize >= 16) {
+            format = le16(body);
+            layout.channels = le16(body + 2);
+            layout.sampleRate = le32(body + 4);
+            blockAlign = le16(body + 12);
+            bits = le16(body + 14);
+            if (format == 0xfffe && bodySize >= 26) {
+                // WAVE_FORMAT_EXTENSIBLE: the real format is at the
+                // start of the subformat GUID
+                format = le16(body + 24);
+            }
+            haveFormat = true;
+        } else if (!memcmp(chunk, "data", 4)) {
+            layout.dataOffset = pos + 8;
+            dataSize = bodySize;
+            haveData = true;
+        } else if (!memcmp(chunk, "srcr", 4) && bodySize >= 8) {
+            // Written by DecodeCache: the rate of the file this one
+            // was decoded from
+            uint64_t u = (uint64_t(le32(body + 4)) << 32) | le32(body);
+            double rate;
+            memcpy(&rate, &u, 8);
+            layout.nativeRate = rate;
+        } else if (!memcmp(chunk, "LIST", 4) && bodySize >= 4 &&
+                   !memcmp(body, "INFO", 4)) {
+            size_t ipos = 4;
+            while (ipos + 8 <= bodySize) {
+                const unsigned char *item = body + ipos;
+                size_t itemSize = std::min(size_t(le32(item + 4)),
+                                           bodySize - ipos - 8);
+                if (!memcmp(item, "INAM", 4)) {
+                    layout.title = chunkText(item + 8, itemSize);
+                } else if (!memcmp(item, "IART", 4)) {
+                    layout.maker = chunkText(item + 8, itemSize);
+                }
+                ipos += 8 + itemSize + (itemSize & 1);
+            }
+        }
+
+        // Chunks are padded to an even length
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    if (!haveFormat || !haveData || layout.channels == 0 || bits % 8) {
+        return false;
+    }
+
+    layout.bytesPerSample = bits / 8;
+    layout.bigEndian = false;
+
+    if (format == 1) {
+        switch (bits) {
+        case 8: layout.encoding = Encoding::UInt8; break;
+        case 16: layout.encoding = Encoding::Int16; break;
+        case 24: layout.encoding = Encoding::Int24; break;
+        case 32: layout.encoding = Encoding::Int32; break;
+        default: return false;
+        }
+    } else if (format == 3) {
+        switch (bits) {
+        case 32: layout.encoding = Encoding::Float32; break;
+        case 64: layout.encoding = Encoding::Float64; break;
+        default: return false;
+        }
+    } else {
+        return false;
+    }
+
+    if (blockAlign != layout.channels * layout.bytesPerSample) {
+        return false;
+    }
+
+    layout.frameCount = sv_frame_t(dataSize / blockAlign);
+    return true;
+}
+
+bool
+MappedAudioFileReader::parseAiff(const unsigned char *p, size_t size,
+                                 Layout &layout)
+{
+    if (size < 12 || memcmp(p, "FORM", 4)) {
+        return false;
+    }
+
+    bool aifc = !memcmp(p + 8, "AIFC", 4);
+    if (!aifc && memcmp(p + 8, "AIFF", 4)) {
+        return false;
+    }
+    
+    bool haveCommon = false, haveData = false;
+    int bits = 0;
+    char compression[4] = { 'N', 'O', 'N', 'E' };
+    sv_frame_t frames = 0;
+    size_t dataSize = 0;
+
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+
+        const unsigned char *chunk = p + pos;
+        size_t chunkSize = be32(chunk + 4);
+        size_t bodySize = std::min(chunkSize, size - pos - 8);
+        const unsigned char *body = chunk + 8;
+
+        if (!memcmp(chunk, "COMM", 4) && bodySize >= 18) {
+            layout.channels = be16(body);
+            frames = be32(body + 2);
+            bits = be16(body + 6);
+
+            // 80-bit IEEE 754 extended precision
+            int exponent = (be16(body + 8) & 0x7fff) - 16383 - 63;
+            uint64_t mantissa =
+                (uint64_t(be32(body + 10)) << 32) | be32(body + 14);
+            layout.sampleRate = ldexp(double(mantissa), exponent);
+
+            if (aifc) {
+                if (bodySize < 22) return false;
+                memcpy(compression, body + 18, 4);
+            }
+            haveCommon = true;
+        } else if (!memcmp(chunk, "SSND", 4) && bodySize >= 8) {
+            size_t offset = be32(body);
+            if (offset > bodySize - 8) return false;
+            layout.dataOffset = pos + 16 + offset;
+            dataSize = bodySize - 8 - offset;
+            haveData = true;
+        } else if (!memcmp(chunk, "NAME", 4)) {
+            layout.title = chunkText(body, bodySize);
+        } else if (!memcmp(chunk, "AUTH", 4)) {
+            layout.maker = chunkText(body, bodySize);
+        }
+
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    if (!haveCommon || !haveData || layout.channels == 0 || bits == 0) {
+        return false;
+    }
+
+    // Sample sizes that aren't a whole number of bytes are stored
+    // left-justified in the next size up
+    layout.bytesPerSample = (bits + 7) / 8;
+    layout.bigEndian = true;
+
+    if (!memcmp(compression, "NONE", 4) || !memcmp(compression, "twos", 4) ||
+        !memcmp(compression, "sowt", 4)) {
+        layout.bigEndian = memcmp(compression, "sowt", 4);
+        switch (layout.bytesPerSample) {
+        case 1: layout.encoding = Encoding::Int8; break;
+        case 2: layout.encoding = Encoding::Int16; break;
+        case 3: layout.encoding = Encoding::Int24; break;
+        case 4: layout.encoding = Encoding::Int32; break;
+        default: return false;
+        }
+    } else if (!memcmp(compression, "fl32", 4) ||
+               !memcmp(compression, "FL32", 4)) {
+        layout.encoding = Encoding::Float32;
+        layout.bytesPerSample = 4;
+    } else if (!memcmp(compression, "fl64", 4) ||
+               !memcmp(compression, "FL64", 4)) {
+        layout.encoding = Encoding::Float64;
+        layout.bytesPerSample = 8;
+    } else {
+        return false;
+    }
+
+    size_t bytesPerFrame = size_t(layout.channels) * layout.bytesPerSample;
+    layout.frameCount = std::min(frames, sv_frame_t(dataSize / bytesPerFrame));
+    return true;
+}
+
+MappedAudioFileReader *
+MappedAudioFileReader::create(FileSource source,
+                              sv_samplerate_t targetRate)
+{
+#ifdef _WIN32
+    (void)source;
+    (void)targetRate;
+    return 0;
+#else
+    if (!source.isAvailable()) {
+        return 0;
+    }
+    source.waitForData();
+
+    QString path = source.getLocalFilename();
+    
+    int fd = ::open(QFile::encodeName(path).data(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 12) {
+        ::close(fd);
+        return 0;
+    }
+
+    size_t size = size_t(st.st_size);
+    void *mapping = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    const unsigned char *p = static_cast<const unsigned char *>(mapping);
+    Layout layout;
+
+    if ((!parseWav(p, size, layout) && !parseAiff(p, size, layout)) ||
+        layout.frameCount == 0 ||
+        (targetRate != 0 && targetRate != layout.sampleRate)) {
+        munmap(mapping, size);
+        return 0;
+    }
+
+    // We expect to read from start to end, so ask for generous
+    // readahead and early release of pages we have passed
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    
+    return new MappedAudioFileReader(source, mapping, size, layout);
+#endif
+}
+
+MappedAudioFileReader::MappedAudioFileReader(FileSource source,
+                                             void *mapping,
+                                             size_t mappedSize,
+                                             const Layout &layout) :
+    m_source(source),
+    m_title(layout.title),
+    m_maker(layout.maker),
+    m_nativeRate(layout.nativeRate != 0 ? layout.nativeRate : layout.sampleRate),
+    m_mapping(mapping),
+    m_mappedSize(mappedSize),
+    m_data(static_cast<const unsigned char *>(mapping) + layout.dataOffset),
+    m_layout(layout),
+    m_bytesPerFrame(layout.bytesPerSample * layout.channels)
+{
+    m_channelCount = layout.channels;
+    m_sampleRate = layout.sampleRate;
+    m_frameCount = layout.frameCount;
+
+    SVDEBUG << "MappedAudioFileReader: mapped \"" << source.getLocation()
+            << "\": " << m_channelCount << "ch, " << m_frameCount
+            << " frames at " << m_sampleRate << "Hz" << endl;
+}
+
+MappedAudioFileReader::~MappedAudioFileReader()
+{
+#ifndef _WIN32
+    munmap(m_mapping, m_mappedSize);
+#endif
+}
+
+template <typename Decode>
+static void
+convertSamples(const unsigned char *in, int inStride, sv_frame_t n,
+               float *out, int outStride, bool add, Decode decode)
+{
+    if (add) {
+        for (sv_frame_t i = 0; i < n; ++i) {
+            out[i * outStride] += decode(in + i * inStride);
+        }
+    } else {
+        for (sv_frame_t i = 0; i < n; ++i) {
+            out[i * outStride] = decode(in + i * inStride);
+        }
+    }
+}
+
+void
+MappedAudioFileReader::convert(const Layout &layout,
+                               const unsigned char *frame, int channel,
+                               sv_frame_t n, float *out, int outStride,
+                               bool add)
+{
+    // The scale factors are those libsndfile uses, so that we return
+    // exactly what the ordinary reader would
+
+    const unsigned char *in = frame + channel * layout.bytesPerSample;
+    int stride = layout.bytesPerSample * layout.channels;
+    bool be = layout.bigEndian;
+
+    switch (layout.encoding) {
+
+    case Encoding::UInt8:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [](const unsigned char *s) {
+                           return (float(s[0]) - 128.f) * (1.f / 128.f);
+                       });
+        break;
+
+    case Encoding::Int8:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [](const unsigned char *s) {
+                           return float(int8_t(s[0])) * (1.f / 128.f);
+                       });
+        break;
+
+    case Encoding::Int16:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [be](const unsigned char *s) {
+                           int16_t v = int16_t(be ? be16(s) : le16(s));
+                           return float(v) * (1.f / 32768.f);
+                       });
+        break;
+
+    case Encoding::Int24:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [be](const unsigned char *s) {
+                           uint32_t u = be ?
+                               ((uint32_t(s[0]) << 24) |
+                                (uint32_t(s[1]) << 16) |
+                                (uint32_t(s[2]) << 8)) :
+                               ((uint32_t(s[2]) << 24) |
+                                (uint32_t(s[1]) << 16) |
+                                (uint32_t(s[0]) << 8));
+                           return float(int32_t(u)) * (1.f / 2147483648.f);
+                       });
+        break;
+
+    case Encoding::Int32:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [be](const unsigned char *s) {
+                           uint32_t u = be ? be32(s) : le32(s);
+                           return float(int32_t(u)) * (1.f / 2147483648.f);
+                       });
+        break;
+
+    case Encoding::Float32:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [be](const unsigned char *s) {
+                           uint32_t u = be ? be32(s) : le32(s);
+                           float f;
+                           memcpy(&f, &u, 4);
+                           return f;
+                       });
+        break;
+
+    case Encoding::Float64:
+        convertSamples(in, stride, n, out, outStride, add,
+                       [be](const unsigned char *s) {
+                           uint64_t u = be ?
+                               ((uint64_t(be32(s)) << 32) | be32(s + 4)) :
+                               ((uint64_t(le32(s + 4)) << 32) | le32(s));
+                           double d;
+                           memcpy(&d, &u, 8);
+                           return float(d);
+                       });
+        break;
+    }
+}
+
+floatvec_t
+MappedAudioFileReader::getInterleavedFrames(sv_frame_t start,
+                                            sv_frame_t count) const
+{
+    if (start < 0 || start >= m_frameCount) {
+        return {};
+    }
+    sv_frame_t n = std::min(count, m_frameCount - start);
+
+    floatvec_t frames(n * m_channelCount);
+    const unsigned char *in = m_data + start * m_bytesPerFrame;
+
+    for (int c = 0; c < m_channelCount; ++c) {
+        convert(m_layout, in, c, n, frames.data() + c, m_channelCount, false);
+    }
+
+    applyGain(frames.data(), n * m_channelCount);
+    return frames;
+}
+
+sv_frame_t
+MappedAudioFileReader::readChannels(sv_frame_t start,
+                                    sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const
+{
+    sv_frame_t n = 0;
+    if (start >= 0 && start < m_frameCount) {
+        n = std::min(count, m_frameCount - start);
+    }
+
+    const unsigned char *in = 0;
+    if (n > 0) {
+        in = m_data + start * m_bytesPerFrame;
+    }
+    int rc = m_channelCount;
+
+    if (channels == 1 && rc > 1) {
+
+        // Summed from zero in channel order and then divided, as in
+        // DeinterleavingReader::deinterleave
+        
+        float *out = buffers[0];
+        std::fill(out, out + count, 0.f);
+        if (n > 0) {
+            for (int c = 0; c < rc; ++c) {
+                convert(m_layout, in, c, n, out, 1, true);
+            }
+            for (sv_frame_t i = 0; i < n; ++i) {
+                out[i] /= float(rc);
+            }
+        }
+        applyGain(out, n);
+        return n;
+    }
+
+    for (int c = 0; c < channels; ++c) {
+        float *out = buffers[c];
+        if (c < rc && n > 0) {
+            convert(m_layout, in, c, n, out, 1, false);
+            std::fill(out + n, out + count, 0.f);
+        } else {
+            std::fill(out, out + count, 0.f);
+        }
+    }
+
+    applyGain(channels, buffers, n);
+    return n;
+}
+
+float
+MappedAudioFileReader::findPeak() const
+{
+    // Converted a chunk at a time, so this costs little more than
+    // reading through the file
+    
+    const sv_frame_t chunk = 65536;
+    floatvec_t frames(chunk * m_channelCount);
+    float peak = 0.f;
+
+    for (sv_frame_t i = 0; i < m_frameCount; i += chunk) {
+        sv_frame_t n = std::min(chunk, m_frameCount - i);
+        const unsigned char *in = m_data + i * m_bytesPerFrame;
+        for (int c = 0; c < m_channelCount; ++c) {
+            convert(m_layout, in, c, n, frames.data() + c,
+                    m_channelCount, false);
+        }
+        for (sv_frame_t j = 0; j < n * m_channelCount; ++j) {
+            peak = std::max(peak, fabsf(frames[j]));
+        }
+    }
+
+    return peak;
+}
+
+const float *
+MappedAudioFileReader::getChannelData(sv_frame_t start,
+                                      sv_frame_t count) const
+{
+    if (m_channelCount != 1 || m_gain != 1.f ||
+        m_layout.encoding != Encoding::Float32 ||
+        m_layout.bigEndian != isBigEndianHost() ||
+        start < 0 || start + count > m_frameCount) {
+        return 0;
+    }
+
+    const unsigned char *p = m_data + start * m_bytesPerFrame;
+    if (reinterpret_cast<uintptr_t>(p) % alignof(float) != 0) {
+        return 0;
+    }
+
+    return reinterpret_cast<const float *>(p);
+}
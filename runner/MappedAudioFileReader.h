@@ -0,0 +1,140 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _MAPPED_AUDIO_FILE_READER_H_
+#define _MAPPED_AUDIO_FILE_READER_H_
+
+#include "data/fileio/AudioFileReader.h"
+#include "data/fileio/FileSource.h"
+
+#include "DeinterleavingReader.h"
+
+#include <QString>
+
+/**
+ * An AudioFileReader for uncompressed WAV and AIFF files that maps
+ * the file into memory and converts samples straight from the mapped
+ * bytes into the caller's buffers. There is no decoding step and no
+ * cache: the operating system pages the file in as it is read, with
+ * readahead suited to reading it from start to end.
+ *
+ * A mono file of 32-bit floats in the machine's own byte order needs
+ * no conversion at all, and can be handed to plugins in place (see
+ * getChannelData), unless a gain has been set.
+ *
+ * Only files already at the required sample rate can be read this
+ * way, as there is nowhere to resample them; others are left to the
+ * ordinary readers.
+ */
+class MappedAudioFileReader : public AudioFileReader,
+                              public DeinterleavingReader
+{
+    Q_OBJECT
+
+public:
+    // Return a reader for the given file, or return 0 if it is not
+    // an uncompressed WAV or AIFF file that we understand, or its
+    // sample rate differs from the target rate (if that is nonzero),
+    // or it can't be mapped.
+    static MappedAudioFileReader *create(FileSource source,
+                                         sv_samplerate_t targetRate);
+
+    virtual ~MappedAudioFileReader();
+
+    virtual QString getError() const override { return ""; }
+    virtual bool isQuicklySeekable() const override { return true; }
+
+    virtual QString getTitle() const override { return m_title; }
+    virtual QString getMaker() const override { return m_maker; }
+
+    virtual QString getLocation() const { return m_source.getLocation(); }
+    virtual QString getLocalFilename() const { return m_source.getLocalFilename(); }
+
+    virtual sv_samplerate_t getNativeRate() const override { return m_nativeRate; }
+
+    virtual floatvec_t getInterleavedFrames
+    (sv_frame_t start, sv_frame_t count) const override;
+
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const override;
+
+    virtual const float *getChannelData(sv_frame_t start,
+                                        sv_frame_t count) const override;
+
+    // Return the largest absolute sample value in the file, before
+    // any gain, by converting all of it
+    float findPeak() const;
+
+    // The sample encodings and file layouts we understand. These,
+    // parseWav and convert are also used by PipeAudioFileReader for
+    // the same formats arriving on a pipe.
+    
+    enum class Encoding {
+        UInt8, Int8, Int16, Int24, Int32, Float32, Float64
+    };
+
+    // Where and how the audio is laid out in a file
+    struct Layout {
+        Layout() : encoding(Encoding::Int16), bigEndian(false),
+                   bytesPerSample(0), channels(0), sampleRate(0),
+                   nativeRate(0), dataOffset(0), frameCount(0) { }
+        Encoding encoding;
+        bool bigEndian;
+        int bytesPerSample;
+        int channels;
+        sv_samplerate_t sampleRate;
+        sv_samplerate_t nativeRate; // if the file says it was resampled
+        size_t dataOffset;
+        sv_frame_t frameCount;
+        QString title;
+        QString maker;
+    };
+
+    // Find the layout of a mapped file of the given size, returning
+    // false if it isn't a file we can read. A WAV file cut off just
+    // after the header of its data chunk is accepted, with a frame
+    // count of 0.
+    static bool parseWav(const unsigned char *p, size_t size, Layout &layout);
+
+    // Convert n samples of channel channel, starting at the given
+    // frame of data in the given layout, into out, writing every
+    // outStride'th element. If add is true, add to what is in out
+    // already.
+    static void convert(const Layout &layout, const unsigned char *frame,
+                        int channel, sv_frame_t n,
+                        float *out, int outStride, bool add);
+
+private:
+    static bool parseAiff(const unsigned char *p, size_t size, Layout &layout);
+
+    MappedAudioFileReader(FileSource source, void *mapping,
+                          size_t mappedSize, const Layout &layout);
+
+    FileSource m_source;
+    QString m_title;
+    QString m_maker;
+    sv_samplerate_t m_nativeRate;
+    void *m_mapping;
+    size_t m_mappedSize;
+    const unsigned char *m_data;
+    Layout m_layout;
+    int m_bytesPerFrame;
+
+    MappedAudioFileReader(const MappedAudioFileReader &) =delete;
+    MappedAudioFileReader &operator=(const MappedAudioFileReader &) =delete;
+};
+
+#endif
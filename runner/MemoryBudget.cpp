@@ -0,0 +1,124 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MemoryBudget.h"
+
+#include "base/Debug.h"
+
+using namespace std;
+
+static int
+toMB(size_t bytes)
+{
+    return int((bytes + 1048575) / 1048576);
+}
+
+MemoryBudget::MemoryBudget(size_t budget) :
+    m_budget(budget),
+    m_used(0),
+    m_throttling(false)
+{
+}
+
+bool
+MemoryBudget::isAdmissible(size_t bytes) const
+{
+    // Called with m_mutex held
+    return m_used == 0 || m_used + bytes <= m_budget;
+}
+
+void
+MemoryBudget::reportThrottling(size_t bytes, QString source)
+{
+    // Called with m_mutex held. Report only the first of a series of
+    // refusals, or we would repeat ourselves every time a caller of
+    // tryAcquire looked for something to do
+    
+    if (m_throttling) return;
+    m_throttling = true;
+    
+    SVCERR << "Memory budget: waiting for some of " << toMB(m_used)
+           << "MB in use to be freed before starting \"" << source
+           << "\" (estimated " << toMB(bytes) << "MB, budget "
+           << toMB(m_budget) << "MB)" << endl;
+}
+
+void
+MemoryBudget::take(size_t bytes, QString source)
+{
+    // Called with m_mutex held
+    
+    if (bytes > m_budget) {
+        SVCERR << "WARNING: Estimated memory use of " << toMB(bytes)
+               << "MB for \"" << source << "\" exceeds budget of "
+               << toMB(m_budget) << "MB on its own" << endl;
+    }
+    
+    m_used += bytes;
+    m_throttling = false;
+}
+
+void
+MemoryBudget::acquire(size_t bytes, QString source)
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    if (!isAdmissible(bytes)) {
+        reportThrottling(bytes, source);
+        m_condition.wait(lock, [this, bytes]() {
+                return isAdmissible(bytes);
+            });
+    }
+
+    take(bytes, source);
+}
+
+bool
+MemoryBudget::tryAcquire(size_t bytes, QString source)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!isAdmissible(bytes)) {
+        reportThrottling(bytes, source);
+        return false;
+    }
+
+    take(bytes, source);
+    return true;
+}
+
+void
+MemoryBudget::acquireNow(size_t bytes, QString source)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!isAdmissible(bytes)) {
+        SVCERR << "Memory budget: exceeding budget of " << toMB(m_budget)
+               << "MB to start \"" << source << "\", as the "
+               << toMB(m_used) << "MB in use is waiting on it" << endl;
+    }
+
+    take(bytes, source);
+}
+
+void
+MemoryBudget::release(size_t bytes)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_used = (bytes > m_used ? 0 : m_used - bytes);
+    }
+    m_condition.notify_all();
+}
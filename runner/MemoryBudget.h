@@ -0,0 +1,73 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+
+#include <QString>
+
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+/**
+ * Admission control for work with an estimated memory cost. Before
+ * starting on a source, a worker acquires its estimated footprint
+ * from the budget, waiting until enough has been released by others
+ * if necessary, and releases it again when done. A source whose
+ * footprint is larger than the whole budget is admitted only when
+ * nothing else is running, rather than never.
+ */
+class MemoryBudget
+{
+public:
+    MemoryBudget(size_t budget);
+
+    size_t getBudget() const { return m_budget; }
+
+    // Wait until the given number of bytes can be taken from the
+    // budget, and take them. The source is named in the message
+    // reported if we have to wait.
+    void acquire(size_t bytes, QString source);
+
+    // Take the given number of bytes from the budget if that can be
+    // done without waiting, returning true if so. For callers that
+    // have something else they could be doing instead.
+    bool tryAcquire(size_t bytes, QString source);
+
+    // Take the given number of bytes from the budget straight away,
+    // even if that takes us over it. For a source that everything
+    // else in hand is waiting on, so that waiting for room would
+    // never end.
+    void acquireNow(size_t bytes, QString source);
+
+    void release(size_t bytes);
+
+private:
+    bool isAdmissible(size_t bytes) const;
+    void take(size_t bytes, QString source);
+    void reportThrottling(size_t bytes, QString source);
+    
+    size_t m_budget;
+    size_t m_used;
+    bool m_throttling;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+
+    MemoryBudget(const MemoryBudget &) =delete;
+    MemoryBudget &operator=(const MemoryBudget &) =delete;
+};
+
+#endif
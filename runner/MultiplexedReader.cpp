@@ -15,8 +15,16 @@
 
 #include "MultiplexedReader.h"
 
-MultiplexedReader::MultiplexedReader(QList<AudioFileReader *> readers) : 
-    m_readers(readers)
+#include <algorithm>
+
+MultiplexedReader::MultiplexedReader(QList<AudioFileReader *> readers,
+                                     int threads) :
+    m_readers(readers),
+    m_readStart(0),
+    m_readCount(0),
+    m_readReaders(0),
+    m_readTargets(0),
+    m_mixTarget(0)
 {
     m_channelCount = readers.size();
     m_sampleRate = readers[0]->getSampleRate();
@@ -45,6 +53,33 @@ MultiplexedReader::MultiplexedReader(QList<AudioFileReader *> readers) :
 	    }
 	}
     }
+
+    int n = m_readers.size();
+    m_got.resize(n, 0);
+    for (int r = 0; r < n; ++r) {
+        m_readAhead.emplace_back(new ReadAheadBuffer(m_readers.at(r)));
+    }
+    m_buffers.resize(n);
+    m_bufferPointers.resize(n, 0);
+
+    m_pool.reset(new TaskPool(std::max(1, std::min(threads, n))));
+
+    for (int r = 0; r < n; ++r) {
+        m_readTasks.push_back([this, r]() {
+                if (r < m_readReaders) {
+                    m_got[r] = readOne(r, m_readStart,
+                                       m_readCount, m_readTargets[r]);
+                }
+            });
+    }
+
+    int slices = m_pool->getSize();
+    for (int s = 0; s < slices; ++s) {
+        m_mixTasks.push_back([this, s, slices]() {
+                mixSlice((m_readCount * s) / slices,
+                         (m_readCount * (s + 1)) / slices);
+            });
+    }
 }
 
 MultiplexedReader::~MultiplexedReader()
@@ -57,35 +92,112 @@ MultiplexedReader::~MultiplexedReader()
 floatvec_t
 MultiplexedReader::getInterleavedFrames(sv_frame_t start, sv_frame_t frameCount) const
 {
-    int out_chans = m_readers.size();
+    int readers = m_readers.size();
 
-    // Allocate and zero
-    floatvec_t block(frameCount * out_chans, 0.f);
+    floatvec_t block(frameCount * readers, 0.f);
 
-    for (int out_chan = 0; out_chan < out_chans; ++out_chan) {
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-	AudioFileReader *reader = m_readers[out_chan];
-	auto readerBlock = reader->getInterleavedFrames(start, frameCount);
+    float *const *buffers = getSourceBuffers(frameCount);
+    readSources(start, frameCount, readers, buffers);
 
-	int in_chans = reader->getChannelCount();
+    for (sv_frame_t i = 0; i < frameCount; ++i) {
+        float *frame = block.data() + i * readers;
+        for (int r = 0; r < readers; ++r) {
+            frame[r] = buffers[r][i];
+        }
+    }
 
-	for (int frame = 0; frame < frameCount; ++frame) {
+    return block;
+}
 
-            int out_index = frame * out_chans + out_chan;
+sv_frame_t
+MultiplexedReader::readOne(int r, sv_frame_t start,
+                           sv_frame_t count, float *buffer) const
+{
+    return m_readAhead[r]->readChannels(start, count, 1, &buffer);
+}
 
-	    for (int in_chan = 0; in_chan < in_chans; ++in_chan) {
-                int in_index = frame * in_chans + in_chan;
-                if (in_index >= (int)readerBlock.size()) break;
-		block[out_index] += readerBlock[in_index];
-	    }
+sv_frame_t
+MultiplexedReader::readSources(sv_frame_t start, sv_frame_t count,
+                               int readers, float *const *targets) const
+{
+    m_readStart = start;
+    m_readCount = count;
+    m_readReaders = readers;
+    m_readTargets = targets;
 
-            if (in_chans > 1) {
-                block[out_index] /= float(in_chans);
-            }
-	}
+    m_pool->run(m_readTasks);
+
+    sv_frame_t got = 0;
+    for (int r = 0; r < readers; ++r) {
+        got = std::max(got, m_got[r]);
     }
+    return got;
+}
 
-    return block;
+float *const *
+MultiplexedReader::getSourceBuffers(sv_frame_t count) const
+{
+    for (int r = 0; r < int(m_buffers.size()); ++r) {
+        if (sv_frame_t(m_buffers[r].size()) < count) {
+            m_buffers[r].resize(count);
+            m_bufferPointers[r] = m_buffers[r].data();
+        }
+    }
+    return m_bufferPointers.data();
+}
+
+void
+MultiplexedReader::mixSlice(sv_frame_t from, sv_frame_t to) const
+{
+    // Summing in reader order and then dividing, as a caller mixing
+    // our interleaved output would do. Each slice is small enough to
+    // stay in cache while every reader's buffer is added to it.
+
+    int readers = int(m_bufferPointers.size());
+    float *out = m_mixTarget + from;
+    sv_frame_t n = to - from;
+
+    std::fill(out, out + n, 0.f);
+
+    for (int r = 0; r < readers; ++r) {
+        const float *in = m_bufferPointers[r] + from;
+        for (sv_frame_t i = 0; i < n; ++i) {
+            out[i] += in[i];
+        }
+    }
+
+    float divisor = float(readers);
+    for (sv_frame_t i = 0; i < n; ++i) {
+        out[i] /= divisor;
+    }
+}
+
+sv_frame_t
+MultiplexedReader::readChannels(sv_frame_t start, sv_frame_t count,
+                                int channels, float *const *buffers) const
+{
+    int readers = m_readers.size();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (channels == 1 && readers > 1) {
+        sv_frame_t got = readSources(start, count, readers,
+                                     getSourceBuffers(count));
+        m_mixTarget = buffers[0];
+        m_pool->run(m_mixTasks);
+        return got;
+    }
+
+    int direct = std::min(channels, readers);
+    sv_frame_t got = readSources(start, count, direct, buffers);
+
+    for (int c = direct; c < channels; ++c) {
+        std::fill(buffers[c], buffers[c] + count, 0.f);
+    }
+
+    return got;
 }
 
 int
@@ -18,16 +18,33 @@
 
 #include "data/fileio/AudioFileReader.h"
 
+#include "DeinterleavingReader.h"
+#include "ReadAheadBuffer.h"
+#include "TaskPool.h"
+
 #include <QString>
 #include <QList>
 
-class MultiplexedReader : public AudioFileReader
+#include <vector>
+#include <memory>
+#include <mutex>
+
+/**
+ * Present a number of readers as a single reader with one channel
+ * for each, mixing any reader with more than one channel down to
+ * mono. The readers are read from up to a given number of threads
+ * at once, each into a buffer of its own that is kept from one read
+ * to the next, and each through a ReadAheadBuffer of its own.
+ */
+class MultiplexedReader : public AudioFileReader,
+                          public DeinterleavingReader
 {
     Q_OBJECT
 
 public:
-    // I take ownership of readers
-    MultiplexedReader(QList<AudioFileReader *> readers);
+    // I take ownership of readers. Read from up to threads of them
+    // at once.
+    MultiplexedReader(QList<AudioFileReader *> readers, int threads = 1);
     virtual ~MultiplexedReader();
 
     virtual QString getError() const override { return m_error; }
@@ -42,6 +59,10 @@ public:
     virtual floatvec_t getInterleavedFrames
     (sv_frame_t start, sv_frame_t count) const override;
 
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const override;
+
     virtual int getDecodeCompletion() const override;
 
     virtual bool isUpdating() const override;
@@ -50,6 +71,48 @@ protected:
     QString m_error;
     bool m_quicklySeekable;
     QList<AudioFileReader *> m_readers;
+
+    // Read the audio of the reader of index r, mixed to mono, into
+    // buffer
+    sv_frame_t readOne(int r, sv_frame_t start,
+                       sv_frame_t count, float *buffer) const;
+
+    // Read each of the first readers readers into the target buffer
+    // of the same index, in parallel, and return the most frames read
+    // from any. Call with m_mutex held.
+    sv_frame_t readSources(sv_frame_t start, sv_frame_t count,
+                           int readers, float *const *targets) const;
+
+    // Return our own buffers, one per reader, with room for at least
+    // count frames. Call with m_mutex held.
+    float *const *getSourceBuffers(sv_frame_t count) const;
+
+    // Mix frames from up to (but not including) to of our own buffers
+    // into m_mixTarget
+    void mixSlice(sv_frame_t from, sv_frame_t to) const;
+
+    std::unique_ptr<TaskPool> m_pool;
+
+    // One task per reader, and one per thread for mixing down, each
+    // made once and taking its arguments from the members below
+    std::vector<TaskPool::Task> m_readTasks;
+    std::vector<TaskPool::Task> m_mixTasks;
+
+    // The read in progress, and all of the buffers, guarded by
+    // m_mutex
+    mutable sv_frame_t m_readStart;
+    mutable sv_frame_t m_readCount;
+    mutable int m_readReaders;
+    mutable float *const *m_readTargets;
+    mutable float *m_mixTarget;
+    mutable std::vector<sv_frame_t> m_got;
+    mutable std::vector<std::unique_ptr<ReadAheadBuffer>> m_readAhead;
+    mutable std::vector<std::vector<float>> m_buffers;
+    mutable std::vector<float *> m_bufferPointers;
+    mutable std::mutex m_mutex;
+
+    MultiplexedReader(const MultiplexedReader &) =delete;
+    MultiplexedReader &operator=(const MultiplexedReader &) =delete;
 };
 
 #endif
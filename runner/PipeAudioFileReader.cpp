@@ -0,0 +1,363 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PipeAudioFileReader.h"
+
+#include "base/Exceptions.h"
+#include "base/Debug.h"
+
+#include <QStringList>
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+typedef MappedAudioFileReader::Layout Layout;
+typedef MappedAudioFileReader::Encoding Encoding;
+
+// Bytes to read at a time when we run out
+static const size_t readChunk = 65536;
+
+// Give up on a WAV stream whose headers go on for longer than this
+static const size_t maxHeaderSize = 1048576;
+
+bool
+PipeAudioFileReader::isPipe(QString source)
+{
+    if (source == "-") {
+        return true;
+    }
+#ifndef _WIN32
+    struct stat st;
+    if (stat(source.toLocal8Bit().data(), &st) == 0 && S_ISFIFO(st.st_mode)) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool
+PipeAudioFileReader::parseRawFormat(QString format, Layout &layout)
+{
+    QStringList parts = format.split(":");
+    if (parts.size() < 2 || parts.size() > 3) {
+        return false;
+    }
+
+    bool ok = false;
+    double rate = parts[0].toDouble(&ok);
+    if (!ok || rate <= 0) {
+        return false;
+    }
+    int channels = parts[1].toInt(&ok);
+    if (!ok || channels < 1) {
+        return false;
+    }
+
+    QString encoding = (parts.size() > 2 ? parts[2].toLower() : "s16");
+    bool bigEndian = false;
+    if (encoding.endsWith("be")) {
+        bigEndian = true;
+        encoding.chop(2);
+    } else if (encoding.endsWith("le")) {
+        encoding.chop(2);
+    }
+
+    struct {
+        const char *name;
+        Encoding encoding;
+        int bytes;
+    } encodings[] = {
+        { "u8", Encoding::UInt8, 1 },
+        { "s8", Encoding::Int8, 1 },
+        { "s16", Encoding::Int16, 2 },
+        { "s24", Encoding::Int24, 3 },
+        { "s32", Encoding::Int32, 4 },
+        { "f32", Encoding::Float32, 4 },
+        { "f64", Encoding::Float64, 8 },
+    };
+
+    for (const auto &e: encodings) {
+        if (encoding == e.name) {
+            layout.encoding = e.encoding;
+            layout.bytesPerSample = e.bytes;
+            layout.bigEndian = bigEndian;
+            layout.channels = channels;
+            layout.sampleRate = rate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+PipeAudioFileReader *
+PipeAudioFileReader::create(QString source, QString rawFormat)
+{
+    Layout layout;
+    if (rawFormat != "" && !parseRawFormat(rawFormat, layout)) {
+        return 0;
+    }
+    
+    FILE *file = 0;
+    if (source == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        file = stdin;
+    } else {
+        file = fopen(source.toLocal8Bit().data(), "rb");
+    }
+    if (!file) {
+        return 0;
+    }
+
+    auto fail = [&]() -> PipeAudioFileReader * {
+        if (file != stdin) fclose(file);
+        return 0;
+    };
+
+    long long dataBytes = -1;
+
+    if (rawFormat == "") {
+
+        // Read the WAV headers a chunk at a time, stopping at the
+        // header of the data chunk, and hand them to the ordinary
+        // parser. We can't look ahead or go back, so any chunks after
+        // the data are never seen.
+
+        vector<unsigned char> header(12);
+        if (fread(header.data(), 1, 12, file) != 12 ||
+            memcmp(header.data(), "RIFF", 4) ||
+            memcmp(header.data() + 8, "WAVE", 4)) {
+            SVCERR << "ERROR: No WAV header found on \"" << source
+                   << "\" (use --raw-format for raw audio)" << endl;
+            return fail();
+        }
+
+        while (true) {
+
+            size_t pos = header.size();
+            header.resize(pos + 8);
+            if (fread(header.data() + pos, 1, 8, file) != 8) {
+                return fail();
+            }
+
+            const unsigned char *p = header.data() + pos + 4;
+            size_t chunkSize = size_t(p[0]) | (size_t(p[1]) << 8) |
+                (size_t(p[2]) << 16) | (size_t(p[3]) << 24);
+
+            if (!memcmp(header.data() + pos, "data", 4)) {
+                // Writers that can't seek back leave the size as 0 or
+                // as large as it will go
+                if (chunkSize != 0 && chunkSize != 0xffffffffu) {
+                    dataBytes = (long long)chunkSize;
+                }
+                break;
+            }
+
+            size_t bodySize = chunkSize + (chunkSize & 1);
+            if (pos + 8 + bodySize > maxHeaderSize) {
+                return fail();
+            }
+            header.resize(pos + 8 + bodySize);
+            if (fread(header.data() + pos + 8, 1, bodySize, file) != bodySize) {
+                return fail();
+            }
+        }
+
+        if (!MappedAudioFileReader::parseWav(header.data(), header.size(),
+                                             layout)) {
+            SVCERR << "ERROR: Unsupported WAV format on \"" << source
+                   << "\"" << endl;
+            return fail();
+        }
+    }
+
+    return new PipeAudioFileReader(source, file, layout, dataBytes);
+}
+
+PipeAudioFileReader::PipeAudioFileReader(QString source, FILE *file,
+                                         const Layout &layout,
+                                         long long dataBytes) :
+    m_source(source),
+    m_file(file),
+    m_layout(layout),
+    m_bytesPerFrame(layout.bytesPerSample * layout.channels),
+    m_remaining(dataBytes),
+    m_bufferHead(0),
+    m_bufferStart(0),
+    m_framesRead(0),
+    m_ended(false)
+{
+    m_channelCount = layout.channels;
+    m_sampleRate = layout.sampleRate;
+    m_frameCount = 0;
+
+    SVDEBUG << "PipeAudioFileReader: reading \"" << source << "\": "
+            << m_channelCount << "ch at " << m_sampleRate << "Hz" << endl;
+}
+
+PipeAudioFileReader::~PipeAudioFileReader()
+{
+    if (m_file != stdin) {
+        fclose(m_file);
+    }
+}
+
+void
+PipeAudioFileReader::readTo(sv_frame_t frame) const
+{
+    // Called with m_mutex held
+
+    size_t ch = m_channelCount;
+
+    while (!m_ended) {
+
+        sv_frame_t available =
+            sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+        if (m_bufferStart + available >= frame) {
+            break;
+        }
+
+        size_t want = readChunk;
+        if (m_remaining >= 0 && (long long)want > m_remaining) {
+            want = size_t(m_remaining);
+        }
+
+        size_t have = m_bytes.size();
+        m_bytes.resize(have + want);
+        size_t got = fread(m_bytes.data() + have, 1, want, m_file);
+        m_bytes.resize(have + got);
+
+        if (m_remaining >= 0) {
+            m_remaining -= (long long)got;
+        }
+
+        // fread only comes back short at the end of the stream or on
+        // an error
+        if (got < want || m_remaining == 0) {
+            if (ferror(m_file)) {
+                m_error = "Error reading from pipe";
+                SVCERR << "WARNING: Error reading audio from \"" << m_source
+                       << "\", treating it as the end of the audio" << endl;
+            }
+            m_ended = true;
+        }
+
+        // Convert whole frames, keeping any part frame for next time
+        sv_frame_t n = sv_frame_t(m_bytes.size() / m_bytesPerFrame);
+        size_t sz = m_buffer.size();
+        m_buffer.resize(sz + n * ch);
+        for (int c = 0; c < m_channelCount; ++c) {
+            MappedAudioFileReader::convert(m_layout, m_bytes.data(), c, n,
+                                           m_buffer.data() + sz + c,
+                                           m_channelCount, false);
+        }
+        m_bytes.erase(m_bytes.begin(), m_bytes.begin() + n * m_bytesPerFrame);
+        m_framesRead += n;
+    }
+}
+
+const float *
+PipeAudioFileReader::prepareRead(sv_frame_t start, sv_frame_t &count) const
+{
+    // Called with m_mutex held
+    
+    size_t ch = m_channelCount;
+
+    if (start < m_bufferStart) {
+        throw FileOperationFailed
+            (m_source, "read from before the current position in piped audio");
+    }
+
+    readTo(start + count);
+
+    // Drop what we have passed, and compact once the dead space at
+    // the front is larger than what remains
+    
+    sv_frame_t available = sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+    sv_frame_t skip = std::min(start - m_bufferStart, available);
+    m_bufferHead += skip * ch;
+    m_bufferStart += skip;
+
+    if (m_bufferHead > m_buffer.size() / 2) {
+        m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_bufferHead);
+        m_bufferHead = 0;
+    }
+
+    if (m_bufferStart < start) {
+        // The pipe ended before start
+        m_bufferStart = start;
+        count = 0;
+        return 0;
+    }
+
+    available = sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+    count = std::min(count, available);
+    if (count == 0) {
+        return 0;
+    }
+    
+    return m_buffer.data() + m_bufferHead;
+}
+
+floatvec_t
+PipeAudioFileReader::getInterleavedFrames(sv_frame_t start,
+                                          sv_frame_t count) const
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    const float *frames = prepareRead(start, count);
+    if (!frames) {
+        return {};
+    }
+    
+    floatvec_t result(frames, frames + count * m_channelCount);
+    applyGain(result.data(), count * m_channelCount);
+    return result;
+}
+
+sv_frame_t
+PipeAudioFileReader::readChannels(sv_frame_t start,
+                                  sv_frame_t count,
+                                  int channels,
+                                  float *const *buffers) const
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    sv_frame_t available = count;
+    const float *frames = prepareRead(start, available);
+
+    deinterleave(frames, available, m_channelCount, count, channels, buffers);
+    applyGain(channels, buffers, available);
+    return available;
+}
+
+sv_frame_t
+PipeAudioFileReader::getFramesRead() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_framesRead;
+}
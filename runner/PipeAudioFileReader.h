@@ -0,0 +1,121 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _PIPE_AUDIO_FILE_READER_H_
+#define _PIPE_AUDIO_FILE_READER_H_
+
+#include "data/fileio/AudioFileReader.h"
+
+#include "DeinterleavingReader.h"
+#include "MappedAudioFileReader.h"
+
+#include <QString>
+
+#include <cstdio>
+#include <vector>
+#include <mutex>
+
+/**
+ * An AudioFileReader for audio arriving on standard input or a named
+ * pipe, as a WAV stream or as raw samples in a format given on the
+ * command line. The audio can only be read once, forwards, and
+ * nothing is kept once the read position has passed it.
+ *
+ * The length is not known until the writer closes the pipe, so this
+ * reader is open-ended (see DeinterleavingReader::isOpenEnded). The
+ * length in a WAV header is not trusted, as programs writing to a
+ * pipe can't go back and fill it in, but reading does stop at the
+ * end of the data chunk if the header gives one.
+ *
+ * There is no resampling: the audio is delivered at its own rate.
+ */
+class PipeAudioFileReader : public AudioFileReader,
+                            public DeinterleavingReader
+{
+    Q_OBJECT
+
+public:
+    // Return true if the source names standard input ("-") or a
+    // named pipe
+    static bool isPipe(QString source);
+
+    // Parse a raw sample format of the form rate:channels[:encoding],
+    // where the encoding is one of u8, s8, s16, s24, s32, f32 or f64
+    // with an optional "be" suffix for big-endian (default s16,
+    // little-endian). Return false if it can't be parsed.
+    static bool parseRawFormat(QString format,
+                               MappedAudioFileReader::Layout &layout);
+
+    // Open the given pipe and read its header, if rawFormat is empty,
+    // or expect raw samples in that format if not. Return 0 if the
+    // pipe can't be opened or its header can't be understood.
+    static PipeAudioFileReader *create(QString source, QString rawFormat);
+
+    virtual ~PipeAudioFileReader();
+
+    virtual QString getError() const override { return m_error; }
+    virtual bool isQuicklySeekable() const override { return false; }
+
+    virtual QString getTitle() const override { return m_layout.title; }
+    virtual QString getMaker() const override { return m_layout.maker; }
+
+    virtual QString getLocation() const { return m_source; }
+    virtual QString getLocalFilename() const { return ""; }
+
+    virtual sv_samplerate_t getNativeRate() const override { return m_sampleRate; }
+
+    virtual floatvec_t getInterleavedFrames
+    (sv_frame_t start, sv_frame_t count) const override;
+
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const override;
+
+    virtual bool isOpenEnded() const override { return true; }
+    virtual sv_frame_t getFramesRead() const override;
+
+private:
+    PipeAudioFileReader(QString source, FILE *file,
+                        const MappedAudioFileReader::Layout &layout,
+                        long long dataBytes);
+
+    // Read and convert at least up to the given frame, or to the end
+    // of the pipe. Called with m_mutex held.
+    void readTo(sv_frame_t frame) const;
+
+    // As StreamingAudioFileReader::prepareRead. Called with m_mutex
+    // held.
+    const float *prepareRead(sv_frame_t start, sv_frame_t &count) const;
+
+    QString m_source;
+    FILE *m_file;
+    MappedAudioFileReader::Layout m_layout;
+    int m_bytesPerFrame;
+    mutable QString m_error;
+
+    mutable long long m_remaining; // bytes left in the data chunk, or -1
+    mutable std::vector<unsigned char> m_bytes; // part of a frame, between reads
+    mutable floatvec_t m_buffer;
+    mutable size_t m_bufferHead; // index in m_buffer of m_bufferStart
+    mutable sv_frame_t m_bufferStart;
+    mutable sv_frame_t m_framesRead;
+    mutable bool m_ended;
+    mutable std::mutex m_mutex;
+
+    PipeAudioFileReader(const PipeAudioFileReader &) =delete;
+    PipeAudioFileReader &operator=(const PipeAudioFileReader &) =delete;
+};
+
+#endif
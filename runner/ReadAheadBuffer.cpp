@@ -0,0 +1,66 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2014 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ReadAheadBuffer.h"
+
+#include "DeinterleavingReader.h"
+
+#include <algorithm>
+
+ReadAheadBuffer::ReadAheadBuffer(const AudioFileReader *reader,
+                                 sv_frame_t chunkFrames) :
+    m_reader(reader),
+    m_direct(dynamic_cast<const DeinterleavingReader *>(reader)),
+    m_readerChannels(std::max(1, reader->getChannelCount())),
+    m_chunkFrames(chunkFrames),
+    m_chunkStart(0),
+    m_chunkAvailable(0),
+    m_atEnd(false)
+{
+}
+
+sv_frame_t
+ReadAheadBuffer::readChannels(sv_frame_t start, sv_frame_t count,
+                              int channels, float *const *buffers)
+{
+    if (m_direct) {
+        return m_direct->readChannels(start, count, channels, buffers);
+    }
+
+    sv_frame_t chunkEnd = m_chunkStart + m_chunkAvailable;
+    bool within = (start >= m_chunkStart &&
+                   (start + count <= chunkEnd || m_atEnd));
+
+    if (!within) {
+        sv_frame_t wanted = std::max(count, m_chunkFrames);
+        m_chunk = m_reader->getInterleavedFrames(start, wanted);
+        m_chunkStart = start;
+        m_chunkAvailable = sv_frame_t(m_chunk.size()) / m_readerChannels;
+        // A reader still decoding in the background may simply not
+        // have got this far yet
+        m_atEnd = (m_chunkAvailable < wanted && !m_reader->isUpdating());
+        chunkEnd = m_chunkStart + m_chunkAvailable;
+    }
+
+    sv_frame_t available = std::max(sv_frame_t(0),
+                                    std::min(count, chunkEnd - start));
+    const float *in = 0;
+    if (available > 0) {
+        in = m_chunk.data() + (start - m_chunkStart) * m_readerChannels;
+    }
+    DeinterleavingReader::deinterleave(in, available, m_readerChannels,
+                                       count, channels, buffers);
+    return available;
+}
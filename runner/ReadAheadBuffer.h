@@ -0,0 +1,68 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2014 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _READ_AHEAD_BUFFER_H_
+#define _READ_AHEAD_BUFFER_H_
+
+#include "data/fileio/AudioFileReader.h"
+
+class DeinterleavingReader;
+
+/**
+ * Read blocks from an audio file reader into per-channel buffers, as
+ * DeinterleavingReader::readChannels does. Readers that implement
+ * DeinterleavingReader are read directly. Any other reader (i.e. one
+ * from svcore) can only return a newly allocated interleaved vector
+ * for each read, so it is read a chunk of many blocks at a time, and
+ * the blocks are then served from that chunk. This keeps allocation
+ * to once per chunk rather than once per block.
+ *
+ * One of these is meant to be used by a single thread, reading
+ * forwards through a single reader, which must outlive it.
+ */
+class ReadAheadBuffer
+{
+public:
+    ReadAheadBuffer(const AudioFileReader *reader,
+                    sv_frame_t chunkFrames = defaultChunkFrames);
+
+    // Read count frames starting at frame start into the given
+    // buffers, one for each of channels channels, as
+    // DeinterleavingReader::readChannels does. Return the number of
+    // frames of actual audio read.
+    sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                            int channels, float *const *buffers);
+
+    static const sv_frame_t defaultChunkFrames = 65536;
+
+private:
+    const AudioFileReader *m_reader;
+    const DeinterleavingReader *m_direct;
+    int m_readerChannels;
+    sv_frame_t m_chunkFrames;
+
+    // The current chunk, starting at m_chunkStart and holding
+    // m_chunkAvailable frames. If m_atEnd, it reaches the end of the
+    // audio, so there is nothing more to be read beyond it.
+    floatvec_t m_chunk;
+    sv_frame_t m_chunkStart;
+    sv_frame_t m_chunkAvailable;
+    bool m_atEnd;
+
+    ReadAheadBuffer(const ReadAheadBuffer &) =delete;
+    ReadAheadBuffer &operator=(const ReadAheadBuffer &) =delete;
+};
+
+#endif
@@ -0,0 +1,320 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SourceFinder.h"
+
+#include "data/fileio/AudioFileReaderFactory.h"
+#include "base/Debug.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+
+#include <algorithm>
+
+using namespace std;
+
+static const char *snapshotHeader = "sonic-annotator directory snapshot 1";
+
+// A directory modified this close to the start of a scan may change
+// again without its modification time appearing to change, so its
+// listing is not trusted on the next run
+static const qint64 settleMs = 2000;
+
+SourceFinder::SourceFinder(QStringList paths, QString snapshotPath,
+                           bool reportProgress) :
+    m_snapshotPath(snapshotPath),
+    m_reportProgress(reportProgress),
+    m_startTime(QDateTime::currentMSecsSinceEpoch()),
+    m_pending(0),
+    m_listedFiles(0),
+    m_listedDirs(0),
+    m_reusedDirs(0),
+    m_finished(false),
+    m_stop(false)
+{
+    m_extensions = AudioFileReaderFactory::getKnownExtensions()
+        .split(" ", QString::SkipEmptyParts);
+
+    loadSnapshot();
+
+    m_root.listed = true;
+    m_root.directory = false;
+
+    for (QString path: paths) {
+        unique_ptr<Node> node(new Node);
+        node->path = path;
+        if (QDir(path).exists()) {
+            m_toList.push_back(node.get());
+            ++m_pending;
+        } else {
+            node->listed = true;
+            node->directory = false;
+            node->files.push_back(path);
+        }
+        m_root.children.push_back(std::move(node));
+    }
+
+    // Directories pushed later are listed first
+    std::reverse(m_toList.begin(), m_toList.end());
+
+    m_cursor.push_back({ &m_root, 0, false });
+    
+    {
+        lock_guard<mutex> lock(m_mutex);
+        advance();
+    }
+
+    if (m_pending > 0) {
+        int threads = std::max(4, int(thread::hardware_concurrency()));
+        for (int i = 0; i < threads; ++i) {
+            m_threads.push_back(thread([this]() { run(); }));
+        }
+    }
+}
+
+SourceFinder::~SourceFinder()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_workAvailable.notify_all();
+    for (auto &t: m_threads) {
+        t.join();
+    }
+
+    if (m_snapshotPath != "") {
+        saveSnapshot();
+        SVCERR << "Directory snapshot: reused the recorded contents of "
+               << m_reusedDirs << " of " << m_listedDirs
+               << " directories" << endl;
+    }
+}
+
+QString
+SourceFinder::getSource(int index)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_sourcesAvailable.wait(lock, [&]() {
+            return m_finished || index < m_found.size();
+        });
+    if (index < m_found.size()) {
+        return m_found[index];
+    } else {
+        return "";
+    }
+}
+
+QStringList
+SourceFinder::getAllSources()
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_sourcesAvailable.wait(lock, [&]() { return m_finished; });
+    return m_found;
+}
+
+void
+SourceFinder::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (true) {
+
+        m_workAvailable.wait(lock, [this]() {
+                return m_stop || !m_toList.empty() || m_pending == 0;
+            });
+
+        if (m_stop || m_toList.empty()) {
+            return;
+        }
+
+        Node *node = m_toList.back();
+        m_toList.pop_back();
+
+        lock.unlock();
+        Listing listing;
+        bool reused = list(node, listing);
+        lock.lock();
+
+        ++m_listedDirs;
+        if (reused) ++m_reusedDirs;
+
+        QDir dir(node->path);
+        
+        for (QString file: listing.files) {
+            node->files.push_back(dir.filePath(file));
+        }
+        for (QString subdir: listing.subdirs) {
+            unique_ptr<Node> child(new Node);
+            child->path = dir.filePath(subdir);
+            node->children.push_back(std::move(child));
+        }
+        for (auto i = node->children.rbegin(); i != node->children.rend(); ++i) {
+            m_toList.push_back(i->get());
+            ++m_pending;
+        }
+        node->listed = true;
+
+        if (m_snapshotPath != "") {
+            if (listing.modified > m_startTime - settleMs) {
+                listing.modified = -1;
+            }
+            m_newSnapshot[node->path] = listing;
+        }
+
+        m_listedFiles += listing.files.size();
+
+        if (m_reportProgress) {
+            QString printable = dir.dirName().left(20);
+            SVCERR << "\rScanning \"" << printable << "\"..."
+                   << QString("                    ").left(20 - printable.length())
+                   << " [" << m_listedFiles << " audio file(s)]";
+        }
+        
+        --m_pending;
+        advance();
+        m_workAvailable.notify_all();
+    }
+}
+
+bool
+SourceFinder::list(Node *node, Listing &listing)
+{
+    // Called without m_mutex held. m_oldSnapshot and m_extensions
+    // are not changed once we are running, so they need no lock.
+    
+    QFileInfo info(node->path);
+    listing.modified = info.lastModified().toMSecsSinceEpoch();
+
+    auto itr = m_oldSnapshot.find(node->path);
+    if (itr != m_oldSnapshot.end() && itr->second.modified >= 0 &&
+        itr->second.modified == listing.modified) {
+        listing = itr->second;
+        return true;
+    }
+
+    QDir dir(node->path);
+    listing.files = dir.entryList
+        (m_extensions, QDir::Files | QDir::Readable);
+    listing.subdirs = dir.entryList
+        (QStringList(), QDir::Dirs | QDir::NoSymLinks | QDir::NoDotAndDotDot);
+    return false;
+}
+
+void
+SourceFinder::advance()
+{
+    // Called with m_mutex held. Move the cursor on through every
+    // node listed so far, in order, adding their files to m_found
+    
+    while (!m_cursor.empty()) {
+
+        Frame &f = m_cursor.back();
+        if (!f.node->listed) {
+            break;
+        }
+
+        if (!f.emitted) {
+            m_found.append(f.node->files);
+            f.node->files.clear();
+            f.emitted = true;
+        }
+
+        if (f.next < f.node->children.size()) {
+            Node *child = f.node->children[f.next++].get();
+            m_cursor.push_back({ child, 0, false });
+            continue;
+        }
+
+        // Finished with this one, and everything below it
+        f.node->children.clear();
+        m_cursor.pop_back();
+    }
+
+    if (m_cursor.empty()) {
+        m_finished = true;
+    }
+    
+    m_sourcesAvailable.notify_all();
+}
+
+void
+SourceFinder::loadSnapshot()
+{
+    if (m_snapshotPath == "") {
+        return;
+    }
+    
+    QFile file(m_snapshotPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QStringList lines = QString::fromUtf8(file.readAll()).split('\n');
+    if (lines.empty() || lines[0] != snapshotHeader) {
+        SVCERR << "WARNING: Ignoring unrecognised directory snapshot file \""
+               << m_snapshotPath << "\"" << endl;
+        return;
+    }
+
+    Listing *current = 0;
+    
+    for (int i = 1; i < lines.size(); ++i) {
+        QStringList fields = lines[i].split('\t');
+        if (fields.size() == 3 && fields[0] == "D") {
+            current = &m_oldSnapshot[fields[2]];
+            current->modified = fields[1].toLongLong();
+        } else if (fields.size() == 2 && current && fields[0] == "F") {
+            current->files.push_back(fields[1]);
+        } else if (fields.size() == 2 && current && fields[0] == "S") {
+            current->subdirs.push_back(fields[1]);
+        }
+    }
+    
+    SVDEBUG << "SourceFinder: loaded " << m_oldSnapshot.size()
+            << " directories from snapshot" << endl;
+}
+
+void
+SourceFinder::saveSnapshot()
+{
+    auto unsafe = [](QString s) {
+        return s.contains('\t') || s.contains('\n');
+    };
+
+    QString text = QString(snapshotHeader) + "\n";
+    
+    for (const auto &entry: m_newSnapshot) {
+        const Listing &listing = entry.second;
+        bool ok = !unsafe(entry.first);
+        for (QString f: listing.files) if (unsafe(f)) ok = false;
+        for (QString s: listing.subdirs) if (unsafe(s)) ok = false;
+        if (!ok) continue;
+        text += QString("D\t%1\t%2\n").arg(listing.modified).arg(entry.first);
+        for (QString f: listing.files) text += "F\t" + f + "\n";
+        for (QString s: listing.subdirs) text += "S\t" + s + "\n";
+    }
+
+    QSaveFile file(m_snapshotPath);
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(text.toUtf8()) < 0 ||
+        !file.commit()) {
+        SVCERR << "WARNING: Failed to write directory snapshot file \""
+               << m_snapshotPath << "\"" << endl;
+    }
+}
@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _SOURCE_FINDER_H_
+#define _SOURCE_FINDER_H_
+
+#include <QString>
+#include <QStringList>
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Find the audio files under a set of directories, listing several
+ * directories at once on separate threads, since on a network
+ * filesystem most of the time goes in waiting for each listing.
+ *
+ * Files are made available in the same order as a serial depth-first
+ * walk would find them (each directory's files in name order, then
+ * its subdirectories in name order), and as soon as everything
+ * before them in that order has been found, so that a caller can
+ * start work on the first files while the rest are still being
+ * looked for.
+ *
+ * Given a snapshot file, the finder records each directory's
+ * modification time and contents there, and on a later run reuses
+ * the recorded contents of any directory whose modification time is
+ * unchanged instead of listing it again. A directory's modification
+ * time changes when files are added to it, removed or renamed, but
+ * not when anything happens further down the tree, so every
+ * directory still has to be looked at, but only changed ones listed.
+ */
+class SourceFinder
+{
+public:
+    // Start finding audio files. Each of the given paths that is a
+    // directory is searched; any other path is passed through as it
+    // stands, in its place in the order. The snapshot path may be
+    // empty. If reportProgress is true, progress is printed as
+    // directories are scanned.
+    SourceFinder(QStringList paths, QString snapshotPath,
+                 bool reportProgress);
+    ~SourceFinder();
+
+    // Wait until the source at the given index in the order is
+    // known, and return it, or return an empty string if there turn
+    // out to be no more than index sources.
+    QString getSource(int index);
+
+    // Wait until all the sources have been found, and return them.
+    QStringList getAllSources();
+
+private:
+    struct Node {
+        Node() : listed(false), directory(true) { }
+        QString path;
+        bool listed;
+        bool directory;
+        QStringList files;
+        std::vector<std::unique_ptr<Node>> children;
+    };
+
+    struct Frame {
+        Node *node;
+        size_t next;
+        bool emitted;
+    };
+
+    struct Listing {
+        qint64 modified;
+        QStringList files;
+        QStringList subdirs;
+    };
+
+    void run();
+    // Return true if the listing came from the old snapshot
+    bool list(Node *node, Listing &listing);
+    void advance();
+    void loadSnapshot();
+    void saveSnapshot();
+
+    QStringList m_extensions;
+    QString m_snapshotPath;
+    bool m_reportProgress;
+    qint64 m_startTime;
+    std::map<QString, Listing> m_oldSnapshot;
+    std::map<QString, Listing> m_newSnapshot;
+
+    Node m_root;
+    std::vector<Node *> m_toList;   // a stack, for roughly depth-first order
+    int m_pending;                  // nodes queued or being listed
+    std::vector<Frame> m_cursor;    // walk of the tree, for the output order
+    QStringList m_found;
+    int m_listedFiles;
+    int m_listedDirs;
+    int m_reusedDirs;               // of m_listedDirs, from the snapshot
+    bool m_finished;
+    bool m_stop;
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_sourcesAvailable;
+
+    SourceFinder(const SourceFinder &) =delete;
+    SourceFinder &operator=(const SourceFinder &) =delete;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SourceManifest.h"
+
+#include "base/Debug.h"
+
+#include <QFile>
+
+SourceManifest::SourceManifest(QString path) :
+    m_path(path)
+{
+}
+
+bool
+SourceManifest::start(QString description)
+{
+    return write("# " + description + "\n", true);
+}
+
+bool
+SourceManifest::record(QString source, bool succeeded)
+{
+    return write(QString(succeeded ? "completed" : "failed") + "\t" +
+                 source + "\n", false);
+}
+
+bool
+SourceManifest::write(QString line, bool truncate)
+{
+    QFile file(m_path);
+
+    if (!file.open(QIODevice::WriteOnly |
+                   (truncate ? QIODevice::Truncate : QIODevice::Append))) {
+        SVCERR << "WARNING: Failed to open manifest file \"" << m_path
+               << "\" for writing" << endl;
+        return false;
+    }
+
+    // A single write, so that lines from different processes can't
+    // be interleaved
+    QByteArray data = line.toUtf8();
+    bool ok = (file.write(data) == data.size());
+    file.close();
+
+    if (!ok) {
+        SVCERR << "WARNING: Failed to write to manifest file \"" << m_path
+               << "\"" << endl;
+    }
+    
+    return ok;
+}
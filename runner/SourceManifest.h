@@ -0,0 +1,52 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _SOURCE_MANIFEST_H_
+#define _SOURCE_MANIFEST_H_
+
+#include <QString>
+
+/**
+ * A small text file listing the sources that have been completed or
+ * have failed so far in a run, one per line, preceded by "completed"
+ * or "failed" and a tab. Lines are appended as each source finishes,
+ * so the file is useful even if the run is interrupted: anything not
+ * listed was not finished.
+ *
+ * Each line is written with a single append to a freshly opened
+ * file, so several processes may safely record into the same
+ * manifest.
+ */
+class SourceManifest
+{
+public:
+    SourceManifest(QString path);
+
+    QString getPath() const { return m_path; }
+
+    // Create or truncate the file, and write the given description
+    // as a comment at the top. Return false on failure.
+    bool start(QString description);
+
+    // Append a line for the given source. Return false on failure.
+    bool record(QString source, bool succeeded);
+
+private:
+    bool write(QString line, bool truncate);
+    
+    QString m_path;
+};
+
+#endif
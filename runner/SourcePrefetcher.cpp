@@ -0,0 +1,234 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SourcePrefetcher.h"
+
+#include "data/fileio/AudioFileReader.h"
+
+#include "base/Debug.h"
+
+#include <algorithm>
+
+using namespace std;
+
+SourcePrefetcher::SourcePrefetcher(Opener opener, int depth, size_t maxBytes) :
+    m_opener(opener),
+    m_depth(std::max(1, depth)),
+    m_maxBytes(maxBytes),
+    m_heldBytes(0),
+    m_heldUnknown(0),
+    m_added(0),
+    m_stop(false)
+{
+    for (int i = 0; i < m_depth; ++i) {
+        m_threads.push_back(thread([this]() { run(); }));
+    }
+}
+
+SourcePrefetcher::~SourcePrefetcher()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (auto &t: m_threads) {
+        t.join();
+    }
+
+    for (auto &e: m_entries) {
+        delete e.second.reader;
+    }
+}
+
+void
+SourcePrefetcher::add(QString source, size_t bytes)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_queue.push_back({ source, bytes, m_added++ });
+    }
+    m_condition.notify_all();
+}
+
+bool
+SourcePrefetcher::canStart()
+{
+    if (m_queue.empty()) return false;
+    if (int(m_entries.size()) >= m_depth) return false;
+
+    // The same source listed twice: wait until the first is taken
+    const Pending &next = m_queue.front();
+    if (m_entries.find(next.source) != m_entries.end()) return false;
+
+    if (next.bytes == unknownSize) {
+        return m_heldUnknown == 0;
+    }
+    
+    return m_heldBytes + next.bytes <= m_maxBytes;
+}
+
+void
+SourcePrefetcher::hold(const Entry &entry)
+{
+    if (entry.bytes == unknownSize) {
+        ++m_heldUnknown;
+    } else {
+        m_heldBytes += entry.bytes;
+    }
+}
+
+void
+SourcePrefetcher::unhold(const Entry &entry)
+{
+    if (entry.bytes == unknownSize) {
+        --m_heldUnknown;
+    } else {
+        m_heldBytes -= entry.bytes;
+    }
+}
+
+void
+SourcePrefetcher::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (true) {
+
+        m_condition.wait(lock, [this]() { return m_stop || canStart(); });
+        if (m_stop) return;
+
+        Pending next = m_queue.front();
+        m_queue.pop_front();
+        QString source = next.source;
+
+        // std::map references stay valid while other entries come
+        // and go, and nobody else removes this one until it is done
+        Entry &entry = m_entries[source];
+        entry.bytes = next.bytes;
+        entry.index = next.index;
+        hold(entry);
+
+        lock.unlock();
+
+        SVDEBUG << "SourcePrefetcher: opening \"" << source << "\"" << endl;
+
+        AudioFileReader *reader = 0;
+        exception_ptr error;
+        try {
+            reader = m_opener(source);
+        } catch (...) {
+            error = current_exception();
+        }
+
+        lock.lock();
+
+        if (entry.abandoned) {
+            delete reader;
+            unhold(entry);
+            m_entries.erase(source);
+        } else {
+            entry.reader = reader;
+            entry.error = error;
+            entry.done = true;
+        }
+        m_condition.notify_all();
+    }
+}
+
+AudioFileReader *
+SourcePrefetcher::take(QString source)
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    auto itr = m_entries.find(source);
+
+    if (itr == m_entries.end() || itr->second.abandoned) {
+        // Not started, perhaps because it was too big
+        auto qi = find_if(m_queue.begin(), m_queue.end(),
+                          [&](const Pending &p) { return p.source == source; });
+        if (qi != m_queue.end()) {
+            dropBefore(qi->index + 1);
+        }
+        lock.unlock();
+        m_condition.notify_all();
+        return 0;
+    }
+
+    dropBefore(itr->second.index);
+
+    m_condition.wait(lock, [&]() { return itr->second.done; });
+
+    Entry entry = itr->second;
+    m_entries.erase(itr);
+    unhold(entry);
+
+    lock.unlock();
+    m_condition.notify_all();
+
+    if (entry.error) {
+        rethrow_exception(entry.error);
+    }
+    return entry.reader;
+}
+
+void
+SourcePrefetcher::dropBefore(int index)
+{
+    while (!m_queue.empty() && m_queue.front().index < index) {
+        m_queue.pop_front();
+    }
+
+    for (auto itr = m_entries.begin(); itr != m_entries.end(); ) {
+        Entry &entry = itr->second;
+        if (entry.index >= index || entry.abandoned) {
+            ++itr;
+        } else if (!entry.done) {
+            // The thread opening it will drop it when it's done
+            entry.abandoned = true;
+            ++itr;
+        } else {
+            SVDEBUG << "SourcePrefetcher: dropping skipped source \""
+                    << itr->first << "\"" << endl;
+            delete entry.reader;
+            unhold(entry);
+            itr = m_entries.erase(itr);
+        }
+    }
+}
+
+bool
+SourcePrefetcher::runIfIdle(function<void()> fn)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_entries.empty()) {
+        return false;
+    }
+    fn();
+    return true;
+}
+
+bool
+SourcePrefetcher::isWanted(QString source)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_entries.find(source) != m_entries.end()) {
+        return true;
+    }
+    return find_if(m_queue.begin(), m_queue.end(),
+                   [&](const Pending &p) { return p.source == source; })
+        != m_queue.end();
+}
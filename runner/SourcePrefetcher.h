@@ -0,0 +1,128 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _SOURCE_PREFETCHER_H_
+#define _SOURCE_PREFETCHER_H_
+
+#include <QString>
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+class AudioFileReader;
+
+/**
+ * Open audio sources on background threads, ahead of their being
+ * needed, so that retrieving, parsing and starting to decode the
+ * next file need not leave the plugins idle between files.
+ *
+ * Sources are opened in the order given, up to depth at a time
+ * (counting those opened but not yet taken), and only while the
+ * estimated size of the audio held by those waiting stays within
+ * maxBytes. A source too large to fit is left for the caller to open
+ * when it gets there. A source whose size can't be estimated (from a
+ * remote or unprobeable file) is opened only while no other such
+ * source is waiting, so that at most one of them is held at a time.
+ */
+class SourcePrefetcher
+{
+public:
+    // Open a source and return a reader for it, or throw
+    typedef std::function<AudioFileReader *(QString source)> Opener;
+
+    SourcePrefetcher(Opener opener, int depth, size_t maxBytes);
+
+    // Size to pass to add for a source that can't be estimated
+    static const size_t unknownSize = ~size_t(0);
+
+    // Stop, waiting for any opens in progress, and delete any readers
+    // not taken
+    ~SourcePrefetcher();
+
+    // Add a source to those to be opened, with an estimate of how
+    // many bytes its reader will hold, or unknownSize. Sources will
+    // be asked for in the order they are added.
+    void add(QString source, size_t bytes);
+
+    // Return the reader for the given source, waiting for it if it is
+    // being opened now, and rethrowing anything thrown when opening
+    // it. The caller takes ownership. Return 0 if the source was not
+    // prefetched, in which case it won't be, so the caller should open
+    // it itself. Either way, any sources added before this one and
+    // not taken are assumed to have been skipped, and are dropped.
+    AudioFileReader *take(QString source);
+
+    // Call the given function if no source is being opened or waiting
+    // to be taken, making sure none starts to be until it returns,
+    // and return true; or return false without calling it. Readers
+    // may keep their decoded audio in the temporary directory, so
+    // this is how to clean that up safely.
+    bool runIfIdle(std::function<void()> fn);
+
+    // Return true if the given source is waiting to be opened, being
+    // opened, or waiting to be taken, i.e. if it has been listed more
+    // than once and we have yet to get to a later listing of it.
+    bool isWanted(QString source);
+
+private:
+    struct Pending {
+        QString source;
+        size_t bytes;
+        int index;   // in order of adding
+    };
+
+    struct Entry {
+        Entry() : done(false), abandoned(false), reader(0),
+                  bytes(0), index(0) { }
+        bool done;
+        bool abandoned; // skipped while being opened
+        AudioFileReader *reader;
+        std::exception_ptr error;
+        size_t bytes;
+        int index;
+    };
+
+    // These are called with m_mutex held
+    void run();
+    bool canStart();
+    void dropBefore(int index);
+    void hold(const Entry &entry);
+    void unhold(const Entry &entry);
+
+    Opener m_opener;
+    int m_depth;
+    size_t m_maxBytes;
+
+    std::deque<Pending> m_queue;
+    std::map<QString, Entry> m_entries; // being opened or waiting
+    size_t m_heldBytes;
+    int m_heldUnknown;
+    int m_added;
+    bool m_stop;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+
+    SourcePrefetcher(const SourcePrefetcher &) =delete;
+    SourcePrefetcher &operator=(const SourcePrefetcher &) =delete;
+};
+
+#endif
@@ -0,0 +1,343 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SourceQueue.h"
+
+#include "base/Debug.h"
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QSysInfo>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+static bool
+writeWholeFile(QString path, QString text)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    QByteArray data = text.toUtf8();
+    bool ok = (file.write(data) == data.size());
+    file.close();
+    return ok;
+}
+
+SourceQueue::SourceQueue(QString directory, int leaseSeconds) :
+    m_directory(directory),
+    m_leaseSeconds(leaseSeconds),
+    m_ok(true),
+    m_stopRenewing(false)
+{
+    m_owner = QString("%1:%2")
+        .arg(QSysInfo::machineHostName())
+        .arg(QCoreApplication::applicationPid());
+
+    QDir dir;
+    for (QString sub: { "claims", "done", "failed" }) {
+        if (!dir.mkpath(m_directory + "/" + sub)) {
+            SVCERR << "ERROR: Failed to create queue directory \""
+                   << m_directory + "/" + sub << "\"" << endl;
+            m_ok = false;
+            return;
+        }
+    }
+}
+
+SourceQueue::~SourceQueue()
+{
+    if (m_renewer.joinable()) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stopRenewing = true;
+        }
+        m_condition.notify_all();
+        m_renewer.join();
+    }
+
+    // Sources claimed but never finished: let someone else have them
+    // now rather than after the leases expire
+    for (const auto &c: m_claims) {
+        if (isOwnClaim(c.first)) {
+            QDir(getClaimPath(c.first)).removeRecursively();
+        }
+    }
+}
+
+QString
+SourceQueue::getKey(QString source) const
+{
+    return QString::fromLatin1
+        (QCryptographicHash::hash(source.toUtf8(),
+                                  QCryptographicHash::Sha1).toHex());
+}
+
+QString
+SourceQueue::getClaimPath(QString key) const
+{
+    return m_directory + "/claims/" + key;
+}
+
+QString
+SourceQueue::getLeasePath(QString key) const
+{
+    return getClaimPath(key) + "/lease";
+}
+
+QString
+SourceQueue::getMarkerPath(QString key, bool succeeded) const
+{
+    return m_directory + (succeeded ? "/done/" : "/failed/") + key;
+}
+
+bool
+SourceQueue::isFinished(QString key) const
+{
+    return QFileInfo(getMarkerPath(key, true)).exists() ||
+        QFileInfo(getMarkerPath(key, false)).exists();
+}
+
+bool
+SourceQueue::tryClaim(QString key, QString source)
+{
+    // mkdir is atomic, even on most network filesystems, and fails
+    // if the directory already exists
+    if (!QDir().mkdir(getClaimPath(key))) {
+        return false;
+    }
+
+    // Someone may have finished the source and released its claim
+    // between our checking for a marker and making the claim
+    if (isFinished(key)) {
+        QDir(getClaimPath(key)).removeRecursively();
+        return false;
+    }
+
+    writeLease(key, source, 0);
+    return true;
+}
+
+bool
+SourceQueue::writeLease(QString key, QString source, int renewals)
+{
+    // Readers only compare the contents with what they saw last time,
+    // so it doesn't matter if one of them catches this half-written
+    return writeWholeFile(getLeasePath(key),
+                          QString("%1\t%2\t%3\n")
+                          .arg(m_owner).arg(renewals).arg(source));
+}
+
+QString
+SourceQueue::readLease(QString key) const
+{
+    QFile file(getLeasePath(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return "";
+    }
+    return QString::fromUtf8(file.readAll());
+}
+
+bool
+SourceQueue::isOwnClaim(QString key) const
+{
+    // If we were slow enough to renew the lease that someone else
+    // took our claim to have expired, the claim directory may now be
+    // theirs, or gone
+    return readLease(key).section('\t', 0, 0) == m_owner;
+}
+
+bool
+SourceQueue::isExpired(QString key)
+{
+    // The lease is judged only by whether its contents change, and
+    // the time is measured locally with a monotonic clock. So neither
+    // the other machine's clock, nor the filesystem's timestamps, nor
+    // our own wall clock being adjusted can make a claim expire early
+    QString lease = readLease(key);
+    auto now = chrono::steady_clock::now();
+
+    auto itr = m_observed.find(key);
+    if (itr == m_observed.end() || itr->second.lease != lease) {
+        m_observed[key] = { lease, now };
+        return false;
+    }
+
+    return (now - itr->second.since >= chrono::seconds(m_leaseSeconds));
+}
+
+void
+SourceQueue::breakClaim(QString key)
+{
+    // Move the claim out of the way first, so that if several of us
+    // decide at once that it has expired, only one succeeds in
+    // breaking it
+    QString expected = m_observed[key].lease;
+    m_observed.erase(key);
+
+    QString claimPath = getClaimPath(key);
+    QString brokenPath = QString("%1.broken.%2")
+        .arg(claimPath).arg(QCoreApplication::applicationPid());
+
+    if (!QDir().rename(claimPath, brokenPath)) {
+        return;
+    }
+
+    QFile lease(brokenPath + "/lease");
+    QString found;
+    if (lease.open(QIODevice::ReadOnly)) {
+        found = QString::fromUtf8(lease.readAll());
+        lease.close();
+    }
+
+    if (found != expected) {
+        // Someone else broke the expired claim and made a new one
+        // after we looked at it: put theirs back
+        QDir().rename(brokenPath, claimPath);
+        return;
+    }
+
+    QDir(brokenPath).removeRecursively();
+}
+
+QString
+SourceQueue::claimNext(QStringList sources, bool wait)
+{
+    if (!m_ok) return "";
+
+    int pollMs = std::max(1000, m_leaseSeconds * 250);
+    bool reportedWaiting = false;
+
+    while (true) {
+
+        int waiting = 0;
+
+        for (QString source: sources) {
+
+            QString key = getKey(source);
+            if (isFinished(key) || isClaimedByUs(key)) {
+                continue;
+            }
+
+            bool claimed = tryClaim(key, source);
+
+            if (!claimed && isExpired(key)) {
+                SVCERR << "Claim on \"" << source
+                       << "\" has expired, requeueing it" << endl;
+                breakClaim(key);
+                claimed = tryClaim(key, source);
+            }
+
+            if (claimed) {
+                m_observed.erase(key);
+                {
+                    lock_guard<mutex> lock(m_mutex);
+                    m_claims[key] = { source, 0, false };
+                }
+                if (!m_renewer.joinable()) {
+                    m_renewer = thread([this]() { renewLeases(); });
+                }
+                return source;
+            }
+
+            ++waiting;
+        }
+
+        if (waiting == 0 || !wait) {
+            return "";
+        }
+
+        if (!reportedWaiting) {
+            SVCERR << "Waiting for " << waiting
+                   << " source(s) claimed by other processes" << endl;
+            reportedWaiting = true;
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(pollMs));
+    }
+}
+
+bool
+SourceQueue::isClaimedByUs(QString key)
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_claims.find(key) != m_claims.end();
+}
+
+void
+SourceQueue::renewLeases()
+{
+    auto interval = chrono::milliseconds(std::max(250, m_leaseSeconds * 250));
+
+    unique_lock<mutex> lock(m_mutex);
+
+    while (!m_condition.wait_for(lock, interval,
+                                 [this]() { return m_stopRenewing; })) {
+        for (auto &c: m_claims) {
+            Claim &claim = c.second;
+            if (claim.lost) {
+                continue;
+            }
+            if (!isOwnClaim(c.first)) {
+                SVCERR << "WARNING: Claim on \"" << claim.source
+                       << "\" has been taken over by another process" << endl;
+                claim.lost = true;
+                continue;
+            }
+            ++claim.renewals;
+            if (!writeLease(c.first, claim.source, claim.renewals)) {
+                SVCERR << "WARNING: Failed to renew lease on \""
+                       << claim.source << "\"" << endl;
+            }
+        }
+    }
+}
+
+void
+SourceQueue::finish(QString source, bool succeeded)
+{
+    QString key = getKey(source);
+
+    {
+        // Stop renewing the lease before we touch the claim
+        lock_guard<mutex> lock(m_mutex);
+        if (m_claims.find(key) == m_claims.end()) {
+            SVCERR << "WARNING: SourceQueue::finish: source \"" << source
+                   << "\" is not one that we have claimed" << endl;
+            return;
+        }
+        m_claims.erase(key);
+    }
+
+    // Write the marker before releasing the claim, so that there is
+    // no moment at which the source appears to be available
+    if (!writeWholeFile(getMarkerPath(key, succeeded),
+                        QString("%1\t%2\n").arg(m_owner).arg(source))) {
+        SVCERR << "WARNING: Failed to write queue marker for \""
+               << source << "\"" << endl;
+    }
+
+    // Release the claim only if it is still ours: if not, whoever
+    // has it now is working on the source too, and will finish it
+    if (isOwnClaim(key)) {
+        QDir(getClaimPath(key)).removeRecursively();
+    }
+}
@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _SOURCE_QUEUE_H_
+#define _SOURCE_QUEUE_H_
+
+#include <QString>
+#include <QStringList>
+
+#include <map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * A queue of sources shared among any number of processes, on any
+ * number of machines, through a directory that they can all see. No
+ * service is needed apart from the filesystem.
+ *
+ * Each process is given the same list of sources and works through
+ * it, skipping those that have been finished (by anyone) and those
+ * that another process has claimed. A claim is a directory, created
+ * with mkdir so that only one process can succeed, containing a
+ * lease file that the claiming process rewrites regularly while it
+ * works on the source. A claim whose lease has not changed for the
+ * lease time, as seen by another process, is taken to belong to a
+ * process that has died, and is broken so that the source can be
+ * claimed again. Because expiry is judged by observing the lease
+ * rather than by comparing timestamps, the machines' clocks need not
+ * agree, and file modification times are not used at all.
+ *
+ * The directory contains:
+ *
+ *   claims/<key>   -- claim for a source being worked on
+ *   done/<key>     -- marker for a source completed successfully
+ *   failed/<key>   -- marker for a source that failed
+ *
+ * where <key> is derived from the source path, so every process must
+ * refer to each source by the same path.
+ */
+class SourceQueue
+{
+public:
+    SourceQueue(QString directory, int leaseSeconds);
+    ~SourceQueue();
+
+    // Return false if the queue directory could not be set up (an
+    // error will have been printed)
+    bool isOK() const { return m_ok; }
+
+    // Claim the first of the given sources that is neither finished
+    // nor claimed by anyone (including us), and return it. If there
+    // are none, but some are claimed by others, wait until one of
+    // those is finished or its claim expires. Return an empty string
+    // once all of the sources are finished, or straight away instead
+    // of waiting if wait is false. More than one source may be
+    // claimed at once. The lease on each claimed source is kept up
+    // to date in a separate thread until finish() is called for it.
+    QString claimNext(QStringList sources, bool wait = true);
+
+    // Record a claimed source as finished and release its claim,
+    // unless another process has taken the claim over in the meantime.
+    void finish(QString source, bool succeeded);
+
+private:
+    QString getKey(QString source) const;
+    QString getClaimPath(QString key) const;
+    QString getLeasePath(QString key) const;
+    QString getMarkerPath(QString key, bool succeeded) const;
+
+    bool isFinished(QString key) const;
+    bool tryClaim(QString key, QString source);
+    bool isExpired(QString key);
+    void breakClaim(QString key);
+    bool writeLease(QString key, QString source, int renewals);
+    QString readLease(QString key) const;
+    bool isOwnClaim(QString key) const;
+    bool isClaimedByUs(QString key);
+    void renewLeases();
+
+    QString m_directory;
+    int m_leaseSeconds;
+    bool m_ok;
+    QString m_owner;
+
+    // Lease contents last seen for other processes' claims, and the
+    // time we first saw them, by our own steady clock
+    struct Observation {
+        QString lease;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::map<QString, Observation> m_observed;
+
+    // Our claims, by key. Guarded by m_mutex, as the renewal thread
+    // goes through them
+    struct Claim {
+        QString source;
+        int renewals;
+        bool lost;      // taken over by another process
+    };
+    std::map<QString, Claim> m_claims;
+
+    std::thread m_renewer;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopRenewing;
+
+    SourceQueue(const SourceQueue &) =delete;
+    SourceQueue &operator=(const SourceQueue &) =delete;
+};
+
+#endif
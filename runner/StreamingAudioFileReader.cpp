@@ -0,0 +1,224 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "StreamingAudioFileReader.h"
+
+#include "base/Exceptions.h"
+#include "base/Debug.h"
+
+#include <bqaudiostream/AudioReadStream.h>
+#include <bqaudiostream/AudioReadStreamFactory.h>
+
+using namespace std;
+
+// Frames to decode at a time when we run out
+static const sv_frame_t decodeChunk = 4096;
+
+StreamingAudioFileReader *
+StreamingAudioFileReader::create(FileSource source,
+                                 sv_samplerate_t targetRate)
+{
+    if (!source.isAvailable()) {
+        return 0;
+    }
+    source.waitForData();
+
+    QString path = source.getLocalFilename();
+    breakfastquay::AudioReadStream *stream = 0;
+    
+    try {
+        stream = breakfastquay::AudioReadStreamFactory::createReadStream
+            (path.toLocal8Bit().data());
+    } catch (const std::exception &e) {
+        SVDEBUG << "StreamingAudioFileReader: no stream for \"" << path
+                << "\": " << e.what() << endl;
+        return 0;
+    }
+    
+    if (!stream || !stream->isOK()) {
+        delete stream;
+        return 0;
+    }
+
+    sv_samplerate_t nativeRate = sv_samplerate_t(stream->getSampleRate());
+    if (nativeRate == 0) {
+        delete stream;
+        return 0;
+    }
+
+    if (targetRate != 0 && targetRate != nativeRate) {
+        stream->setRetrievalSampleRate(size_t(targetRate));
+    }
+
+    return new StreamingAudioFileReader(source, stream);
+}
+
+StreamingAudioFileReader::StreamingAudioFileReader(FileSource source,
+                                                   breakfastquay::AudioReadStream *stream) :
+    m_source(source),
+    m_stream(stream),
+    m_bufferHead(0),
+    m_bufferStart(0),
+    m_framesRead(0),
+    m_ended(false)
+{
+    m_channelCount = int(stream->getChannelCount());
+    m_nativeRate = sv_samplerate_t(stream->getSampleRate());
+    m_sampleRate = sv_samplerate_t(stream->getRetrievalSampleRate());
+    m_frameCount = 0; // open-ended
+    m_title = QString::fromStdString(stream->getTrackName());
+    m_maker = QString::fromStdString(stream->getArtistName());
+
+    SVDEBUG << "StreamingAudioFileReader: streaming \""
+            << source.getLocation() << "\": " << m_channelCount
+            << "ch at " << m_sampleRate << "Hz (estimated "
+            << stream->getEstimatedFrameCount() << " frames at "
+            << m_nativeRate << "Hz)" << endl;
+}
+
+StreamingAudioFileReader::~StreamingAudioFileReader()
+{
+}
+
+void
+StreamingAudioFileReader::decodeTo(sv_frame_t frame) const
+{
+    // Called with m_mutex held
+    
+    size_t ch = m_channelCount;
+    
+    while (!m_ended) {
+        
+        sv_frame_t available =
+            sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+        if (m_bufferStart + available >= frame) {
+            break;
+        }
+
+        size_t sz = m_buffer.size();
+        m_buffer.resize(sz + decodeChunk * ch);
+        size_t got = m_stream->getInterleavedFrames
+            (decodeChunk, m_buffer.data() + sz);
+        m_buffer.resize(sz + got * ch);
+        m_framesRead += sv_frame_t(got);
+
+        if (got == 0) {
+            m_ended = true;
+        }
+    }
+}
+
+void
+StreamingAudioFileReader::skipTo(sv_frame_t frame) const
+{
+    // Called with m_mutex held
+
+    size_t ch = m_channelCount;
+
+    while (true) {
+
+        // Drop what we have passed, and compact once the dead space
+        // at the front is larger than what remains
+        
+        sv_frame_t available =
+            sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+        sv_frame_t skip = std::min(frame - m_bufferStart, available);
+        m_bufferHead += skip * ch;
+        m_bufferStart += skip;
+
+        if (m_bufferHead > m_buffer.size() / 2) {
+            m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_bufferHead);
+            m_bufferHead = 0;
+        }
+
+        if (m_bufferStart >= frame || m_ended) {
+            break;
+        }
+
+        // Everything we had is gone: decode one more chunk
+        decodeTo(std::min(frame, m_bufferStart + decodeChunk));
+    }
+}
+
+const float *
+StreamingAudioFileReader::prepareRead(sv_frame_t start,
+                                      sv_frame_t &count) const
+{
+    // Called with m_mutex held
+    
+    size_t ch = m_channelCount;
+
+    if (start < m_bufferStart) {
+        throw FileOperationFailed
+            (m_source.getLocation(),
+             "read from before the current position in streamed audio");
+    }
+
+    skipTo(start);
+    decodeTo(start + count);
+
+    if (m_bufferStart < start) {
+        // The stream has ended: there is nothing at start, and we
+        // needn't keep anything from before it
+        m_bufferStart = start;
+        count = 0;
+        return 0;
+    }
+
+    sv_frame_t available =
+        sv_frame_t((m_buffer.size() - m_bufferHead) / ch);
+    count = std::min(count, available);
+    
+    return m_buffer.data() + m_bufferHead;
+}
+
+floatvec_t
+StreamingAudioFileReader::getInterleavedFrames(sv_frame_t start,
+                                               sv_frame_t count) const
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    const float *frames = prepareRead(start, count);
+    if (!frames) {
+        return {};
+    }
+    
+    floatvec_t result(frames, frames + count * m_channelCount);
+    applyGain(result.data(), count * m_channelCount);
+    return result;
+}
+
+sv_frame_t
+StreamingAudioFileReader::readChannels(sv_frame_t start,
+                                       sv_frame_t count,
+                                       int channels,
+                                       float *const *buffers) const
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    sv_frame_t available = count;
+    const float *frames = prepareRead(start, available);
+
+    deinterleave(frames, available, m_channelCount, count, channels, buffers);
+    applyGain(channels, buffers, available);
+    return available;
+}
+
+sv_frame_t
+StreamingAudioFileReader::getFramesRead() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_framesRead;
+}
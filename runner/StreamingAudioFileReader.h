@@ -0,0 +1,127 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _STREAMING_AUDIO_FILE_READER_H_
+#define _STREAMING_AUDIO_FILE_READER_H_
+
+#include "data/fileio/AudioFileReader.h"
+#include "data/fileio/FileSource.h"
+
+#include "DeinterleavingReader.h"
+
+#include <QString>
+
+#include <memory>
+#include <mutex>
+
+namespace breakfastquay {
+    class AudioReadStream;
+}
+
+/**
+ * An AudioFileReader that decodes (and resamples) on demand, just
+ * ahead of the position being read, rather than decoding the whole
+ * file into a cache first. Memory use depends on the size of the
+ * reads, not on the length of the file, and the first audio is
+ * available as soon as the file is opened.
+ *
+ * The price is that reads must move forwards through the file: each
+ * read must start no earlier than the previous one did. That suits
+ * the block loop in FeatureExtractionManager, but not anything that
+ * reads the same file from several places at once. Reading from
+ * more than one thread is safe, but only if the reads are still made
+ * in order.
+ *
+ * The audio ends where the stream does. The length a stream reports
+ * before decoding is only an estimate for some formats, so it isn't
+ * used: the reader is open-ended (see
+ * DeinterleavingReader::isOpenEnded), like a pipe.
+ */
+class StreamingAudioFileReader : public AudioFileReader,
+                                 public DeinterleavingReader
+{
+    Q_OBJECT
+
+public:
+    // Return a reader for the given file, with audio resampled to the
+    // given rate (or the file's own rate if 0), or return 0 if no
+    // streaming decoder supports the file.
+    static StreamingAudioFileReader *create(FileSource source,
+                                            sv_samplerate_t targetRate);
+    
+    virtual ~StreamingAudioFileReader();
+
+    virtual QString getError() const override { return m_error; }
+    virtual bool isQuicklySeekable() const override { return false; }
+
+    virtual QString getTitle() const override { return m_title; }
+    virtual QString getMaker() const override { return m_maker; }
+
+    virtual QString getLocation() const { return m_source.getLocation(); }
+    virtual QString getLocalFilename() const { return m_source.getLocalFilename(); }
+
+    virtual sv_samplerate_t getNativeRate() const override { return m_nativeRate; }
+    
+    virtual floatvec_t getInterleavedFrames
+    (sv_frame_t start, sv_frame_t count) const override;
+
+    virtual sv_frame_t readChannels(sv_frame_t start, sv_frame_t count,
+                                    int channels,
+                                    float *const *buffers) const override;
+
+    virtual bool isOpenEnded() const override { return true; }
+    virtual sv_frame_t getFramesRead() const override;
+
+private:
+    StreamingAudioFileReader(FileSource source,
+                             breakfastquay::AudioReadStream *stream);
+
+    // Decode at least up to the given frame, or to the end of the
+    // stream. Called with m_mutex held.
+    void decodeTo(sv_frame_t frame) const;
+
+    // Drop everything before the given frame, decoding a chunk at a
+    // time and dropping as we go, so that skipping a long stretch
+    // (as before a transform's start time) never holds it in memory.
+    // Called with m_mutex held.
+    void skipTo(sv_frame_t frame) const;
+
+    // Decode as far as needed for a read of count frames from start,
+    // and drop what lies before it. Return a pointer to the first
+    // frame of interleaved audio in m_buffer, setting count to the
+    // number of frames available from there, or return 0 if there
+    // are none. Called with m_mutex held.
+    const float *prepareRead(sv_frame_t start, sv_frame_t &count) const;
+    
+    FileSource m_source;
+    QString m_error;
+    QString m_title;
+    QString m_maker;
+    sv_samplerate_t m_nativeRate;
+
+    // Decoded audio from m_bufferStart onwards. Frames are dropped
+    // from the front as the read position passes them, and the
+    // vector compacted when enough of it has gone, so this only ever
+    // holds a little more than the current read.
+    mutable std::unique_ptr<breakfastquay::AudioReadStream> m_stream;
+    mutable floatvec_t m_buffer;
+    mutable size_t m_bufferHead; // index in m_buffer of m_bufferStart
+    mutable sv_frame_t m_bufferStart;
+    mutable sv_frame_t m_framesRead; // decoded so far
+    mutable bool m_ended;
+    mutable std::mutex m_mutex;
+};
+
+#endif
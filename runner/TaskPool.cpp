@@ -0,0 +1,123 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "TaskPool.h"
+
+using namespace std;
+
+TaskPool::TaskPool(int size) :
+    m_tasks(0),
+    m_nextTask(0),
+    m_running(0),
+    m_generation(0),
+    m_exiting(false)
+{
+    for (int i = 1; i < size; ++i) {
+        m_threads.push_back(thread([this]() { threadRun(); }));
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_exiting = true;
+    }
+    m_workAvailable.notify_all();
+    for (auto &t: m_threads) {
+        t.join();
+    }
+}
+
+void
+TaskPool::run(const vector<Task> &tasks)
+{
+    if (tasks.empty()) return;
+
+    unique_lock<mutex> lock(m_mutex);
+
+    m_tasks = &tasks;
+    m_nextTask = 0;
+    m_exception = nullptr;
+    ++m_generation;
+
+    if (!m_threads.empty()) {
+        m_workAvailable.notify_all();
+    }
+
+    // The calling thread takes tasks as well, then waits for any
+    // still running elsewhere
+    runTasks(lock);
+
+    m_workDone.wait(lock, [this]() { return m_running == 0; });
+
+    m_tasks = 0;
+
+    if (m_exception) {
+        exception_ptr e = m_exception;
+        m_exception = nullptr;
+        rethrow_exception(e);
+    }
+}
+
+void
+TaskPool::runTasks(unique_lock<mutex> &lock)
+{
+    // Called with lock held; returns with it held
+
+    while (m_tasks && m_nextTask < int(m_tasks->size())) {
+
+        const Task &task = (*m_tasks)[m_nextTask++];
+        ++m_running;
+
+        lock.unlock();
+
+        exception_ptr e;
+        try {
+            task();
+        } catch (...) {
+            e = current_exception();
+        }
+
+        lock.lock();
+
+        if (e && !m_exception) {
+            m_exception = e;
+        }
+
+        if (--m_running == 0) {
+            m_workDone.notify_all();
+        }
+    }
+}
+
+void
+TaskPool::threadRun()
+{
+    unique_lock<mutex> lock(m_mutex);
+    int seen = m_generation;
+
+    while (true) {
+
+        m_workAvailable.wait(lock, [this, seen]() {
+                return m_exiting || m_generation != seen;
+            });
+
+        if (m_exiting) return;
+
+        seen = m_generation;
+        runTasks(lock);
+    }
+}
@@ -0,0 +1,72 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Annotator
+    A utility for batch feature extraction from audio files.
+    Mark Levy, Chris Sutton and Chris Cannam, Queen Mary, University of London.
+    Copyright 2007-2020 QMUL.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _TASK_POOL_H_
+#define _TASK_POOL_H_
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+/**
+ * A fixed set of threads for running a batch of short tasks in
+ * parallel and waiting for them all to complete. The threads are
+ * kept running between batches, so this is cheap enough to use once
+ * per processing block.
+ */
+class TaskPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    // Run tasks on up to the given number of threads at once. The
+    // thread that calls run() counts as one of them, so a pool of
+    // size 1 starts no threads and simply runs each task in turn.
+    TaskPool(int size);
+    ~TaskPool();
+
+    int getSize() const { return int(m_threads.size()) + 1; }
+
+    // Run all of the given tasks and return when they have all
+    // finished. The tasks may be started in any order. If any task
+    // throws, the first exception caught is rethrown from here once
+    // all the others are done.
+    void run(const std::vector<Task> &tasks);
+
+private:
+    void threadRun();
+    void runTasks(std::unique_lock<std::mutex> &lock);
+
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_workDone;
+
+    const std::vector<Task> *m_tasks;
+    int m_nextTask;
+    int m_running;
+    int m_generation;
+    bool m_exiting;
+    std::exception_ptr m_exception;
+
+    TaskPool(const TaskPool &) =delete;
+    TaskPool &operator=(const TaskPool &) =delete;
+};
+
+#endif
@@ -25,6 +25,10 @@
 #include <QDir>
 #include <QSet>
 
+#include <thread>
+#include <algorithm>
+#include <memory>
+
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -45,6 +49,16 @@ using std::string;
 #include "transform/TransformFactory.h"
 
 #include "FeatureExtractionManager.h"
+#include "ExtractionWorkerPool.h"
+#include "ExtractionTaskScheduler.h"
+#include "ExtractionProcessPool.h"
+#include "SourceManifest.h"
+#include "SourceQueue.h"
+#include "MemoryBudget.h"
+#include "DecodeCache.h"
+#include "DecodeMemoryPolicy.h"
+#include "SourceFinder.h"
+#include "PipeAudioFileReader.h"
 #include "transform/FeatureWriter.h"
 #include "FeatureWriterFactory.h"
 
@@ -257,6 +271,13 @@ void printHelp(QString myname, QString w)
     cerr << "Playlist files in M3U format are also supported." << endl;
     cerr << endl;
 
+    cerr << wrap("Audio may also be read from standard input, given as"
+                 " \"-\", or from a named pipe, either as a WAV stream or"
+                 " as raw samples described with --raw-format. Such input"
+                 " can't be resampled or normalised, or used with -m or any"
+                 " option that processes files in parallel.", 78, 0)
+         << endl << endl;
+
     if (extlist.contains("*.mp3")) {
         QString warning = "(Note: It's wise to avoid using %1 as a source format, even in cases where lossy compression is not considered problematic: the handling of initial encoder delay can vary between decoders, and possibly even between builds of %2, so feature timings may not be consistent.)";
         if (extlist.contains("*.m4a")) {
@@ -336,6 +357,20 @@ void printHelp(QString myname, QString w)
                         " at times read from the text file <F>. (one time per"
                         " line, in seconds).")
              << endl << endl;
+        cerr << "      --regions-from <F>\n                      "
+             << wrapCol("Extract features only from within regions of each"
+                        " input file listed in the text file <F>, one region"
+                        " per line in the form <audio>,<start>,<end> with"
+                        " times in seconds, where <audio> is the input file as"
+                        " given on the command line or its full path. Files"
+                        " with no regions listed are skipped. Overlapping"
+                        " regions are joined. The plugins start afresh at each"
+                        " gap between regions, feature times are those in the"
+                        " whole file, and each label (including those of"
+                        " summaries) starts with \"region <start>-<end>\"."
+                        " Not used in the same cases as --excerpts, and not"
+                        " together with it.")
+             << endl << endl;
         cerr << "  -m, --multiplex     "
              << wrapCol("If multiple input audio files are given, use mono"
                         " mixdowns of the files as the input channels for a single"
@@ -347,10 +382,234 @@ void printHelp(QString myname, QString w)
              << wrapCol("If any of the <audio> arguments is found to be a local"
                         " directory, search the tree starting at that directory"
                         " for all supported audio files and take all of those as"
-                        " input in place of it.")
+                        " input in place of it. Several directories are"
+                        " searched at once. Every file found is checked before"
+                        " any is processed, except with --force: then, if"
+                        " nothing else requires the whole list of files in"
+                        " advance, processing starts as soon as the first file"
+                        " is found, and a bad file found later is skipped.")
+             << endl << endl;
+        cerr << "      --scan-snapshot <F>\n                      "
+             << wrapCol("With -r, record the contents of each directory"
+                        " searched in the file <F>, and on later runs with the"
+                        " same file, use the recorded contents of any"
+                        " directory that has not been modified since instead"
+                        " of listing it again.")
+             << endl << endl;
+        cerr << "  -j, --jobs <N>      "
+             << wrapCol("Extract features from up to <N> input files at once,"
+                        " each using its own set of plugin instances. Output"
+                        " is written in the same order as it would be without"
+                        " this option. Use 0 for one job per CPU core. With"
+                        " -m, read from up to <N> of the multiplexed files at"
+                        " once instead.")
+             << endl << endl;
+        cerr << "      --processes <N> "
+             << wrapCol("Extract features from up to <N> input files at once,"
+                        " using a separate worker process for each rather than"
+                        " a thread, for plugins that cannot safely be run in"
+                        " more than one thread at a time. Output that would"
+                        " go to a single file or to standard output is"
+                        " gathered up in the same order as it would be without"
+                        " this option; this is only possible with the csv,"
+                        " lab and default writers. Use 0 for one process per"
+                        " CPU core. Not available on Windows.")
+             << endl << endl;
+        cerr << "      --plugin-tasks  "
+             << wrapCol("With --jobs, treat each plugin on each input file as"
+                        " a separate job, so that the jobs for a long file or"
+                        " an expensive plugin can be shared among idle threads."
+                        " Each file is read into memory in full before its"
+                        " plugins are run. Output is the same as it would be"
+                        " without this option.")
+             << endl << endl;
+        cerr << "      --longest-first "
+             << wrapCol("With --jobs, --processes or --queue, open every"
+                        " local input file beforehand to find out how long it"
+                        " is, and start on the longest files first, so that a"
+                        " long file is less likely to be left running on its"
+                        " own at the end. With --processes, share the files"
+                        " among the processes by total duration instead. Output"
+                        " is written in the same order as it would be without"
+                        " this option.")
+             << endl << endl;
+        cerr << "      --memory-budget <M>\n                      "
+             << wrapCol("With --jobs or --processes, try to keep memory use"
+                        " below <M> megabytes, by estimating how much each"
+                        " input file will need from its duration, channel"
+                        " count and sample rate and the outputs requested,"
+                        " and only starting on a file when the estimates for"
+                        " the files already in progress leave room for it."
+                        " The estimates are rough, so leave some margin.")
+             << endl << endl;
+        cerr << "      --plugin-threads <N>\n                      "
+             << wrapCol("Run up to <N> of the requested plugins at once on"
+                        " each block of audio. Output is the same as it would"
+                        " be without this option. Use 0 for one thread per CPU"
+                        " core.")
+             << endl << endl;
+        cerr << "      --pipeline      "
+             << wrapCol("Decode audio, run plugins and write features on"
+                        " separate threads, so that slow decoding or slow"
+                        " output storage need not hold up the plugins. Output"
+                        " is the same as it would be without this option.")
+             << endl << endl;
+        cerr << "      --streaming     "
+             << wrapCol("Decode each input file a little at a time as it is"
+                        " processed, instead of decoding all of it first, so"
+                        " that memory use does not grow with the length of"
+                        " the file. Not used with --split, --excerpts,"
+                        " --regions-from, -m or --plugin-tasks, or for"
+                        " formats that can't be decoded this way. Used with"
+                        " -n only for files whose peak level is already"
+                        " known from --decode-cache.")
+             << endl << endl;
+        cerr << "      --decode-cache <D>\n                      "
+             << wrapCol("Keep the decoded audio for each compressed input"
+                        " file in the directory <D>, and use it instead of"
+                        " decoding the file again when it is next processed"
+                        " at the same sample rate and with the same -n"
+                        " setting. A file that is changed or moved is"
+                        " recognised by its contents. Files decoded with"
+                        " --streaming are not stored. Several runs may share"
+                        " a cache directory.")
+             << endl << endl;
+        cerr << "      --decode-cache-size <M>\n                      "
+             << wrapCol("With --decode-cache, remove the least recently"
+                        " used audio from the cache whenever it grows beyond"
+                        " <M> megabytes. The default is no limit.")
+             << endl << endl;
+        cerr << "      --decode-memory <M>\n                      "
+             << wrapCol("Decode compressed input files, and files needing"
+                        " resampling, into memory instead of into the"
+                        " temporary directory, keeping up to <M> megabytes"
+                        " of decoded audio in memory at once. What doesn't"
+                        " fit is spilled to a file in the format given by"
+                        " --spill-format. A limit of 0 spills everything."
+                        " How much was spilled is reported at the end of the"
+                        " run.")
+             << endl << endl;
+        cerr << "      --spill-format <F>\n                      "
+             << wrapCol("With --decode-memory, spill audio as \"float\""
+                        " (exact; the default) or \"int16\" (16-bit"
+                        " integers, half the size). With \"int16\", only"
+                        " the audio that is spilled is rounded, and which"
+                        " audio that is depends on what else is being"
+                        " decoded at the same time, so with --jobs the"
+                        " output may differ slightly from one run to the"
+                        " next. Audio louder than full scale is also"
+                        " clipped when spilled as \"int16\", before any"
+                        " gain from -n is applied.")
+             << endl << endl;
+        cerr << "      --spill-dir <D> "
+             << wrapCol("With --decode-memory, spill audio to files in the"
+                        " directory <D> rather than the temporary directory.")
+             << endl << endl;
+        cerr << "      --prefetch <N>  "
+             << wrapCol("Open and decode up to <N> of the following input"
+                        " files in the background while each file is being"
+                        " processed, so that the plugins need not wait for"
+                        " them. With -m, open the files to be multiplexed <N>"
+                        " at a time. Not used with --jobs, --processes or"
+                        " --queue. Output is the same as it would be without"
+                        " this option.")
+             << endl << endl;
+        cerr << "      --prefetch-memory <M>\n                      "
+             << wrapCol("With --prefetch, don't open a file ahead of time if"
+                        " the decoded audio for the files already waiting"
+                        " would then be estimated to exceed <M> megabytes."
+                        " The default is 1024.")
+             << endl << endl;
+        cerr << "      --raw-format <F>\n                      "
+             << wrapCol("Read audio from standard input or a named pipe as"
+                        " raw interleaved samples in the format <F>, given as"
+                        " rate:channels[:encoding], instead of expecting a WAV"
+                        " stream. The encoding is one of u8, s8, s16, s24,"
+                        " s32, f32 or f64, with \"be\" appended for big-endian"
+                        " samples; the default is s16, little-endian. For"
+                        " example, 44100:2:s16.")
+             << endl << endl;
+        cerr << "      --channel-layout <I>=<L>\n                      "
+             << wrapCol("Give the plugin for transform id <I> the input"
+                        " channels in the layout <L>: \"native\" for all the"
+                        " channels as they are (the default), \"mono\" for a"
+                        " mixdown of them, or a channel number counting from"
+                        " 1 for just that channel. Transforms with different"
+                        " layouts are run together from one read of each"
+                        " input file. You may supply this option multiple"
+                        " times.")
+             << endl << endl;
+        cerr << "      --split <I>     "
+             << wrapCol("Allow the plugin for transform id <I> to be run on"
+                        " several parts of each input file at once. Only use this"
+                        " for transforms whose results at any point depend only"
+                        " on the audio near that point, such as spectral"
+                        " features: it will give wrong results for transforms"
+                        " such as beat trackers. Not available for transforms"
+                        " with summaries, start times or durations. You may"
+                        " supply this option multiple times.")
+             << endl << endl;
+        cerr << "      --split-count <N>\n                      "
+             << wrapCol("Split each file into up to <N> parts for the"
+                        " transforms given with --split. The default is one"
+                        " part per CPU core.")
+             << endl << endl;
+        cerr << "      --excerpts <E>  "
+             << wrapCol("Extract features only from excerpts of each input"
+                        " file, rather than all of it. <E> is a"
+                        " comma-separated list of the times at which the"
+                        " excerpts start, each either in seconds or as a"
+                        " percentage of the file's duration, such as"
+                        " \"25%,50%,75%\". The plugins start afresh for each"
+                        " excerpt, and the label of each feature begins with"
+                        " the number of the excerpt it came from. Not used"
+                        " for transforms at more than one sample rate or with"
+                        " channel layouts, or for audio from a pipe.")
+             << endl << endl;
+        cerr << "      --excerpt-duration <S>\n                      "
+             << wrapCol("With --excerpts, make each excerpt <S> seconds"
+                        " long, or shorter where the file ends first. The"
+                        " default is 30.")
+             << endl << endl;
+        cerr << "      --shard <K>/<N> "
+             << wrapCol("Process only the <K>th of <N> roughly equal shares"
+                        " of the input files, for <K> from 1 to <N>, so that"
+                        " a large batch can be split among several machines"
+                        " without any coordination between them. Every"
+                        " machine must be given the same input files, with"
+                        " the same paths and sizes. Each share is chosen"
+                        " after -r and playlist expansion, and the files in"
+                        " it are processed in their usual order.")
+             << endl << endl;
+        cerr << "      --shard-manifest <F>\n                      "
+             << wrapCol("With --shard, list the input files completed and"
+                        " failed so far in file <F>. The default is"
+                        " shard-<K>-of-<N>.manifest in the current directory.")
+             << endl << endl;
+        cerr << "      --queue <D>     "
+             << wrapCol("Share the input files with any other runs given the"
+                        " same queue directory <D>, on this machine or on"
+                        " others that see it through a shared filesystem. Each"
+                        " run processes whichever files have not yet been"
+                        " claimed by another, in their usual order, until none"
+                        " are left. A file claimed by a run that then stops"
+                        " responding is given to another run once its lease"
+                        " expires. Every run must be given the same input"
+                        " files, with the same paths. Use separate output"
+                        " files for each input file, or a separate output"
+                        " file for each run.")
+             << endl << endl;
+        cerr << "      --queue-lease <S>\n                      "
+             << wrapCol("With --queue, consider a claimed file abandoned if"
+                        " the run that claimed it has shown no sign of life"
+                        " for <S> seconds. The default is 60.")
              << endl << endl;
         cerr << "  -n, --normalise     "
-             << wrapCol("Normalise each input audio file to signal abs max = 1.f.")
+             << wrapCol("Normalise each input audio file to signal abs max = 1.f."
+                        " Uncompressed files are scanned for their peak level"
+                        " and read in place. With --decode-cache, the peak"
+                        " level of each file is kept for later runs, so that"
+                        " they can normalise as they read.")
              << endl << endl;
         cerr << "  -f, --force         "
              << wrapCol("Continue with subsequent files following an error.")
@@ -485,31 +744,82 @@ checkTransformMinVersion(QString myname, QString id, int version)
     }
 }
 
-void
-findSourcesRecursive(QString dirname, QStringList &addTo, int &found)
+static quint64
+stablePathHash(QString path)
 {
-    QDir dir(dirname);
-
-    QString printable = dir.dirName().left(20);
-    SVCERR << "\rScanning \"" << printable << "\"..."
-         << QString("                    ").left(20 - printable.length())
-         << " [" << found << " audio file(s)]";
+    // 64-bit FNV-1a, which (unlike qHash) is the same for a given
+    // path on every machine and with every version of Qt
+    QByteArray data = path.toUtf8();
+    quint64 h = 14695981039346656037ULL;
+    for (int i = 0; i < data.size(); ++i) {
+        h ^= quint64((unsigned char)data[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-    QString extensions = AudioFileReaderFactory::getKnownExtensions();
-    QStringList extlist = extensions.split(" ", QString::SkipEmptyParts);
+static QStringList
+selectShard(QStringList sources, int shard, int shardCount)
+{
+    // Assign each source to one of shardCount shares, largest files
+    // first, each going to whichever share has the fewest bytes so
+    // far (then the fewest files). Equal sizes are ordered by path
+    // hash, and the search for the least-loaded share starts at a
+    // place given by the hash, so that sources of unknown size are
+    // still spread evenly. Everything here depends only on the
+    // paths and sizes, so every machine arrives at the same answer.
+
+    struct Item {
+        int index;
+        qint64 size;
+        quint64 hash;
+    };
+
+    vector<Item> items;
+    for (int i = 0; i < sources.size(); ++i) {
+        QFileInfo info(sources[i]);
+        Item item;
+        item.index = i;
+        item.size = (info.isFile() ? info.size() : 0);
+        item.hash = stablePathHash(sources[i]);
+        items.push_back(item);
+    }
 
-    QStringList files = dir.entryList
-        (extlist, QDir::Files | QDir::Readable);
-    for (int i = 0; i < files.size(); ++i) {
-        addTo.push_back(dir.filePath(files[i]));
-        ++found;
+    std::sort(items.begin(), items.end(),
+              [&sources](const Item &a, const Item &b) {
+                  if (a.size != b.size) return a.size > b.size;
+                  if (a.hash != b.hash) return a.hash < b.hash;
+                  return sources[a.index] < sources[b.index];
+              });
+
+    vector<qint64> bytes(shardCount, 0);
+    vector<int> counts(shardCount, 0);
+    vector<char> selected(sources.size(), 0);
+
+    for (const Item &item: items) {
+        int start = int(item.hash % quint64(shardCount));
+        int best = start;
+        for (int j = 1; j < shardCount; ++j) {
+            int s = (start + j) % shardCount;
+            if (bytes[s] < bytes[best] ||
+                (bytes[s] == bytes[best] && counts[s] < counts[best])) {
+                best = s;
+            }
+        }
+        bytes[best] += item.size;
+        counts[best] += 1;
+        if (best == shard - 1) {
+            selected[item.index] = 1;
+        }
     }
 
-    QStringList subdirs = dir.entryList
-        (QStringList(), QDir::Dirs | QDir::NoSymLinks | QDir::NoDotAndDotDot);
-    for (int i = 0; i < subdirs.size(); ++i) {
-        findSourcesRecursive(dir.filePath(subdirs[i]), addTo, found);
+    QStringList result;
+    for (int i = 0; i < sources.size(); ++i) {
+        if (selected[i]) {
+            result.push_back(sources[i]);
+        }
     }
+    return result;
 }
 
 QStringList
@@ -602,6 +912,61 @@ readSegmentBoundaries(QString url,
     return true;
 }
 
+bool
+readRegions(QString url, FeatureExtractionManager::RegionMap &regions)
+{
+    FileSource source(url);
+    if (!source.isAvailable()) {
+        SVCERR << "File or URL \"" << url << "\" could not be retrieved" << endl;
+        return false;
+    }
+    source.waitForData();
+
+    QString filename = source.getLocalFilename();
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        SVCERR << "File \"" << filename << "\" could not be read" << endl;
+        return false;
+    }
+
+    QTextStream in(&file);
+    int lineNo = 0;
+
+    while (!in.atEnd()) {
+
+        ++lineNo;
+
+        QString line = in.readLine().trimmed();
+        if (line.startsWith("#")) continue;
+        if (line == "") continue;
+
+        // <audio>,<start>,<end>, taking the times from the right so
+        // that the audio file name may itself contain commas
+        int second = line.lastIndexOf(',');
+        int first = (second > 0 ? line.lastIndexOf(',', second - 1) : -1);
+        if (first <= 0) {
+            SVCERR << "Region at line " << lineNo
+                   << " is not of the form <audio>,<start>,<end>" << endl;
+            return false;
+        }
+
+        bool startGood = false, endGood = false;
+        double start = line.mid(first + 1, second - first - 1).trimmed()
+            .toDouble(&startGood);
+        double end = line.mid(second + 1).trimmed().toDouble(&endGood);
+        if (!startGood || !endGood || start < 0.0 || end <= start) {
+            SVCERR << "Unparseable or out-of-order region times at line "
+                   << lineNo << endl;
+            return false;
+        }
+
+        regions[line.left(first).trimmed()].push_back
+            (FeatureExtractionManager::Region(start, end));
+    }
+
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     QCoreApplication application(argc, argv);
@@ -619,12 +984,42 @@ int main(int argc, char **argv)
     bool force = false;
     bool multiplex = false;
     bool recursive = false;
+    QString scanSnapshotPath;
     bool normalise = false;
     bool quiet = false;
     bool list = false;
     bool listWriters = false;
     bool listFormats = false;
     bool summaryOnly = false;
+    int jobs = 1;
+    int processes = 1;
+    int pluginThreads = 1;
+    bool pipeline = false;
+    bool streaming = false;
+    bool pluginTasks = false;
+    bool longestFirst = false;
+    int memoryBudget = 0;
+    QString decodeCacheDir;
+    QString rawFormat;
+    int decodeCacheSize = 0;
+    int decodeMemory = -1;
+    DecodeMemoryPolicy::SpillFormat spillFormat =
+        DecodeMemoryPolicy::SpillFormat::Float32;
+    bool haveSpillFormat = false;
+    QString spillDir;
+    int prefetch = 0;
+    int prefetchMemory = 0;
+    set<TransformId> splitTransforms;
+    map<TransformId, FeatureExtractionManager::ChannelLayout> channelLayouts;
+    vector<FeatureExtractionManager::Excerpt> excerpts;
+    FeatureExtractionManager::RegionMap regions;
+    double excerptDuration = 0.0;
+    int splitCount = 0;
+    int shard = 0;
+    int shardCount = 0;
+    QString shardManifestPath;
+    QString queueDir;
+    int queueLease = 60;
     QString skeletonFor = "";
     QString minVersion = "";
     pair<QString, QString> transformMinVersion;
@@ -765,12 +1160,370 @@ int main(int argc, char **argv)
                     exit(2);
                 }
             }
+        } else if (arg == "--regions-from") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                if (!readRegions(args[++i], regions)) {
+                    cerr << myname << ": failed to read regions from file" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
         } else if (arg == "-m" || arg == "--multiplex") {
             multiplex = true;
             continue;
         } else if (arg == "-r" || arg == "--recursive") {
             recursive = true;
             continue;
+        } else if (arg == "--scan-snapshot") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                scanSnapshotPath = args[++i];
+                continue;
+            }
+        } else if (arg == "-j" || arg == "--jobs") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                jobs = args[++i].toInt(&ok);
+                if (!ok || jobs < 0) {
+                    cerr << myname << ": number of jobs must be a non-negative integer" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                if (jobs == 0) {
+                    jobs = std::max(1, int(std::thread::hardware_concurrency()));
+                }
+                continue;
+            }
+        } else if (arg == "--processes") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                processes = args[++i].toInt(&ok);
+                if (!ok || processes < 0) {
+                    cerr << myname << ": number of processes must be a non-negative integer" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                if (processes == 0) {
+                    processes = std::max(1, int(std::thread::hardware_concurrency()));
+                }
+                continue;
+            }
+        } else if (arg == "--plugin-tasks") {
+            pluginTasks = true;
+            continue;
+        } else if (arg == "--memory-budget") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                memoryBudget = args[++i].toInt(&ok);
+                if (!ok || memoryBudget < 1) {
+                    cerr << myname << ": memory budget must be a positive number of megabytes" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--longest-first") {
+            longestFirst = true;
+            continue;
+        } else if (arg == "--pipeline") {
+            pipeline = true;
+            continue;
+        } else if (arg == "--streaming") {
+            streaming = true;
+            continue;
+        } else if (arg == "--decode-cache") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                decodeCacheDir = args[++i];
+                continue;
+            }
+        } else if (arg == "--decode-cache-size") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                decodeCacheSize = args[++i].toInt(&ok);
+                if (!ok || decodeCacheSize < 1) {
+                    cerr << myname << ": decode cache size must be a positive number of megabytes" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--decode-memory") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                decodeMemory = args[++i].toInt(&ok);
+                if (!ok || decodeMemory < 0) {
+                    cerr << myname << ": decode memory must be a number of megabytes" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--spill-format") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                if (!DecodeMemoryPolicy::parseSpillFormat(args[++i],
+                                                          spillFormat)) {
+                    cerr << myname << ": unknown spill format \"" << args[i]
+                         << "\" (expected \"int16\" or \"float\")" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                haveSpillFormat = true;
+                continue;
+            }
+        } else if (arg == "--spill-dir") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                spillDir = args[++i];
+                continue;
+            }
+        } else if (arg == "--raw-format") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                rawFormat = args[++i];
+                MappedAudioFileReader::Layout layout;
+                if (!PipeAudioFileReader::parseRawFormat(rawFormat, layout)) {
+                    cerr << myname << ": unrecognised raw audio format \""
+                         << rawFormat << "\"" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--prefetch") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                prefetch = args[++i].toInt(&ok);
+                if (!ok || prefetch < 1) {
+                    cerr << myname << ": prefetch depth must be a positive number of files" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--prefetch-memory") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                prefetchMemory = args[++i].toInt(&ok);
+                if (!ok || prefetchMemory < 1) {
+                    cerr << myname << ": prefetch memory must be a positive number of megabytes" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--channel-layout") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                QString spec = args[++i];
+                int eq = spec.lastIndexOf('=');
+                FeatureExtractionManager::ChannelLayout layout;
+                if (eq <= 0 ||
+                    !FeatureExtractionManager::parseChannelLayout
+                    (spec.mid(eq + 1), layout)) {
+                    cerr << myname << ": channel layout must be given as <transform>=<layout>, where <layout> is native, mono or a channel number" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                channelLayouts[spec.left(eq)] = layout;
+                continue;
+            }
+        } else if (arg == "--excerpts") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                if (!FeatureExtractionManager::parseExcerpts(args[++i],
+                                                            excerpts)) {
+                    cerr << myname << ": excerpts must be given as a comma-separated list of start times in seconds or percentages" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--excerpt-duration") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                excerptDuration = args[++i].toDouble(&ok);
+                if (!ok || excerptDuration <= 0.0) {
+                    cerr << myname << ": excerpt duration must be a positive number of seconds" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--split") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                splitTransforms.insert(args[++i]);
+                continue;
+            }
+        } else if (arg == "--split-count") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                splitCount = args[++i].toInt(&ok);
+                if (!ok || splitCount < 1) {
+                    cerr << myname << ": split count must be a positive integer" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--shard") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                QStringList parts = args[++i].split("/");
+                bool ok = (parts.size() == 2);
+                if (ok) shard = parts[0].toInt(&ok);
+                if (ok) shardCount = parts[1].toInt(&ok);
+                if (!ok || shardCount < 1 || shard < 1 || shard > shardCount) {
+                    cerr << myname << ": shard must be given as <K>/<N> with <K> between 1 and <N>" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--shard-manifest") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                shardManifestPath = args[++i];
+                continue;
+            }
+        } else if (arg == "--queue") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                queueDir = args[++i];
+                continue;
+            }
+        } else if (arg == "--queue-lease") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                queueLease = args[++i].toInt(&ok);
+                if (!ok || queueLease < 1) {
+                    cerr << myname << ": queue lease must be a positive number of seconds" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                continue;
+            }
+        } else if (arg == "--plugin-threads") {
+            if (last || args[i+1].startsWith("-")) {
+                cerr << myname << ": argument expected for \""
+                     << arg << "\" option" << endl;
+                cerr << helpStr << endl;
+                exit(2);
+            } else {
+                bool ok = false;
+                pluginThreads = args[++i].toInt(&ok);
+                if (!ok || pluginThreads < 0) {
+                    cerr << myname << ": number of plugin threads must be a non-negative integer" << endl;
+                    cerr << helpStr << endl;
+                    exit(2);
+                }
+                if (pluginThreads == 0) {
+                    pluginThreads = std::max(1, int(std::thread::hardware_concurrency()));
+                }
+                continue;
+            }
         } else if (arg == "-n" || arg == "--normalise") {
             normalise = true;
             continue;
@@ -950,6 +1703,74 @@ int main(int argc, char **argv)
     FeatureExtractionManager manager(!quiet);
 
     manager.setNormalise(normalise);
+    manager.setPluginThreads(pluginThreads);
+    manager.setPipelined(pipeline);
+    manager.setStreaming(streaming);
+    manager.setRawFormat(rawFormat);
+
+    std::unique_ptr<DecodeCache> decodeCache;
+    if (decodeCacheDir != "") {
+        decodeCache.reset(new DecodeCache(decodeCacheDir,
+                                          size_t(decodeCacheSize) * 1048576));
+        if (!decodeCache->isOK()) {
+            exit(1);
+        }
+        manager.setDecodeCache(decodeCache.get());
+    } else if (decodeCacheSize > 0) {
+        SVCERR << myname << ": --decode-cache-size requires --decode-cache" << endl;
+        exit(2);
+    }
+
+    std::unique_ptr<DecodeMemoryPolicy> decodeMemoryPolicy;
+    if (decodeMemory >= 0) {
+        decodeMemoryPolicy.reset(new DecodeMemoryPolicy
+                                 (size_t(decodeMemory) * 1048576,
+                                  spillFormat, spillDir));
+        manager.setDecodeMemory(decodeMemoryPolicy.get());
+    } else if (haveSpillFormat || spillDir != "") {
+        SVCERR << myname << ": --spill-format and --spill-dir require --decode-memory" << endl;
+        exit(2);
+    }
+
+    if (prefetch > 0) {
+        manager.setPrefetch(prefetch, size_t(prefetchMemory > 0 ?
+                                             prefetchMemory : 1024) * 1048576);
+    } else if (prefetchMemory > 0) {
+        SVCERR << myname << ": --prefetch-memory requires --prefetch" << endl;
+        exit(2);
+    }
+
+    // The durations are only of use when processing files in parallel
+    bool parallel = (jobs > 1 || processes > 1 || queueDir != "");
+    manager.setProbeDurations((longestFirst || memoryBudget > 0) &&
+                              parallel && !multiplex);
+
+    if (!splitTransforms.empty()) {
+        if (splitCount == 0) {
+            splitCount = std::max(1, int(std::thread::hardware_concurrency()));
+        }
+        manager.setSplitTransforms(splitTransforms, splitCount);
+    }
+
+    if (!channelLayouts.empty()) {
+        manager.setChannelLayouts(channelLayouts);
+    }
+
+    if (!excerpts.empty()) {
+        manager.setExcerpts(excerpts,
+                            excerptDuration > 0.0 ? excerptDuration : 30.0);
+    } else if (excerptDuration > 0.0) {
+        SVCERR << myname << ": --excerpt-duration requires --excerpts" << endl;
+        exit(2);
+    }
+
+    if (!regions.empty()) {
+        if (!excerpts.empty()) {
+            SVCERR << myname << ": --regions-from and --excerpts can't be used together" << endl;
+            exit(2);
+        }
+        manager.setRegions(regions);
+    }
 
     if (!requestedSummaryTypes.empty()) {
         if (!manager.setSummaryTypes(requestedSummaryTypes,
@@ -962,6 +1783,7 @@ int main(int argc, char **argv)
     manager.setSummariesOnly(summaryOnly);
 
     vector<FeatureWriter *> writers;
+    vector<ExtractionProcessPool::WriterSetup> writerSetups;
 
     for (set<string>::const_iterator i = requestedWriterTags.begin();
          i != requestedWriterTags.end(); ++i) {
@@ -1041,10 +1863,12 @@ int main(int argc, char **argv)
         }
         
         writers.push_back(writer);
+        writerSetups.push_back({ writer, *i, writerArgs });
     }
 
     for (int i = 0; i < otherArgs.size(); ++i) {
-        if (otherArgs[i].startsWith("-")) {
+        // A lone "-" is standard input, not an option
+        if (otherArgs[i].startsWith("-") && otherArgs[i] != "-") {
             cerr << myname << ": unknown option \""
                  << otherArgs[i] << "\"" << endl;
             cerr << helpStr << endl;
@@ -1074,48 +1898,181 @@ int main(int argc, char **argv)
     }
 
     QStringList sources;
+    std::unique_ptr<SourceFinder> finder;
+
+    // Sources found by a recursive search can be processed while the
+    // search goes on, unless we need to know them all beforehand to
+    // share them out, order them or budget for them
+    bool streamSources = false;
+    
     if (!recursive) {
+        if (scanSnapshotPath != "") {
+            SVCERR << myname << ": --scan-snapshot requires -r" << endl;
+            exit(2);
+        }
         sources = otherArgs;
     } else {
-        for (QStringList::const_iterator i = otherArgs.begin();
-             i != otherArgs.end(); ++i) {
-            if (QDir(*i).exists()) {
-                SVCERR << "Directory found and recursive flag set, scanning for audio files..." << endl;
-                int found = 0;
-                findSourcesRecursive(*i, sources, found);
-                SVCERR << "\rDone, found " << found << " supported audio file(s)                    " << endl;
-            } else {
-                sources.push_back(*i);
-            }
+        // Without --force, a bad file must stop the run before any
+        // output is written, so every file has to be found and
+        // checked first
+        streamSources = (force &&
+                         !multiplex && shardCount == 0 && queueDir == "" &&
+                         !longestFirst && memoryBudget == 0 &&
+                         jobs <= 1 && processes <= 1);
+        SVCERR << "Recursive flag set, scanning for audio files..." << endl;
+        finder.reset(new SourceFinder(otherArgs, scanSnapshotPath,
+                                      !streamSources));
+        if (!streamSources) {
+            sources = finder->getAllSources();
+            SVCERR << "\rDone, found " << sources.size() << " supported audio file(s)                    " << endl;
         }
     }
 
     sources = expandPlaylists(sources);
+
+    // Files with no regions listed would only be skipped, so don't
+    // open them at all
+    auto hasRegions = [&](QString source) -> bool {
+        if (manager.hasRegionsFor(source)) return true;
+        SVCERR << "NOTE: No regions listed for \""
+               << source.toStdString() << "\", skipping it" << endl;
+        return false;
+    };
+    if (!regions.empty()) {
+        QStringList listed;
+        foreach (QString source, sources) {
+            if (hasRegions(source)) listed.push_back(source);
+        }
+        sources = listed;
+        if (sources.empty() && !streamSources) {
+            SVCERR << myname << ": no regions listed for any input file, nothing to do" << endl;
+            exit(0);
+        }
+    }
+
+    // A pipe can only be read once, from start to end, by one reader
+    foreach (QString source, sources) {
+        if (PipeAudioFileReader::isPipe(source) &&
+            (multiplex || jobs > 1 || processes > 1 ||
+             shardCount > 0 || queueDir != "")) {
+            SVCERR << myname << ": input from a pipe cannot be used with -m, --jobs, --processes, --shard or --queue" << endl;
+            exit(2);
+        }
+    }
+
+    std::unique_ptr<SourceManifest> manifest;
+
+    if (shardCount > 0) {
+        if (multiplex) {
+            SVCERR << myname << ": --shard cannot be used with -m" << endl;
+            exit(2);
+        }
+        int total = sources.size();
+        sources = selectShard(sources, shard, shardCount);
+        SVCERR << "Shard " << shard << " of " << shardCount << ": "
+               << sources.size() << " of " << total << " file(s)" << endl;
+        if (shardManifestPath == "") {
+            shardManifestPath = QString("shard-%1-of-%2.manifest")
+                .arg(shard).arg(shardCount);
+        }
+        manifest.reset(new SourceManifest(shardManifestPath));
+        if (!manifest->start(QString("%1 shard %2/%3: %4 of %5 file(s)")
+                             .arg(myname).arg(shard).arg(shardCount)
+                             .arg(sources.size()).arg(total))) {
+            exit(1);
+        }
+    } else if (shardManifestPath != "") {
+        SVCERR << myname << ": --shard-manifest requires --shard" << endl;
+        exit(2);
+    }
+
+    std::unique_ptr<SourceQueue> queue;
+
+    if (queueDir != "") {
+        if (multiplex || shardCount > 0 || jobs > 1 || processes > 1) {
+            SVCERR << myname << ": --queue cannot be used with -m, --shard, --jobs or --processes" << endl;
+            exit(2);
+        }
+        queue.reset(new SourceQueue(queueDir, queueLease));
+        if (!queue->isOK()) {
+            exit(1);
+        }
+    }
+
+    auto recordCompletion = [&manifest](QString source, bool succeeded) {
+        if (manifest) manifest->record(source, succeeded);
+    };
         
     bool good = true;
     QSet<QString> badSources;
 
-    for (QStringList::const_iterator i = sources.begin();
-         i != sources.end(); ++i) {
+    // Return false if the source can't be added and we should stop
+    auto addSource = [&](QString source, bool more) -> bool {
         try {
-            manager.addSource(*i, multiplex);
+            manager.addSource(source, multiplex);
         } catch (const std::exception &e) {
-            badSources.insert(*i);
-            SVCERR << "ERROR: Failed to process file \"" << i->toStdString()
+            badSources.insert(source);
+            recordCompletion(source, false);
+            SVCERR << "ERROR: Failed to process file \"" << source.toStdString()
                  << "\": " << e.what() << endl;
             if (force) {
                 // print a note only if we have more files to process
-                QStringList::const_iterator j = i;
-                if (++j != sources.end()) {
+                if (more) {
                     SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
                 }
             } else {
                 SVCERR << "NOTE: If you want to continue with processing any further files after an" << endl
                      << "error like this, use the --force option" << endl;
-                good = false;
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (QStringList::const_iterator i = sources.begin();
+         i != sources.end(); ++i) {
+        QStringList::const_iterator j = i;
+        if (!addSource(*i, ++j != sources.end())) {
+            good = false;
+            break;
+        }
+    }
+
+    // Take further sources from a search still in progress, adding
+    // each to the manager as it comes, until there are more than the
+    // given number of good ones or the search is over. Return false
+    // if a source can't be added and we should stop.
+    int streamIndex = 0;
+    auto takeStreamedSources = [&](QStringList &goodSources, int count) -> bool {
+        while (streamSources && goodSources.size() <= count) {
+            QString found = finder->getSource(streamIndex++);
+            if (found == "") {
+                streamSources = false;
+                SVCERR << "Done, found " << streamIndex - 1
+                       << " supported audio file(s)" << endl;
                 break;
             }
+            foreach (QString source, expandPlaylists({ found })) {
+                if (!hasRegions(source)) {
+                    continue;
+                }
+                if (!addSource(source, true)) {
+                    return false;
+                }
+                if (!badSources.contains(source)) {
+                    goodSources.push_back(source);
+                }
+            }
         }
+        return true;
+    };
+
+    // The first good source sets the defaults that the feature
+    // extractors need, so we must have it before adding them
+    QStringList streamedSources;
+    if (good && streamSources) {
+        good = takeStreamedSources(streamedSources, 0);
+        sources.append(streamedSources);
     }
 
     if (good) {
@@ -1146,6 +2103,48 @@ int main(int argc, char **argv)
             SVCERR << myname << ": no feature extractors added" << endl;
             good = false;
         }
+
+        manager.checkChannelLayouts();
+
+        // Transforms at several rates or with their own channel
+        // layouts are run together from one read of each file, which
+        // these options can't take apart
+        if (manager.hasTransformGroups()) {
+            if (pluginTasks) {
+                SVCERR << "NOTE: Transforms use more than one sample rate or a channel layout, so \"--plugin-tasks\" is ignored" << endl;
+                pluginTasks = false;
+            }
+            if (pipeline) {
+                SVCERR << "NOTE: Transforms use more than one sample rate or a channel layout, so \"--pipeline\" is ignored" << endl;
+            }
+            if (!splitTransforms.empty()) {
+                SVCERR << "NOTE: Transforms use more than one sample rate or a channel layout, so \"--split\" is ignored" << endl;
+            }
+            if (!excerpts.empty()) {
+                SVCERR << "NOTE: Transforms use more than one sample rate or a channel layout, so \"--excerpts\" is ignored" << endl;
+            }
+            if (!regions.empty()) {
+                SVCERR << "NOTE: Transforms use more than one sample rate or a channel layout, so \"--regions-from\" is used only to choose which files to process" << endl;
+            }
+        } else if (!excerpts.empty() || !regions.empty()) {
+            // Excerpts and regions are taken one after another from a
+            // single read, which these options would also take apart
+            QString windowOption = (excerpts.empty() ?
+                                    "--regions-from" : "--excerpts");
+            if (pluginTasks) {
+                SVCERR << "NOTE: \"--plugin-tasks\" is ignored with \""
+                       << windowOption << "\"" << endl;
+                pluginTasks = false;
+            }
+            if (pipeline) {
+                SVCERR << "NOTE: \"--pipeline\" is ignored with \""
+                       << windowOption << "\"" << endl;
+            }
+            if (!splitTransforms.empty()) {
+                SVCERR << "NOTE: \"--split\" is ignored with \""
+                       << windowOption << "\"" << endl;
+            }
+        }
     }
 
     if (good) {
@@ -1155,34 +2154,182 @@ int main(int argc, char **argv)
                 goodSources.push_back(source);
             }
         }
+        // Every file is processed with the same transforms, so
+        // duration alone is enough to tell which files will take
+        // longest
+        vector<double> sourceCosts;
+        if (longestFirst) {
+            foreach (QString source, goodSources) {
+                sourceCosts.push_back(manager.getSourceDuration(source));
+            }
+        }
+        // Worker threads hold on to all the features for each file
+        // until it can be written in order; worker processes don't
+        std::unique_ptr<MemoryBudget> budget;
+        vector<size_t> footprints;
+        if (memoryBudget > 0) {
+            budget.reset(new MemoryBudget(size_t(memoryBudget) * 1048576));
+            foreach (QString source, goodSources) {
+                footprints.push_back(manager.estimateMemoryFootprint
+                                     (source, processes <= 1));
+            }
+        }
         if (multiplex) {
             try {
                 for (int i = 0; i < (int)writers.size(); ++i) {
                     writers[i]->setNofM(1, 1);
                 }
+                manager.setMultiplexThreads(jobs);
+                manager.prefetchSources(goodSources);
                 manager.extractFeaturesMultiplexed(goodSources);
             } catch (const std::exception &e) {
                 SVCERR << "ERROR: Feature extraction failed: "
                      << e.what() << endl;
             }
-        } else {
+        } else if (queue) {
+            // Each run's output is written as each file is done, so
+            // here we simply claim the files in order of cost
+            QStringList queueOrder;
+            for (int i: ExtractionWorkerPool::getProcessingOrder
+                     (sourceCosts, goodSources.size())) {
+                queueOrder.push_back(goodSources[i]);
+            }
+            // We can't know in advance which of the sources this run
+            // will end up with. As with streamed sources, what the
+            // writers need from setNofM is whether another will
+            // follow, so we claim the next one (if we can have it
+            // without waiting) before starting on the current one
+            QString source = queue->claimNext(queueOrder);
             int n = 0;
-            for (QStringList::const_iterator i = goodSources.begin();
-                 i != goodSources.end(); ++i) {
-                SVCERR << "Extracting features for: \"" << *i << "\"" << endl;
+            while (source != "") {
                 ++n;
+                QString next = queue->claimNext(queueOrder, false);
+                SVCERR << "Extracting features for: \"" << source << "\"" << endl;
+                try {
+                    for (int j = 0; j < (int)writers.size(); ++j) {
+                        writers[j]->setNofM(n, next == "" ? n : n + 1);
+                    }
+                    manager.extractFeatures(source);
+                    queue->finish(source, true);
+                } catch (const std::exception &e) {
+                    queue->finish(source, false);
+                    SVCERR << "ERROR: Feature extraction failed for \""
+                           << source.toStdString() << "\": " << e.what() << endl;
+                    if (force) {
+                        SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
+                    } else {
+                        SVCERR << "NOTE: If you want to continue with processing any further files after an" << endl
+                               << "error like this, use the --force option" << endl;
+                        good = false;
+                        break;
+                    }
+                }
+                if (next == "") {
+                    // The writers have been told that was the last
+                    // one, so anything we get after waiting for other
+                    // processes starts a new sequence
+                    next = queue->claimNext(queueOrder);
+                    n = 0;
+                }
+                source = next;
+            }
+        } else if (processes > 1 && goodSources.size() > 1) {
+            if (budget) {
+                // Each process handles one file at a time, so we can
+                // only keep within the budget by having fewer of them
+                vector<size_t> largest(footprints);
+                std::sort(largest.rbegin(), largest.rend());
+                int allowed = 0;
+                size_t total = 0;
+                while (allowed < int(largest.size()) &&
+                       total + largest[allowed] <= budget->getBudget()) {
+                    total += largest[allowed++];
+                }
+                allowed = std::max(1, allowed);
+                if (allowed < processes) {
+                    SVCERR << "Memory budget: using " << allowed
+                           << " worker process(es) instead of " << processes
+                           << endl;
+                    processes = allowed;
+                }
+            }
+            ExtractionProcessPool pool(manager, writerSetups, processes);
+            if (!pool.isOK()) {
+                SVCERR << myname << ": failed to set up extraction worker processes" << endl;
+                good = false;
+            } else {
+                pool.setCompletionCallback(recordCompletion);
+                pool.setSourceCosts(sourceCosts);
+                if (!pool.extractFeatures(goodSources, force)) {
+                    if (!force) good = false;
+                }
+            }
+        } else if (jobs > 1 && pluginTasks) {
+            // Each plugin already runs as a job of its own, so there
+            // is nothing left for these options to divide up
+            if (pipeline) {
+                SVCERR << "NOTE: \"--pipeline\" is ignored with \"--plugin-tasks\"" << endl;
+            }
+            if (!splitTransforms.empty()) {
+                SVCERR << "NOTE: \"--split\" is ignored with \"--plugin-tasks\"" << endl;
+            }
+            if (pluginThreads > 1) {
+                SVCERR << "NOTE: \"--plugin-threads\" is ignored with \"--plugin-tasks\"" << endl;
+            }
+            ExtractionTaskScheduler scheduler(manager, writers, jobs);
+            if (!scheduler.isOK()) {
+                SVCERR << myname << ": failed to set up extraction workers" << endl;
+                good = false;
+            } else {
+                scheduler.setCompletionCallback(recordCompletion);
+                scheduler.setSourceCosts(sourceCosts);
+                if (budget) scheduler.setMemoryBudget(budget.get(), footprints);
+                if (!scheduler.extractFeatures(goodSources, force)) {
+                    if (!force) good = false;
+                }
+            }
+        } else if (jobs > 1 && goodSources.size() > 1) {
+            ExtractionWorkerPool pool(manager, writers,
+                                      std::min(jobs, int(goodSources.size())));
+            if (!pool.isOK()) {
+                SVCERR << myname << ": failed to set up extraction workers" << endl;
+                good = false;
+            } else {
+                pool.setCompletionCallback(recordCompletion);
+                pool.setSourceCosts(sourceCosts);
+                if (budget) pool.setMemoryBudget(budget.get(), footprints);
+                if (!pool.extractFeatures(goodSources, force)) {
+                    if (!force) good = false;
+                }
+            }
+        } else {
+            // While sources are still being found, we only know
+            // whether there is another after the current one, but
+            // that is all that the writers need from setNofM. When
+            // prefetching, we want enough to keep the prefetcher busy
+            int prefetched = 0;
+            for (int n = 1; n <= goodSources.size(); ++n) {
+                if (!takeStreamedSources(goodSources, n + prefetch)) {
+                    good = false;
+                    break;
+                }
+                manager.prefetchSources(goodSources.mid(prefetched));
+                prefetched = goodSources.size();
+                QString source = goodSources[n-1];
+                SVCERR << "Extracting features for: \"" << source << "\"" << endl;
                 try {
                     for (int j = 0; j < (int)writers.size(); ++j) {
                         writers[j]->setNofM(n, goodSources.size());
                     }
-                    manager.extractFeatures(*i);
+                    manager.extractFeatures(source);
+                    recordCompletion(source, true);
                 } catch (const std::exception &e) {
+                    recordCompletion(source, false);
                     SVCERR << "ERROR: Feature extraction failed for \""
-                           << i->toStdString() << "\": " << e.what() << endl;
+                           << source.toStdString() << "\": " << e.what() << endl;
                     if (force) {
                         // print a note only if we have more files to process
-                        QStringList::const_iterator j = i;
-                        if (++j != sources.end()) {
+                        if (n < goodSources.size()) {
                             SVCERR << "NOTE: \"--force\" option was provided, continuing (more errors may occur)" << endl;
                         }
                     } else {
@@ -1198,6 +2345,10 @@ int main(int argc, char **argv)
     
     for (int i = 0; i < (int)writers.size(); ++i) delete writers[i];
 
+    if (decodeMemoryPolicy) {
+        decodeMemoryPolicy->report();
+    }
+
     TempDirectory::getInstance()->cleanup();
     
     if (good) return 0;
@@ -5,8 +5,9 @@
 inbase=$audiopath/3clicks
 tmpfile1=$mypath/tmp_1_$$
 tmpfile2=$mypath/tmp_2_$$
+cachedir=$mypath/tmp_cache_$$
 
-trap "rm -f $tmpfile1 $tmpfile2" 0
+trap "rm -f $tmpfile1 $tmpfile2 ; rm -rf $cachedir" 0
 
 for extension in wav ogg mp3 opus ; do
 
@@ -32,6 +33,110 @@ for extension in wav ogg mp3 opus ; do
 	faildiff "Output mismatch for transform $transform for format $extension with audio file $infile" $tmpfile2 $expected
 done
 
+# Check the decode cache: the first run stores the decoded audio and
+# the second reads it back (as it reports), and both should match the
+# expected output
+
+transform=$mypath/transforms/percussiononsets.n3
+expected=$mypath/expected/percussiononsets-ogg.csv
+infile=$inbase.ogg
+
+for run in store reuse ; do
+
+    $r -t $transform -w csv --csv-stdout --decode-cache $cachedir $infile > $tmpfile2 2>$tmpfile1 || \
+	fail "Fails to run transform $transform against audio file $infile with --decode-cache ($run)"
+
+    if [ "$run" = "reuse" ]; then
+	grep -q "Using decoded audio for .* from cache" $tmpfile1 || \
+	    fail "Decoded audio not read from cache directory with --decode-cache ($run)"
+    else
+	! grep -q "Using decoded audio for .* from cache" $tmpfile1 || \
+	    fail "Decoded audio read from cache directory before it was stored ($run)"
+    fi
+
+    csvcompare $tmpfile2 $expected || \
+	faildiff "Output mismatch for transform $transform with audio file $infile and --decode-cache ($run)" $tmpfile2 $expected
+
+    test -n "$(ls $cachedir/audio/*.wav 2>/dev/null)" || \
+	fail "No decoded audio stored in cache directory with --decode-cache ($run)"
+done
+
+# Check decoding into memory: with room for all of the audio, and
+# with none, so that it is all spilled, in each spill format. Spilled
+# 16-bit integers are close enough for these onsets to come out the
+# same.
+
+for spill in "--decode-memory 64" "--decode-memory 0 --spill-format float" "--decode-memory 0 --spill-format int16" ; do
+
+    $r -t $transform -w csv --csv-stdout $spill --spill-dir $cachedir $infile > $tmpfile2 2>/dev/null || \
+	fail "Fails to run transform $transform against audio file $infile with $spill"
+
+    csvcompare $tmpfile2 $expected || \
+	faildiff "Output mismatch for transform $transform with audio file $infile and $spill" $tmpfile2 $expected
+done
+
+test -z "$(ls $cachedir/spill-* 2>/dev/null)" || \
+    fail "Spill files left behind after run with --decode-memory"
+
+# Check reading from a pipe: the WAV file on standard input, and then
+# its samples alone as raw audio, should give the same output as the
+# file itself. The source is named differently, so the first column
+# is not compared
+
+transform=$mypath/transforms/percussiononsets.n3
+expected=$mypath/expected/percussiononsets-wav.csv
+infile=${inbase}8.wav
+
+cat $infile | $r -t $transform -w csv --csv-stdout - > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform $transform against audio file $infile on standard input"
+
+csvcompare_ignorefirst $tmpfile2 $expected || \
+    faildiff "Output mismatch for transform $transform with audio file $infile on standard input" $tmpfile2 $expected
+
+tail -c +45 $infile | $r -t $transform -w csv --csv-stdout --raw-format 44100:1:u8 - > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform $transform against raw audio from $infile on standard input"
+
+csvcompare_ignorefirst $tmpfile2 $expected || \
+    faildiff "Output mismatch for transform $transform with raw audio from $infile on standard input" $tmpfile2 $expected
+
+# Check the sample formats read by mapping the file rather than
+# decoding it. These files hold the same samples as the 8-bit WAV
+# file, widened exactly, so they should give the same output. They
+# live here rather than in the main audio directory, whose contents
+# other tests depend on
+
+for infile in $mypath/audio/3clicks16.aiff $mypath/audio/3clicks24.wav $mypath/audio/3clicksf32.wav ; do
+
+    test -f $infile || \
+	fail "Internal error: no input audio file $infile"
+
+    $r -t $transform -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+	fail "Fails to run transform $transform against audio file $infile"
+
+    csvcompare_ignorefirst $tmpfile2 $expected || \
+	faildiff "Output mismatch for transform $transform with audio file $infile" $tmpfile2 $expected
+done
+
+# Check that durations and channel counts are found for a compressed
+# file and a WAV file (the latter from its headers alone) when a
+# memory budget needs them, and that the budget then uses them: each
+# of these files is long enough to exceed a 1MB budget on its own
+
+$r -d $amplplug -w csv --csv-stdout -j 2 --memory-budget 1 $audiopath/6clicks.ogg $audiopath/6clicks8.wav > /dev/null 2>$tmpfile1 || \
+    fail "Fails to run default transform for plugin $amplplug with --memory-budget"
+
+for infile in 6clicks.ogg 6clicks8.wav ; do
+
+    grep -q "Found duration of 9\.9[0-9]*s and 1 channel(s) for \".*/$infile\"" $tmpfile1 || \
+	fail "Duration and channel count not found for audio file $infile with --memory-budget"
+
+    grep -q "Estimated memory use of .* for \".*/$infile\" exceeds budget" $tmpfile1 || \
+	fail "Duration not used in memory estimate for audio file $infile with --memory-budget"
+done
+
+grep -q "Found duration of .* for \".*/6clicks8.wav\", from file headers" $tmpfile1 || \
+    fail "Duration of WAV file not read from its headers with --memory-budget"
+
 # Check the normalise flag
 
 $r -d $amplplug -w csv --csv-stdout ${inbase}8quiet.wav 2>/dev/null | head > $tmpfile1 || \
@@ -49,4 +154,38 @@ $r -d $amplplug --normalise -w csv --csv-stdout ${inbase}8quiet.wav 2>/dev/null
 csvcompare $tmpfile1 $mypath/expected/norm-on.csv || \
     faildiff "Output mismatch for default transform for plugin $amplplug against audio file ${inbase}8quiet.wav with normalisation" $tmpfile1 $mypath/expected/norm-on.csv
 
+# A WAV file is mapped rather than decoded into memory, so check
+# normalising in-memory audio (by a gain on read) with a compressed
+# file, against the same file normalised as it is decoded
+
+$r -d $amplplug -n -w csv --csv-stdout $inbase.ogg 2>/dev/null | head > $tmpfile2 || \
+    fail "Fails to run default transform for plugin $amplplug against audio file $inbase.ogg with normalisation"
+
+$r -d $amplplug -n --decode-memory 0 --spill-format float -w csv --csv-stdout $inbase.ogg 2>/dev/null | head > $tmpfile1 || \
+    fail "Fails to run default transform for plugin $amplplug against audio file $inbase.ogg with normalisation and --decode-memory"
+csvcompare $tmpfile1 $tmpfile2 || \
+    faildiff "Output mismatch for default transform for plugin $amplplug against audio file $inbase.ogg with normalisation and --decode-memory" $tmpfile1 $tmpfile2
+
+# Normalising with the decode cache: the cache check above stored
+# the unnormalised audio and recorded its peak level, so a normalised
+# run can read that audio scaled by the peak instead of decoding the
+# file again. It should match a plain normalised run.
+
+infile=$inbase.ogg
+
+$r -t $transform -n -w csv --csv-stdout $infile > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform against audio file $infile with normalisation"
+
+test -n "$(ls $cachedir/peaks/* 2>/dev/null)" || \
+    fail "No peak level recorded in cache directory with --decode-cache"
+
+$r -t $transform -n -w csv --csv-stdout --decode-cache $cachedir $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform $transform against audio file $infile with normalisation and --decode-cache"
+
+csvcompare $tmpfile2 $tmpfile1 || \
+    faildiff "Output mismatch for transform $transform with audio file $infile, normalisation and --decode-cache" $tmpfile2 $tmpfile1
+
+test "$(ls $cachedir/audio/*.wav | wc -l)" -eq 1 || \
+    fail "Normalised audio stored in cache directory when unnormalised audio and peak were available"
+
 exit 0
@@ -18,8 +18,9 @@ outfile6=6clicks8_vamp_vamp-example-plugins_percussiononsets_detectionfunction.j
 outfile1dot=3.clicks.8.json
 
 tmpjson=$mypath/tmp_1_$$.json
+queuedir=$mypath/tmp_queue_$$
 
-trap "rm -f $tmpjson $outfile1 $outfile2 $outfile3 $outfile4 $outfile5 $outfile6 $infile1dot $outfile1dot $audiopath/$outfile1 $audiopath/$outfile2 $audiopath/$outfile3 $audiopath/$outfile4 $audiopath/$outfile5 $audiopath/$outfile6 $audiopath/$outfile1dot" 0
+trap "rm -rf $queuedir; rm -f $tmpjson $outfile1 $outfile2 $outfile3 $outfile4 $outfile5 $outfile6 $infile1dot $outfile1dot $audiopath/$outfile1 $audiopath/$outfile2 $audiopath/$outfile3 $audiopath/$outfile4 $audiopath/$outfile5 $audiopath/$outfile6 $audiopath/$outfile1dot" 0
 
 transformdir=$mypath/transforms
 
@@ -88,6 +89,14 @@ $r -t $transformdir/onsets.n3 $mandatory --jams-stdout $infile1 $infile2 2>/dev/
 check_json $tmpjson "$ctx"
 
 
+ctx="onsets transform, two audio files, stdout JAMS writer, --queue"
+
+$r -t $transformdir/onsets.n3 $mandatory --jams-stdout --queue $queuedir $infile1 $infile2 2>/dev/null >$tmpjson || \
+    fail "Fails to run with $ctx"
+
+check_json $tmpjson "$ctx"
+
+
 ctx="onsets transform, one audio file, many-files JAMS writer"
 
 rm -f $audiopath/$outfile3
@@ -4,8 +4,14 @@
 
 tmpfile1=$mypath/tmp_1_$$
 tmpfile2=$mypath/tmp_2_$$
+tmpfile3=$mypath/tmp_3_$$
+queuedir=$mypath/tmp_queue_$$
+snapshot=$mypath/tmp_snapshot_$$
+manifest1=$mypath/tmp_manifest_1_$$
+manifest2=$mypath/tmp_manifest_2_$$
+listing=$mypath/tmp_listing_$$
 
-trap "rm -f $tmpfile1 $tmpfile2" 0
+trap "rm -rf $tmpfile1 $tmpfile2 $tmpfile3 $queuedir $snapshot $manifest1 $manifest2 $listing" 0
 
 transform=$mypath/transforms/af.n3 
 
@@ -135,3 +141,221 @@ expected=$mypath/expected/multiplexed
 csvcompare $tmpfile1 $expected.csv || \
     faildiff "Output mismatch for transform $transform with summaries and 2-file multiplexed input" $tmpfile1 $expected.csv
 
+
+# 10. As 1, but extracting from several files at once. Output should
+# be identical, as it is written in the same order
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --jobs 3 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --jobs"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --jobs" $tmpfile1 $expected.csv
+
+
+# 11. As 1, but running the transform's plugins alongside one another
+# within each block. Again the output should be identical
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --plugin-threads 2 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --plugin-threads"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --plugin-threads" $tmpfile1 $expected.csv
+
+# With more transforms, so that several plugins really do run at once, the
+# output should match a run without --plugin-threads line for line
+
+$r -t $transform -t $mypath/transforms/detectionfunction.n3 -d $amplplug -d $percplug -w csv --csv-digits 3 --csv-stdout -r $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run several plugins with recursive dir option"
+
+$r -t $transform -t $mypath/transforms/detectionfunction.n3 -d $amplplug -d $percplug -w csv --csv-digits 3 --csv-stdout -r --plugin-threads 4 $audiopath > $tmpfile2 2>/dev/null || \
+    fail "Fails to run several plugins with recursive dir option and --plugin-threads"
+
+csvcompare $tmpfile2 $tmpfile1 || \
+    faildiff "Output mismatch for several plugins with recursive dir option and --plugin-threads" $tmpfile2 $tmpfile1
+
+
+# 12. As 1, but with decoding, processing and writing pipelined on
+# separate threads
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --pipeline $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --pipeline"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --pipeline" $tmpfile1 $expected.csv
+
+
+# 13. As 10, but with each plugin on each file as a separate job
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --jobs 3 --plugin-tasks $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option, --jobs and --plugin-tasks"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option, --jobs and --plugin-tasks" $tmpfile1 $expected.csv
+
+
+# 14. As 10, but with worker processes instead of threads. Each
+# process writes its own part of the output, and the parts should be
+# joined back up in the original order
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --processes 3 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --processes"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --processes" $tmpfile1 $expected.csv
+
+
+# 15. As 1, but split into two shards. Between them the shards should
+# cover every file exactly once, though of course not in the original
+# order, so we compare sorted lines. Each shard's manifest should list
+# just the files that shard wrote out
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --shard 1/2 --shard-manifest $manifest1 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --shard 1/2"
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --shard 2/2 --shard-manifest $manifest2 $audiopath > $tmpfile3 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --shard 2/2"
+
+for shard in 1 2; do
+    if [ $shard = 1 ]; then output=$tmpfile1; manifest=$manifest1;
+    else output=$tmpfile3; manifest=$manifest2; fi
+    grep '^"' $output | cut -d, -f1 | sed 's/^"//; s/"$//' | sort > $tmpfile2
+    grep '^completed	' $manifest | cut -f2 | sort > $listing
+    cmp -s $tmpfile2 $listing || \
+        faildiff "Manifest for --shard $shard/2 does not list exactly the files in its output" $tmpfile2 $listing
+done
+
+cut -d, -f1 $mypath/expected/all-files.csv | grep '^"' | sed 's/^"//; s/"$//' | sort > $tmpfile2
+cat $manifest1 $manifest2 | grep '^completed	' | cut -f2 | sort > $listing
+cmp -s $tmpfile2 $listing || \
+    faildiff "Manifests for --shard 1/2 and 2/2 do not list every file exactly once between them" $tmpfile2 $listing
+
+cat $tmpfile3 >> $tmpfile1
+sort $tmpfile1 > $tmpfile2 && mv $tmpfile2 $tmpfile1
+
+expected=$mypath/expected/all-files
+sort $expected.csv > $tmpfile2
+csvcompare $tmpfile1 $tmpfile2 || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --shard" $tmpfile1 $tmpfile2
+
+
+# 16. As 1, but with two runs at once sharing a queue directory. Again
+# the files can come out in any order, but each should be processed
+# by exactly one of the runs
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --queue $queuedir $audiopath > $tmpfile1 2>/dev/null &
+pid1=$!
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --queue $queuedir $audiopath > $tmpfile3 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --queue"
+wait $pid1 || \
+    fail "Fails to run transform $transform with recursive dir option and --queue"
+
+cat $tmpfile3 >> $tmpfile1
+sort $tmpfile1 > $tmpfile2 && mv $tmpfile2 $tmpfile1
+
+expected=$mypath/expected/all-files
+sort $expected.csv > $tmpfile2
+csvcompare $tmpfile1 $tmpfile2 || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --queue" $tmpfile1 $tmpfile2
+
+
+# 17. As 10, but starting on the longest files first. The output
+# should still be in the original order
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --jobs 3 --longest-first $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option, --jobs and --longest-first"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option, --jobs and --longest-first" $tmpfile1 $expected.csv
+
+
+# 18. As 10, but with a memory budget too small for more than one file
+# at a time. Output should be unaffected
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --jobs 3 --memory-budget 1 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option, --jobs and --memory-budget"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option, --jobs and --memory-budget" $tmpfile1 $expected.csv
+
+
+# 19. As 1, but recording the directory contents in a snapshot file,
+# then running again with the directory listing taken from it. Output
+# should be the same both times, and the second run should report
+# that it used the recorded listing
+
+for run in record reuse ; do
+
+    $r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --scan-snapshot $snapshot $audiopath > $tmpfile1 2>$tmpfile2 || \
+        fail "Fails to run transform $transform with recursive dir option and --scan-snapshot ($run)"
+
+    test -s $snapshot || \
+        fail "No snapshot file written with --scan-snapshot ($run)"
+
+    if [ "$run" = "reuse" ]; then
+        grep -q "reused the recorded contents of [1-9]" $tmpfile2 || \
+            fail "Snapshot not reused with --scan-snapshot"
+    else
+        grep -q "reused the recorded contents of 0 " $tmpfile2 || \
+            fail "Snapshot reused before one was recorded"
+    fi
+
+    expected=$mypath/expected/all-files
+    csvcompare $tmpfile1 $expected.csv || \
+        faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --scan-snapshot ($run)" $tmpfile1 $expected.csv
+done
+
+
+# 20. As 1 and then 9, but opening the following files in the
+# background while each is processed. Output should be unaffected
+
+$r -t $transform -w csv --csv-digits 3 --csv-stdout -r --summary-only --prefetch 2 $audiopath > $tmpfile1 2>/dev/null || \
+    fail "Fails to run transform $transform with recursive dir option and --prefetch"
+
+expected=$mypath/expected/all-files
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, recursive dir option and --prefetch" $tmpfile1 $expected.csv
+
+$r -t $transform --multiplex --prefetch 2 --csv-digits 3 -w csv --csv-stdout $audiopath/3clicks.mp3 $audiopath/6clicks.ogg --summary-only 2>/dev/null > $tmpfile2 || \
+    fail "Fails to run transform $transform with 2-file input and --prefetch"
+
+cat "$tmpfile2" | sed 's,^"[^"]*/,",' > "$tmpfile1"
+
+expected=$mypath/expected/multiplexed
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, 2-file multiplexed input and --prefetch" $tmpfile1 $expected.csv
+
+
+# 21. Multiplexing, but giving the amplitude transform only the second
+# channel (the longer file), while the onsets transform still sees
+# both. Only the amplitude curve is compared, as the rows with a value
+# column: it should be that of the second file alone
+
+$r -d $amplplug --csv-digits 3 -w csv --csv-stdout $audiopath/6clicks8.wav 2>/dev/null > $tmpfile1 || \
+    fail "Fails to run default transform for $amplplug with single-file input"
+
+$r -d $amplplug -d $percplug --multiplex --channel-layout $amplplug:amplitude=2 --csv-digits 3 -w csv --csv-stdout $audiopath/3clicks8.wav $audiopath/6clicks8.wav 2>/dev/null > $tmpfile3 || \
+    fail "Fails to run default transforms for $amplplug and $percplug with 2-file multiplexed input and --channel-layout"
+
+grep '^[^,]*,[^,]*,' $tmpfile3 > $tmpfile2
+
+csvcompare_ignorefirst $tmpfile2 $tmpfile1 || \
+    faildiff "Output mismatch for default transform for $amplplug with 2-file multiplexed input and --channel-layout" $tmpfile2 $tmpfile1
+
+# 22. As 9, but reading the multiplexed files on several threads. The
+# output should be identical
+
+$r -t $transform --multiplex --jobs 2 --csv-digits 3 -w csv --csv-stdout $audiopath/3clicks.mp3 $audiopath/6clicks.ogg --summary-only 2>/dev/null > $tmpfile2 || \
+    fail "Fails to run transform $transform with 2-file multiplexed input and --jobs"
+
+cat "$tmpfile2" | sed 's,^"[^"]*/,",' > "$tmpfile1"
+
+expected=$mypath/expected/multiplexed
+csvcompare $tmpfile1 $expected.csv || \
+    faildiff "Output mismatch for transform $transform with summaries, 2-file multiplexed input and --jobs" $tmpfile1 $expected.csv
@@ -41,6 +41,18 @@ $r -t $transform -w csv --csv-stdout -S mean $infile > $tmpfile 2>/dev/null || \
 compare $tmpfile ${expected}-with-mean.csv || \
     faildiff "Output mismatch for transform $transform with summary type mean" $tmpfile ${expected}-with-mean.csv
 
+$r -t $transform -w csv --csv-stdout -S mean --pipeline $infile > $tmpfile 2>/dev/null || \
+    fail "Fails to run transform $transform with summary type mean and --pipeline"
+
+compare $tmpfile ${expected}-with-mean.csv || \
+    faildiff "Output mismatch for transform $transform with summary type mean and --pipeline" $tmpfile ${expected}-with-mean.csv
+
+$r -t $transform -w csv --csv-stdout -S mean --streaming $infile > $tmpfile 2>/dev/null || \
+    fail "Fails to run transform $transform with summary type mean and --streaming"
+
+compare $tmpfile ${expected}-with-mean.csv || \
+    faildiff "Output mismatch for transform $transform with summary type mean and --streaming" $tmpfile ${expected}-with-mean.csv
+
 $r -t $transform -w csv --csv-stdout -S min -S max -S mean -S median -S mode -S sum -S variance -S sd -S count --summary-only $infile > $tmpfile 2>/dev/null || \
     fail "Fails to run transform $transform with all summary types and summary-only"
 
@@ -5,8 +5,9 @@
 infile=$audiopath/3clicks8.wav
 tmpfile1=$mypath/tmp_1_$$
 tmpfile2=$mypath/tmp_2_$$
+tmpdir=$mypath/tmp_dir_$$
 
-trap "rm -f $tmpfile1 $tmpfile2" 0
+trap "rm -f $tmpfile1 $tmpfile2 ; rm -rf $tmpdir" 0
 
 $r --skeleton $percplug > $tmpfile1 2>/dev/null || \
     fail "Fails to run with --skeleton $percplug"
@@ -79,5 +80,184 @@ $r -t $mypath/transforms/percussiononsets-set-step-and-block-size.n3 \
 csvcompare $tmpfile2 $mypath/expected/multiple.csv || \
     faildiff "Output mismatch for multiple transforms" $tmpfile2 $mypath/expected/multiple.csv
 
+
+# Check that splitting a frame-local transform into segments gives the
+# same results as running it over the whole file at once
+
+$r -t $mypath/transforms/percussiononsets-df-windowtype-default.n3 \
+    -w csv --csv-stdout $audiopath/6clicks8.wav > $tmpfile1 2>/dev/null || \
+    fail "Fails to run detection function transform without splitting"
+
+$r -t $mypath/transforms/percussiononsets-df-windowtype-default.n3 \
+   --split $percplug:detectionfunction --split-count 4 \
+    -w csv --csv-stdout $audiopath/6clicks8.wav > $tmpfile2 2>/dev/null || \
+    fail "Fails to run detection function transform with --split"
+
+csvcompare $tmpfile2 $tmpfile1 || \
+    faildiff "Output mismatch for detection function transform with --split" $tmpfile2 $tmpfile1
+
+
+# Check that transforms at different sample rates can be run together
+# from one read of the file, each giving the same results as it does
+# when run alone. The one at a lower rate is resampled from the read,
+# with the resampler's delay taken out, rather than read at its own
+# rate, so its onsets should still fall on the same blocks
+
+dffile=3clicks8_vamp_vamp-example-plugins_percussiononsets_detectionfunction.csv
+onsetsfile=3clicks8_vamp_vamp-example-plugins_percussiononsets_onsets.csv
+
+mkdir -p $tmpdir/alone $tmpdir/together
+
+$r -t $mypath/transforms/percussiononsets-df-windowtype-default.n3 \
+    -w csv --csv-basedir $tmpdir/alone $infile 2>/dev/null || \
+    fail "Fails to run detection function transform alone"
+
+$r -t $mypath/transforms/percussiononsets-df-windowtype-default.n3 \
+   -t $mypath/transforms/percussiononsets-set-sample-rate.n3 \
+    -w csv --csv-basedir $tmpdir/together $infile 2>/dev/null || \
+    fail "Fails to run transforms at different sample rates together"
+
+csvcompare $tmpdir/together/$dffile $tmpdir/alone/$dffile || \
+    faildiff "Output mismatch for detection function run alongside a transform at another rate" $tmpdir/together/$dffile $tmpdir/alone/$dffile
+
+test -f $tmpdir/together/$onsetsfile || \
+    fail "No output for transform at lower rate run alongside detection function"
+
+$r -t $mypath/transforms/percussiononsets-set-sample-rate.n3 \
+    -w csv --csv-basedir $tmpdir/alone $infile 2>/dev/null || \
+    fail "Fails to run transform at lower rate alone"
+
+csvcompare $tmpdir/together/$onsetsfile $tmpdir/alone/$onsetsfile || \
+    faildiff "Output mismatch for transform at lower rate run alongside detection function" $tmpdir/together/$onsetsfile $tmpdir/alone/$onsetsfile
+
+# Check a transform with a start time and duration against the same
+# audio on standard input: the end of the range is known without the
+# length of the stream, so the output should be the same as for the
+# file. The source is named differently, so the first column is not
+# compared
+
+transform=$mypath/transforms/percussiononsets-start-and-duration.n3
+expected=$mypath/expected/percussiononsets-start-and-duration.csv
+
+cat $infile | $r -t $transform -w csv --csv-stdout - > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform $transform against audio on standard input"
+
+csvcompare_ignorefirst $tmpfile2 $expected || \
+    faildiff "Output mismatch for transform $transform with audio on standard input" $tmpfile2 $expected
+
+# Check excerpts: two excerpts starting at the same place, each long
+# enough to cover the whole file, should each give the same onsets as
+# the whole file does, labelled with the excerpt they came from
+
+$r -t $mypath/transforms/percussiononsets.n3 --excerpts 0,0% \
+    --excerpt-duration 60 -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with --excerpts"
+
+expected=$mypath/expected/percussiononsets.csv
+
+for excerpt in 1 2 ; do
+    [ $(grep -c ",\"excerpt $excerpt[\":]" $tmpfile2) = $(wc -l < $expected) ] || \
+	faildiff "Wrong number of onsets labelled with excerpt $excerpt" $tmpfile2 $expected
+done
+
+head -$(wc -l < $expected) $tmpfile2 | sed 's/,[^,]*excerpt 1[^,]*$//' > $tmpfile1
+
+csvcompare $tmpfile1 $expected || \
+    faildiff "Output mismatch for first excerpt covering the whole file" $tmpfile1 $expected
+
+# An excerpt starting partway through, on a whole block so that the
+# block boundaries fall where they would for the whole file, and
+# covering the second and third onsets only. The first onset should
+# be dropped and the others should keep their whole-file timestamps
+
+$r -t $mypath/transforms/percussiononsets.n3 --excerpts 1.393197279 \
+    --excerpt-duration 1.5 -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with an excerpt starting partway through"
+
+[ $(grep -c ',"excerpt 1"$' $tmpfile2) = 2 ] && \
+    [ $(wc -l < $tmpfile2) = 2 ] || \
+    fail "Wrong number of onsets from an excerpt starting partway through"
+
+sed 's/,"excerpt 1"$//' $tmpfile2 > $tmpfile1
+sed -n '2,3p' $expected > $tmpfile2
+
+csvcompare_ignorefirst $tmpfile1 $tmpfile2 || \
+    faildiff "Output mismatch for an excerpt starting partway through" $tmpfile1 $tmpfile2
+
+# Check regions: a region covering the whole file, split in two
+# overlapping parts, should give the same onsets as the whole file
+# does, labelled with the joined region; a file with no regions
+# listed should give none
+
+regions=$tmpdir/regions.txt
+( echo "# file,start,end" ; echo "$infile,0,4" ; echo "$infile,2,60" ) > $regions
+
+$r -t $mypath/transforms/percussiononsets.n3 --regions-from $regions \
+    -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with --regions-from"
+
+expected=$mypath/expected/percussiononsets.csv
+
+[ $(grep -c ",\"region 0-[0-9.]*\"$" $tmpfile2) = $(wc -l < $expected) ] || \
+    faildiff "Wrong number of onsets labelled with the joined region" $tmpfile2 $expected
+
+sed 's/,"region 0-[0-9.]*"$//' $tmpfile2 > $tmpfile1
+
+csvcompare $tmpfile1 $expected || \
+    faildiff "Output mismatch for regions covering the whole file" $tmpfile1 $expected
+
+# Summaries are made for each region, so they are labelled too
+
+$r -t $mypath/transforms/percussiononsets.n3 --regions-from $regions \
+    -S count --summary-only -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with --regions-from and summaries"
+
+[ -s $tmpfile2 ] && ! grep -v "region 0-" $tmpfile2 > /dev/null || \
+    fail "Summaries for regions are missing or not labelled with their region"
+
+# Two separate regions, starting on whole blocks so that the block
+# boundaries fall where they would for the whole file, around the
+# first and third onsets only. The second onset lies in the gap and
+# should be dropped, and the others should have the same timestamps
+# as from the whole file, each labelled with its region
+
+( echo "$infile,0.464399093,1" ; echo "$infile,2.205895692,3" ) > $regions
+
+$r -t $mypath/transforms/percussiononsets.n3 --regions-from $regions \
+    -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with separate regions"
+
+[ $(grep -c ',"region 0\.46[0-9]*-1"$' $tmpfile2) = 1 ] && \
+    [ $(grep -c ',"region 2\.2[0-9]*-3"$' $tmpfile2) = 1 ] || \
+    fail "Wrong number of onsets labelled with each of two separate regions"
+
+sed 's/,"region [0-9.]*-[0-9.]*"$//' $tmpfile2 > $tmpfile1
+sed -n '1p;3p' $expected > $tmpfile2
+
+csvcompare $tmpfile1 $tmpfile2 || \
+    faildiff "Output mismatch for two separate regions" $tmpfile1 $tmpfile2
+
+echo "$audiopath/6clicks8.wav,0,60" > $regions
+
+$r -t $mypath/transforms/percussiononsets.n3 --regions-from $regions \
+    -w csv --csv-stdout $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with --regions-from for another file"
+
+[ ! -s $tmpfile2 ] || \
+    fail "Features extracted from a file with no regions listed"
+
+# A file with no regions listed shouldn't even be opened, so one that
+# can't be read is no obstacle, even without --force
+
+echo "not audio" > $tmpdir/unlisted.wav
+echo "$infile,0,60" > $regions
+
+$r -t $mypath/transforms/percussiononsets.n3 --regions-from $regions \
+    -w csv --csv-stdout $tmpdir/unlisted.wav $infile > $tmpfile2 2>/dev/null || \
+    fail "Fails to run transform with --regions-from and an unreadable file with no regions listed"
+
+[ -s $tmpfile2 ] || \
+    fail "No features extracted from the listed file alongside an unreadable one with no regions"
+
 exit 0
 